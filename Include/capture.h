@@ -0,0 +1,187 @@
+#pragma once
+#include "plugin.h"
+#include "libobs/obs-encoder.h"
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace VFW {
+	// Growable memory-mapped file. Writable files are grown in chunks and
+	// truncated to the written size when closed, read-only files are mapped
+	// as a whole.
+	class MappedFile {
+		public:
+		MappedFile(const std::string& path, bool writable);
+		~MappedFile();
+
+		uint8_t* data();
+		size_t size();
+		void reserve(size_t size);
+		void append(const void* data, size_t size);
+		void pad(size_t alignment);
+		void reset();
+		void discard(size_t size);
+
+		private:
+		void map(size_t capacity);
+		void unmap();
+
+		std::string m_path;
+		bool m_writable;
+	#ifdef _WIN32
+		HANDLE m_file, m_mapping;
+	#else
+		int m_file;
+	#endif
+		uint8_t* m_view;
+		size_t m_size, m_capacity;
+	};
+
+	#define CAPTURE_MAGIC		0x43574656 // 'VFWC'
+	#define CAPTURE_VERSION		1
+	#define CAPTURE_ALIGNMENT	64
+
+	struct CaptureHeader {
+		uint32_t magic, version;
+		uint32_t width, height;
+		uint32_t fpsNum, fpsDen;
+		uint32_t format, planes;
+	};
+
+	struct CaptureFrameHeader {
+		int64_t pts;
+		uint64_t size; // Total record size, including this header and padding.
+		uint32_t linesize[MAX_AV_PLANES];
+		uint64_t offset[MAX_AV_PLANES]; // Relative to the record start.
+	};
+
+	// Records the encoder_frame stream handed to encode(). Frames are copied
+	// into a few reused buffers and written to the file on a thread of its
+	// own, so that growing the file never holds up the caller.
+	class CaptureWriter {
+		public:
+		CaptureWriter(const std::string& path, uint32_t width, uint32_t height,
+			uint32_t fpsNum, uint32_t fpsDen, video_format format);
+		~CaptureWriter();
+
+		// Drops the frame if the writer is behind, throws once writing failed.
+		void write(struct encoder_frame* frame);
+		// Waits until all queued frames are written.
+		void finish();
+		size_t count();
+		size_t dropped();
+
+		private:
+		struct record_t {
+			CaptureFrameHeader header;
+			std::vector<uint8_t> data; // Record without the header, as written.
+		};
+
+		void writerMain();
+
+		MappedFile m_file;
+		CaptureHeader m_header;
+		uint32_t m_heights[MAX_AV_PLANES];
+
+		std::mutex m_lock;
+		std::condition_variable m_cv;
+		std::thread m_writer;
+		bool m_shutdown, m_failed;
+		std::deque<std::unique_ptr<record_t>> m_queue, m_free;
+		size_t m_count, m_dropped;
+	};
+
+	// Provides random access to a file created by CaptureWriter.
+	class CaptureReader {
+		public:
+		CaptureReader(const std::string& path);
+
+		const CaptureHeader& header();
+		size_t count();
+		void read(size_t index, struct encoder_frame* frame);
+
+		private:
+		MappedFile m_file;
+		CaptureHeader m_header;
+		std::vector<size_t> m_offsets;
+	};
+
+	// Provides random access to raw video: YUV4MPEG2 (4:2:0 and 4:4:4), or
+	// headerless I420 and BGRA with the geometry given by the caller.
+	class RawReader {
+		public:
+		RawReader(const std::string& path, uint32_t width = 0, uint32_t height = 0,
+			uint32_t fpsNum = 0, uint32_t fpsDen = 0, video_format format = VIDEO_FORMAT_NONE);
+
+		const CaptureHeader& header();
+		size_t count();
+		void read(size_t index, struct encoder_frame* frame);
+
+		private:
+		void parseY4M();
+
+		MappedFile m_file;
+		CaptureHeader m_header;
+		uint32_t m_heights[MAX_AV_PLANES], m_bytes[MAX_AV_PLANES];
+		std::vector<size_t> m_offsets;
+	};
+
+	// Writes packets of a single video stream into an AVI file: The first
+	// RIFF carries a legacy idx1 index, further AVIX RIFFs follow OpenDML, so
+	// that files can grow past 4 GB. Frames without a packet are written as
+	// empty chunks, which players show as a repeat of the previous frame.
+	class AVIWriter {
+		public:
+		// Format is the BITMAPINFO of the packets as the codec reports it,
+		// handler the FourCC of the codec.
+		AVIWriter(const std::string& path, const std::vector<char>& format, uint32_t handler,
+			uint32_t width, uint32_t height, uint32_t fpsNum, uint32_t fpsDen);
+		~AVIWriter();
+
+		// Packets come in frame order, with the frame number as pts.
+		void write(const struct encoder_packet* packet);
+		// Writes the indexes and completes the headers, throws if that failed.
+		void finish();
+
+		private:
+		struct chunk_t {
+			uint64_t offset; // Of the chunk header.
+			uint32_t size;
+			bool keyframe;
+		};
+		struct segment_t {
+			uint64_t offset; // Of the ix00 chunk header.
+			uint32_t size, frames;
+		};
+
+		void writeChunk(const void* data, uint32_t size, bool keyframe);
+		void beginSegment();
+		void endSegment();
+		void patch(uint64_t offset, const void* data, size_t size);
+		void patch(uint64_t offset, uint32_t value);
+
+		std::ofstream m_file;
+		uint64_t m_offset; // Where the next chunk goes.
+		uint64_t m_avihOffset, m_strhOffset, m_indxOffset, m_dmlhOffset;
+		uint64_t m_riffOffset, m_moviOffset; // Of the current RIFF and its movi LIST.
+		std::vector<chunk_t> m_chunks; // Current RIFF only.
+		std::vector<segment_t> m_segments;
+		uint32_t m_fpsNum, m_fpsDen;
+		uint64_t m_frames, m_bytes;
+		uint32_t m_legacyFrames, m_maxChunk;
+		bool m_finished;
+	};
+
+	void GetPlaneHeights(video_format format, uint32_t height, uint32_t (&heights)[MAX_AV_PLANES]);
+	void GetPlaneRowBytes(video_format format, uint32_t width, uint32_t (&bytes)[MAX_AV_PLANES]);
+};
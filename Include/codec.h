@@ -0,0 +1,109 @@
+#pragma once
+#include "plugin.h"
+#include "libobs/obs-encoder.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+// VFW
+#ifdef _WIN32
+#define COMPMAN
+#define VIDEO
+#define MMREG
+#include <windows.h>
+extern "C" {
+	#include <Vfw.h>
+	#include <vfwext.h>
+	#include <vfwmsgs.h>
+};
+#else
+#include "compat.h"
+#endif
+
+std::string FormattedICCError(LRESULT error);
+
+namespace VFW {
+	struct Info {
+		std::string Id;
+		std::string Name;
+		std::string Path;
+		ICINFO icInfo;
+		ICINFO icInfo2;
+		size_t index;
+		obs_encoder_info obsInfo;
+
+		std::string FourCC, FourCC2;
+		std::vector<uint8_t> stateInfo;
+
+		int32_t defaultQuality;
+		int32_t defaultKeyframeRate;
+		bool hasConfigure, hasAbout;
+	};
+
+	struct CodecSettings {
+		uint32_t width, height;
+		UINT mode; // Preferred compression mode, the other one is the fallback.
+		bool sequential;
+		uint32_t keyframeInterval, bitrate, quality;
+		std::vector<uint8_t> state; // Copy of Info::stateInfo, which Configure may change.
+	};
+
+	// An opened, configured and started codec instance.
+	class Codec {
+		public:
+		Codec(VFW::Info* info, const CodecSettings& settings);
+		~Codec();
+
+		VFW::Info* info();
+		const CodecSettings& settings();
+		HIC handle();
+		UINT mode();
+		COMPVARS* compVars();
+		BITMAPINFO* inputFormat();
+		BITMAPINFO* outputFormat();
+		size_t outputFormatSize(); // Including whatever the codec appends to the header.
+		size_t maxOutputSize();
+
+		private:
+		VFW::Info* myInfo;
+		CodecSettings m_settings;
+		HIC hIC;
+		COMPVARS cv;
+		UINT m_mode;
+		std::vector<char>
+			m_bufferInputBitmapInfo,
+			m_bufferOutputBitmapInfo;
+		BITMAPINFO
+			*m_inputBitmapInfo,
+			*m_outputBitmapInfo;
+		size_t m_maxOutputSize;
+		bool m_started;
+	};
+
+	// Keeps a started instance around for recently used configurations and
+	// opens and closes instances on a background thread, so that encoders do
+	// not wait for the driver when starting or stopping.
+	class CodecPool {
+		public:
+		// Takes a warm instance if there is one, otherwise opens a new one.
+		// Only waits (briefly) for tasks posted for the same codec if the
+		// driver refuses to open another instance.
+		static std::shared_ptr<Codec> acquire(VFW::Info* info, const CodecSettings& settings);
+
+		// Closes the instance and warms up a new one in its place, unless
+		// other tasks are waiting.
+		static void release(std::shared_ptr<Codec> codec);
+
+		// Runs a task on one of the background threads.
+		static void post(VFW::Info* info, std::function<void()> task);
+
+		// Finishes all tasks and closes all warm instances.
+		static void shutdown();
+	};
+
+	// Installs a stand-in codec for this process, which copies frames as
+	// they are (FourCC 'FAKE', intra-only). Call before VFW::Initialize().
+	bool InstallFakeCodec();
+};
@@ -0,0 +1,268 @@
+#pragma once
+// The parts of Windows and Video for Windows that the encoder uses, for
+// building the tools on other platforms. Drivers are installed in-process
+// with ICInstall (see InstallFakeCodec), the IC* calls go to their driver
+// procedure just like they do on Windows.
+#ifndef _WIN32
+#include <stdint.h>
+#include <stddef.h>
+#include <strings.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef unsigned int UINT;
+typedef int BOOL;
+typedef intptr_t LRESULT;
+typedef intptr_t LPARAM;
+typedef uintptr_t DWORD_PTR;
+typedef void* LPVOID;
+typedef char* LPSTR;
+typedef wchar_t WCHAR;
+typedef void* HWND;
+typedef void* HDRVR;
+typedef struct HIC__* HIC;
+
+#define TRUE 1
+#define FALSE 0
+#define CALLBACK
+#define UNREFERENCED_PARAMETER(P) (void)(P)
+#define sprintf_s snprintf
+#define _stricmp strcasecmp
+
+// Templates instead of the macros of windows.h, which would break the
+// standard library headers included after them.
+template<typename A, typename B>
+inline typename std::common_type<A, B>::type max(A a, B b) {
+	return (a > b) ? a : b;
+}
+template<typename A, typename B>
+inline typename std::common_type<A, B>::type min(A a, B b) {
+	return (a < b) ? a : b;
+}
+
+inline HWND GetDesktopWindow() {
+	return nullptr;
+}
+inline BOOL DeleteFileA(const char* path) {
+	return std::remove(path) == 0;
+}
+
+// Thread priorities are left to the scheduler.
+#define THREAD_PRIORITY_LOWEST -2
+inline void* GetCurrentThread() {
+	return nullptr;
+}
+inline BOOL SetThreadPriority(void*, int) {
+	return TRUE;
+}
+
+#define mmioFOURCC(ch0, ch1, ch2, ch3) \
+	(DWORD(BYTE(ch0)) | (DWORD(BYTE(ch1)) << 8) | (DWORD(BYTE(ch2)) << 16) | (DWORD(BYTE(ch3)) << 24))
+
+#define BI_RGB 0
+
+struct BITMAPINFOHEADER {
+	DWORD biSize;
+	LONG biWidth, biHeight;
+	WORD biPlanes, biBitCount;
+	DWORD biCompression, biSizeImage;
+	LONG biXPelsPerMeter, biYPelsPerMeter;
+	DWORD biClrUsed, biClrImportant;
+};
+typedef BITMAPINFOHEADER* LPBITMAPINFOHEADER;
+
+struct RGBQUAD {
+	BYTE rgbBlue, rgbGreen, rgbRed, rgbReserved;
+};
+
+struct BITMAPINFO {
+	BITMAPINFOHEADER bmiHeader;
+	RGBQUAD bmiColors[1];
+};
+typedef BITMAPINFO* LPBITMAPINFO;
+
+// Drivers
+#define DRV_LOAD		1
+#define DRV_ENABLE		2
+#define DRV_OPEN		3
+#define DRV_CLOSE		4
+#define DRV_DISABLE		5
+#define DRV_FREE		6
+#define DRV_CONFIGURE		7
+#define DRV_QUERYCONFIGURE	8
+#define DRV_INSTALL		9
+#define DRV_REMOVE		10
+#define DRV_USER		0x4000
+#define DRV_OK			1
+typedef LRESULT (*DRIVERPROC)(DWORD_PTR, HDRVR, UINT, LPARAM, LPARAM);
+
+#define ICTYPE_VIDEO		mmioFOURCC('v', 'i', 'd', 'c')
+#define ICVERSION		0x0104
+#define ICINSTALL_FUNCTION	0x0001
+
+#define ICERR_OK		0
+#define ICERR_UNSUPPORTED	-1
+#define ICERR_BADFORMAT		-2
+#define ICERR_MEMORY		-3
+#define ICERR_INTERNAL		-4
+#define ICERR_BADFLAGS		-5
+#define ICERR_BADPARAM		-6
+#define ICERR_BADSIZE		-7
+#define ICERR_BADHANDLE		-8
+#define ICERR_CANTUPDATE	-9
+#define ICERR_ABORT		-10
+#define ICERR_ERROR		-100
+#define ICERR_BADBITDEPTH	-200
+#define ICERR_BADIMAGESIZE	-201
+#define ICERR_CUSTOM		-400
+
+#define ICMODE_COMPRESS		1
+#define ICMODE_DECOMPRESS	2
+#define ICMODE_QUERY		4
+#define ICMODE_FASTCOMPRESS	5
+
+#define VIDCF_QUALITY		0x0001
+#define VIDCF_CRUNCH		0x0002
+#define VIDCF_TEMPORAL		0x0004
+#define VIDCF_FASTTEMPORALC	0x0020
+
+#define ICCOMPRESS_KEYFRAME	0x00000001
+#define ICDECOMPRESS_NOTKEYFRAME 0x08000000
+#define AVIIF_KEYFRAME		0x00000010
+#define ICMF_COMPVARS_VALID	0x00000001
+#define ICMF_CONFIGURE_QUERY	0x00000001
+#define ICMF_ABOUT_QUERY	0x00000001
+
+#define ICM_USER			(DRV_USER + 0x0000)
+#define ICM_RESERVED			(DRV_USER + 0x1000)
+#define ICM_GETSTATE			(ICM_RESERVED + 0)
+#define ICM_SETSTATE			(ICM_RESERVED + 1)
+#define ICM_GETINFO			(ICM_RESERVED + 2)
+#define ICM_CONFIGURE			(ICM_RESERVED + 10)
+#define ICM_ABOUT			(ICM_RESERVED + 11)
+#define ICM_GETDEFAULTQUALITY		(ICM_RESERVED + 30)
+#define ICM_COMPRESS_GET_FORMAT		(ICM_USER + 4)
+#define ICM_COMPRESS_GET_SIZE		(ICM_USER + 5)
+#define ICM_COMPRESS_QUERY		(ICM_USER + 6)
+#define ICM_COMPRESS_BEGIN		(ICM_USER + 7)
+#define ICM_COMPRESS			(ICM_USER + 8)
+#define ICM_COMPRESS_END		(ICM_USER + 9)
+#define ICM_DECOMPRESS_GET_FORMAT	(ICM_USER + 10)
+#define ICM_DECOMPRESS_QUERY		(ICM_USER + 11)
+#define ICM_DECOMPRESS_BEGIN		(ICM_USER + 12)
+#define ICM_DECOMPRESS			(ICM_USER + 13)
+#define ICM_DECOMPRESS_END		(ICM_USER + 14)
+#define ICM_GETDEFAULTKEYFRAMERATE	(ICM_USER + 42)
+
+struct ICINFO {
+	DWORD dwSize;
+	DWORD fccType, fccHandler;
+	DWORD dwFlags, dwVersion, dwVersionICM;
+	WCHAR szName[16];
+	WCHAR szDescription[128];
+	WCHAR szDriver[128];
+};
+
+struct ICOPEN {
+	DWORD dwSize;
+	DWORD fccType, fccHandler;
+	DWORD dwVersion, dwFlags;
+	LRESULT dwError;
+	LPVOID pV1Reserved, pV2Reserved;
+	DWORD dnDevNode;
+};
+
+struct ICCOMPRESS {
+	DWORD dwFlags;
+	LPBITMAPINFOHEADER lpbiOutput;
+	LPVOID lpOutput;
+	LPBITMAPINFOHEADER lpbiInput;
+	LPVOID lpInput;
+	DWORD* lpckid;
+	DWORD* lpdwFlags;
+	LONG lFrameNum;
+	DWORD dwFrameSize, dwQuality;
+	LPBITMAPINFOHEADER lpbiPrev;
+	LPVOID lpPrev;
+};
+
+struct ICDECOMPRESS {
+	DWORD dwFlags;
+	LPBITMAPINFOHEADER lpbiInput;
+	LPVOID lpInput;
+	LPBITMAPINFOHEADER lpbiOutput;
+	LPVOID lpOutput;
+	DWORD ckid;
+};
+
+struct COMPVARS {
+	LONG cbSize;
+	DWORD dwFlags;
+	HIC hic;
+	DWORD fccType, fccHandler;
+	LPBITMAPINFO lpbiIn, lpbiOut;
+	LPVOID lpBitsOut, lpBitsPrev;
+	LONG lFrame, lKey, lDataRate, lQ, lKeyCount;
+	LPVOID lpState;
+	LONG cbState;
+};
+
+// Implemented in codec.cpp.
+BOOL ICInstall(DWORD fccType, DWORD fccHandler, LPARAM lParam, LPSTR szDesc, UINT wFlags);
+BOOL ICInfo(DWORD fccType, DWORD fccHandler, ICINFO* lpicinfo);
+HIC ICOpen(DWORD fccType, DWORD fccHandler, UINT wMode);
+LRESULT ICClose(HIC hic);
+LRESULT ICGetInfo(HIC hic, ICINFO* picinfo, DWORD cb);
+LRESULT ICSendMessage(HIC hic, UINT msg, DWORD_PTR dw1, DWORD_PTR dw2);
+DWORD ICCompress(HIC hic, DWORD dwFlags, LPBITMAPINFOHEADER lpbiOutput, LPVOID lpData,
+	LPBITMAPINFOHEADER lpbiInput, LPVOID lpBits, DWORD* lpckid, DWORD* lpdwFlags,
+	LONG lFrameNum, DWORD dwFrameSize, DWORD dwQuality, LPBITMAPINFOHEADER lpbiPrev, LPVOID lpPrev);
+DWORD ICDecompress(HIC hic, DWORD dwFlags, LPBITMAPINFOHEADER lpbiFormat, LPVOID lpData,
+	LPBITMAPINFOHEADER lpbi, LPVOID lpBits);
+
+#define ICCompressBegin(hic, lpbiInput, lpbiOutput) \
+	ICSendMessage(hic, ICM_COMPRESS_BEGIN, (DWORD_PTR)(LPVOID)(lpbiInput), (DWORD_PTR)(LPVOID)(lpbiOutput))
+#define ICCompressEnd(hic) \
+	ICSendMessage(hic, ICM_COMPRESS_END, 0, 0)
+#define ICCompressGetSize(hic, lpbiInput, lpbiOutput) \
+	(DWORD)ICSendMessage(hic, ICM_COMPRESS_GET_SIZE, (DWORD_PTR)(LPVOID)(lpbiInput), (DWORD_PTR)(LPVOID)(lpbiOutput))
+#define ICDecompressQuery(hic, lpbiInput, lpbiOutput) \
+	ICSendMessage(hic, ICM_DECOMPRESS_QUERY, (DWORD_PTR)(LPVOID)(lpbiInput), (DWORD_PTR)(LPVOID)(lpbiOutput))
+#define ICDecompressBegin(hic, lpbiInput, lpbiOutput) \
+	ICSendMessage(hic, ICM_DECOMPRESS_BEGIN, (DWORD_PTR)(LPVOID)(lpbiInput), (DWORD_PTR)(LPVOID)(lpbiOutput))
+#define ICDecompressEnd(hic) \
+	ICSendMessage(hic, ICM_DECOMPRESS_END, 0, 0)
+#define ICGetState(hic, pv, cb) \
+	ICSendMessage(hic, ICM_GETSTATE, (DWORD_PTR)(LPVOID)(pv), (DWORD_PTR)(cb))
+#define ICSetState(hic, pv, cb) \
+	ICSendMessage(hic, ICM_SETSTATE, (DWORD_PTR)(LPVOID)(pv), (DWORD_PTR)(cb))
+#define ICGetStateSize(hic) \
+	(DWORD)ICGetState(hic, NULL, 0)
+#define ICQueryConfigure(hic) \
+	(ICSendMessage(hic, ICM_CONFIGURE, (DWORD_PTR)-1, ICMF_CONFIGURE_QUERY) == ICERR_OK)
+#define ICConfigure(hic, hwnd) \
+	ICSendMessage(hic, ICM_CONFIGURE, (DWORD_PTR)(hwnd), 0)
+#define ICQueryAbout(hic) \
+	(ICSendMessage(hic, ICM_ABOUT, (DWORD_PTR)-1, ICMF_ABOUT_QUERY) == ICERR_OK)
+#define ICAbout(hic, hwnd) \
+	ICSendMessage(hic, ICM_ABOUT, (DWORD_PTR)(hwnd), 0)
+
+inline DWORD ICGetDefaultQuality(HIC hic) {
+	DWORD value = 0;
+	ICSendMessage(hic, ICM_GETDEFAULTQUALITY, (DWORD_PTR)(LPVOID)&value, sizeof(DWORD));
+	return value;
+}
+inline DWORD ICGetDefaultKeyFrameRate(HIC hic) {
+	DWORD value = 0;
+	ICSendMessage(hic, ICM_GETDEFAULTKEYFRAMERATE, (DWORD_PTR)(LPVOID)&value, 0);
+	return value;
+}
+#endif
@@ -1,5 +1,10 @@
 #pragma once
 #include "plugin.h"
+#include "codec.h"
+#include "capture.h"
+#include "trace.h"
+#include "kernels.h"
+#include "quality.h"
 #include "libobs/obs-encoder.h"
 
 #include <string>
@@ -7,39 +12,57 @@
 #include <fstream>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <queue>
-
-// VFW
-#define COMPMAN
-#define VIDEO
-#define MMREG
-#include <windows.h>
-extern "C" {
-	#include <Vfw.h>
-	#include <vfwext.h>
-	#include <vfwmsgs.h>
-};
+#include <deque>
 
 namespace VFW {
-	struct Info {
-		std::string Id;
-		std::string Name;
-		std::string Path;
-		ICINFO icInfo;
-		ICINFO icInfo2;
-		size_t index;
-		obs_encoder_info obsInfo;
-
-		std::string FourCC, FourCC2;
-		std::vector<uint8_t> stateInfo;
-
-		int32_t defaultQuality;
-		int32_t defaultKeyframeRate;
-		bool hasConfigure, hasAbout;
+	// Bytes held by frame and packet buffers.
+	struct MemoryUsage {
+		MemoryUsage();
+		void add(int64_t bytes);
+		void remove(int64_t bytes);
+
+		std::atomic<int64_t> current, peak;
+	};
+
+	// Time spent by the encode worker inside the codec. A worker that got
+	// abandoned keeps its own reference, as it may outlive the encoder.
+	struct Watchdog {
+		Watchdog();
+		uint64_t begin();
+		bool end(uint64_t generation);
+		bool expire(int64_t timeout);
+		uint64_t current();
+
+		std::mutex lock;
+		uint64_t generation;
+		bool busy;
+		std::chrono::high_resolution_clock::time_point started;
+	};
+
+	// A frame that several encoders on the same video output take, which
+	// only the first one to get to it pre-processes.
+	struct SharedFrame {
+		enum State {
+			Pending,
+			Working,
+			Done
+		};
+
+		SharedFrame();
+
+		std::mutex lock;
+		std::condition_variable cv;
+		State state;
+		uint32_t complexity;
 	};
+
 	bool Initialize();
 	bool Finalize();
+	VFW::Info* GetInfo(const std::string& id);
 
 	class Encoder {
 		public:
@@ -49,10 +72,13 @@ namespace VFW {
 		static obs_properties_t* get_properties(void *data);
 		static bool cb_configure(obs_properties_t *pr, obs_property_t *p, void *data);
 		static bool cb_about(obs_properties_t *pr, obs_property_t *p, void *data);
+		static bool cb_benchmark(obs_properties_t *pr, obs_property_t *p, void *data);
 		static bool cb_modified(obs_properties_t *pr, obs_property_t *p, obs_data_t *data);
 
 		static void* create(obs_data_t *settings, obs_encoder_t *encoder);
 		Encoder(obs_data_t *settings, obs_encoder_t *encoder);
+		Encoder(VFW::Info* info, obs_data_t *settings,
+			uint32_t width, uint32_t height, uint32_t fpsNum, uint32_t fpsDen);
 
 		static void destroy(void* data);
 		~Encoder();
@@ -60,9 +86,24 @@ namespace VFW {
 		static bool encode(void *data, struct encoder_frame *frame, struct encoder_packet *packet, bool *received_packet);
 		bool encode(struct encoder_frame *frame, struct encoder_packet *packet, bool *received_packet);
 
+		// Offline encoding (enc-vfw-transcode): Blocks until the frame is
+		// queued instead of dropping it when the codec falls behind, with no
+		// time budget and no frames skipped to catch up. Returns whether the
+		// frame was taken; a packet may be handed out either way. Without a
+		// frame it drains like encode().
+		bool encodeOffline(struct encoder_frame *frame, struct encoder_packet *packet, bool *received_packet);
+
+		// Format of the packets as a BITMAPINFO, for writing them to a file.
+		// Call before the first frame, the governor may replace the codec.
+		std::vector<char> outputFormat();
+
 		static bool update(void *data, obs_data_t *settings);
 		bool update(obs_data_t* settings);
 
+		// H.264 only. VFW has no way to ask the codec for its parameter sets,
+		// so there is nothing to hand out until the first packet that carries
+		// them (normally the first keyframe) has been post-processed. Until
+		// OBS got them, packets keep their inline copies.
 		static bool get_extra_data(void *data, uint8_t **extra_data, size_t *size);
 		bool get_extra_data(uint8_t** extra_data, size_t* size);
 
@@ -72,34 +113,105 @@ namespace VFW {
 		static void get_video_info(void *data, struct video_scale_info *info);
 		void get_video_info(struct video_scale_info *info);
 		
+		// Data Vector, Frame, Keyframe, Complexity
+		typedef std::tuple<std::shared_ptr<std::vector<char>>, int64_t, bool, uint32_t> frame_t;
+
 		static void threadMain(void *data, int32_t flag);
 		void threadLocal(int32_t flag);
 		void preProcessLocal(std::unique_lock<std::mutex>& ul);
 		void encodeLocal(std::unique_lock<std::mutex>& ul);
 		void postProcessLocal(std::unique_lock<std::mutex>& ul);
 
+		// Waits for all queued frames and retrieves delayed frames from the
+		// codec, the packets can then be read with encode() without a frame,
+		// which also flushes by itself if frames were encoded since.
+		void flush();
+
+		// Simulcast: Rungs are fed already flipped and scaled frames, which
+		// consumers hand out with encodeSimulcast(). A rung is drained when
+		// its consumer or its source is, and takes no frames meanwhile.
+		bool submitPreprocessed(std::shared_ptr<std::vector<char>> buffer, int64_t pts, uint32_t complexity, bool sceneCut);
+		bool encodeSimulcast(struct encoder_frame* frame, struct encoder_packet* packet, bool* received_packet);
+		bool encodeRung(bool drain, struct encoder_packet* packet, bool* received_packet);
+		void flushRung();
+
+		// Native formats are written straight from the frame OBS hands us,
+		// without ever opening the driver.
+		bool encodeNative(struct encoder_frame* frame, struct encoder_packet* packet, bool* received_packet);
+
+		std::shared_ptr<std::vector<char>> acquireInput(struct encoder_frame* frame, std::shared_ptr<VFW::SharedFrame>& shared);
+		std::shared_ptr<std::vector<char>> acquireIncremental(struct encoder_frame* frame);
+		uint32_t preProcessFrame(std::shared_ptr<std::vector<char>>& buffer, int64_t pts, std::shared_ptr<VFW::SharedFrame> shared, bool& sceneCut);
+		bool detectSceneCut(const std::shared_ptr<std::vector<char>>& buffer);
+		bool encodeFrame(frame_t& kv);
+		template<bool forceKeyframes>
+		bool finishFrame(frame_t& kv, std::shared_ptr<std::vector<char>>& outbuf, bool isKeyframe);
+		bool flushFrame(frame_t& kv);
+		bool failFrame(frame_t& kv);
+		void sampleQuality(int64_t pts, const std::shared_ptr<std::vector<char>>& outbuf, bool isKeyframe);
+		void updateGovernor(bool makeKeyframe);
+		void closeLater(std::shared_ptr<VFW::Codec>& codec);
+		uint32_t updateRateControl(uint32_t complexity, bool makeKeyframe);
+		void trackRateControl(size_t bytes, uint32_t complexity, bool isKeyframe);
+		void checkWatchdog();
+		void abandonWorker();
+
+		std::shared_ptr<std::vector<char>> allocateBuffer(size_t size);
+		std::shared_ptr<std::vector<char>> allocateBuffer(const void* data, size_t size);
+		bool isMemoryAvailable(int64_t bytes);
+		void logStatistics();
+		void postProcessFrame(frame_t& kv);
+		void postProcessH264(frame_t& kv);
+
+		// Encode and post-process variants for every compression mode and
+		// codec quirk, picked once in the constructor. Mode, quality flag,
+		// Force Keyframes and quirk are template parameters and are not
+		// checked per frame. Keyframe decisions, the previous frame for
+		// Sequential and the error policy still are.
+		enum CompressPath {
+			PathNormal,
+			PathTemporal,
+			PathSequential
+		};
+		enum PostProcessQuirk {
+			QuirkNone,
+			QuirkMatroxMPEG2,
+			QuirkH264
+		};
+		typedef bool (Encoder::*encode_variant_t)(frame_t& kv);
+		typedef void (Encoder::*postprocess_variant_t)(frame_t& kv);
+		template<CompressPath path, bool useQuality, bool forceKeyframes>
+		bool encodeVariant(frame_t& kv);
+		template<PostProcessQuirk quirk>
+		void postProcessVariant(frame_t& kv);
+		static encode_variant_t selectEncodeVariant(CompressPath path, bool useQuality, bool forceKeyframes);
+		static CompressPath selectPath(const char* mode);
+		void getPacket(frame_t& kv, struct encoder_packet* packet);
+		void queuePacket(frame_t& kv);
+		bool takePacket(struct encoder_packet* packet, size_t keep);
+		void unspillPackets();
+
+		void updateTiming(std::atomic<int64_t>& average, std::chrono::high_resolution_clock::time_point start);
+		void updateTopology(int64_t frameTime);
+
 		private:
 		VFW::Info* myInfo;
-		HIC hIC;
-		COMPVARS cv;
-		std::vector<char>
-			m_bufferInput,
-			m_bufferInputBitmapInfo,
-			m_bufferPrevInput,
-			m_bufferPrevInputBitmapInfo,
-			m_bufferOutput,
-			m_bufferOutputBitmapInfo;
-		BITMAPINFO 
-			*m_inputBitmapInfo,
-			*m_prevInputBitmapInfo,
-			*m_outputBitmapInfo;
+		VFW::CodecSettings m_codecSettings;
+		std::shared_ptr<VFW::Codec> m_codec;
+		encode_variant_t m_encodeVariant;
+		postprocess_variant_t m_postProcessVariant;
+		VFW::Kernel::MPEG2FrameRate m_mpeg2FrameRate; // QuirkMatroxMPEG2 only.
+		uint32_t m_compressBitrate; // Zero if the codec does not take one.
+		std::shared_ptr<std::vector<char>> m_prevInput; // Temporal, and Sequential with m_sequentialPrev.
+		bool m_sequentialPrev; // Codec compares against the previous frame itself.
 
 		uint32_t 
 			m_width, m_height,
 			m_fpsNum, m_fpsDen,
 			m_keyframeInterval,
 			m_bitrate, m_quality,
-			m_latency, m_maxQueueSize;
+			m_latency, m_maxQueueSize,
+			m_decimation; // Only every n-th frame is encoded, m_fpsDen is already divided.
 		bool
 			m_useNormalCompress,
 			m_useTemporalFlag,
@@ -111,14 +223,147 @@ namespace VFW {
 			std::thread worker;
 			std::mutex lock;
 			std::condition_variable cv;
-			// Data Vector, Frame, Keyframe
-			std::queue<std::tuple<std::shared_ptr<std::vector<char>>, int64_t, bool>> data;
+			std::queue<frame_t> data;
 		} m_preProcessData,
 			m_encodeData,
 			m_postProcessData;		
+		std::queue<std::shared_ptr<VFW::SharedFrame>> m_preProcessShared; // Next to m_preProcessData.data
+		uint64_t m_framesShared;
+
+		// Incremental Input: Input buffers are reused once nothing refers to
+		// them anymore, and remember the hash of every row they hold, so only
+		// rows that changed since are copied (and flipped) into them.
+		struct incremental_t {
+			std::shared_ptr<std::vector<char>> buffer;
+			std::vector<uint64_t> hashes; // By source row.
+			uint64_t used;
+		};
+		bool m_incremental;
+		std::vector<incremental_t> m_incrementalBuffers;
+		std::vector<uint64_t> m_incrementalHashes;
+		uint64_t m_incrementalUses, m_incrementalRows, m_incrementalRowsCopied;
 		std::mutex m_finalPacketsLock;
-		std::queue<std::tuple<std::shared_ptr<std::vector<char>>, int64_t, bool>> m_finalPackets;
+		std::queue<frame_t> m_finalPackets;
 		bool m_threadShutdown;
+
+		// Packet Spill: While more packets than the threshold are in memory,
+		// new ones wait in a mapped file behind them, and come back as soon
+		// as there is room. The file and m_spilled are under m_spillLock,
+		// which is taken before m_finalPacketsLock, never after it.
+		struct spill_t {
+			size_t offset, size;
+			int64_t pts;
+			bool keyframe;
+		};
+		std::string m_spillPath;
+		size_t m_spillThreshold;
+		std::mutex m_spillLock;
+		std::unique_ptr<VFW::MappedFile> m_spillFile;
+		std::deque<spill_t> m_spilled;
+		std::atomic<size_t> m_spilledCount; // Size of m_spilled, changed under both locks.
+		uint64_t m_spillPackets, m_spillBytes, m_spillCompactions;
+		size_t m_spillPeak;
+
+		// Backlog Catch-up: Packets queued beyond the latency outlive the stall
+		// that caused them, so input frames are skipped until they are gone.
+		uint64_t m_backlogDepth, m_backlogPeak, m_backlogSkipped;
+		uint32_t m_backlogFrames; // Calls in a row with too many packets queued.
+
+		// Inline encoding runs all stages on the caller thread, which is
+		// picked automatically for zero latency if the stages are fast enough.
+		bool m_inline;
+		std::atomic<int64_t> m_timePreProcess, m_timeEncode, m_timePostProcess;
+		std::atomic<uint64_t> m_timingSamples;
+
+		// Frames passed to the codec that have no output yet: Frame, Keyframe, Complexity
+		std::deque<std::tuple<int64_t, bool, uint32_t>> m_pendingFrames;
+		size_t m_codecLag;
+		bool m_flushed; // Nothing was encoded since the last flush().
+
+		// Memory Accounting
+		std::shared_ptr<VFW::MemoryUsage> m_memory;
+		int64_t m_memoryLimit, m_moduleMemoryLimit;
+		uint64_t m_memoryRejected, m_statsFrames;
+
+		// A codec being opened on the pool thread, empty if that failed.
+		struct pending_codec_t {
+			std::mutex lock;
+			std::shared_ptr<VFW::Codec> codec;
+			bool done;
+		};
+
+		// CPU Budget Governor: A codec in the other compression mode is opened
+		// on the pool thread, and swapped in at the next keyframe once ready.
+		bool m_governor, m_governorModeLocked;
+		uint32_t m_governorQuality, m_governorCooldown;
+		UINT m_governorMode;
+		std::shared_ptr<pending_codec_t> m_governorCodec; // Replacement being opened.
+		uint64_t m_governorQualityChanges, m_governorModeChanges;
+
+		// Scene Cuts: Found during pre-processing by comparing luma histograms,
+		// and passed to encoding in the keyframe field of the frame.
+		bool m_sceneCut, m_sceneCutReset;
+		bool m_sceneHistogramValid;
+		uint32_t m_sceneHistogram[64];
+		int64_t m_lastKeyframe; // Frame of the last requested keyframe.
+		uint64_t m_sceneCuts;
+
+		// External Rate Control: A leaky bucket drained at the target rate,
+		// which steers the quality given to the codec.
+		bool m_rateControl;
+		uint32_t m_rateControlQuality;
+		double_t m_rateControlTarget, m_rateControlBuffer, m_rateControlFullness;
+		double_t m_rateControlRatio[2]; // Bits per complexity: Delta, Key
+		uint64_t m_rateControlBits, m_rateControlFrames, m_rateControlOverflows;
+
+		// Quality Sampling: Every n-th frame, or the first keyframe after it,
+		// is decoded again and compared to its input. Inputs of candidates are
+		// kept until their packet comes out of the codec.
+		std::unique_ptr<VFW::QualitySampler> m_qualitySampler;
+		uint32_t m_qualityInterval, m_qualitySince;
+		std::deque<std::pair<int64_t, std::shared_ptr<std::vector<char>>>> m_qualityInputs;
+
+		// Stall Watchdog
+		std::shared_ptr<VFW::Watchdog> m_watchdog;
+		int64_t m_watchdogTimeout;
+		bool m_watchdogPending;
+		std::shared_ptr<pending_codec_t> m_watchdogCodec; // Replacement being opened.
+		bool m_encodeStopped; // Encode worker left threadMain(), under m_encodeData.lock.
+		uint64_t m_watchdogStalls, m_watchdogRestarts;
+		std::atomic<bool> m_forceKeyframe;
+
+		// Compression Errors: What to emit instead of the failed frame, and
+		// how many failures in a row stop the encoder.
+		enum ErrorPolicy {
+			ErrorDrop,
+			ErrorRepeat,
+			ErrorKeyframe
+		};
+		ErrorPolicy m_errorPolicy;
+		uint32_t m_errorLimit, m_errorsConsecutive;
+		uint64_t m_errors;
+		std::atomic<bool> m_failed;
+		std::shared_ptr<std::vector<char>> m_lastGoodPacket; // Repeat only, as it left the codec.
+		bool m_lastGoodKeyframe;
 		std::shared_ptr<std::vector<char>> m_donotuse_datastor;
+
+		// H.264 parameter sets (Annex B) taken from the first packet that has
+		// them. Inline copies are only removed once OBS has been handed these.
+		std::mutex m_extraDataLock;
+		std::vector<uint8_t> m_extraData;
+		std::atomic<bool> m_extraDataServed;
+		bool m_extraDataMismatch;
+
+		std::unique_ptr<VFW::CaptureWriter> m_captureWriter;
+		std::shared_ptr<VFW::Tracer> m_tracer;
+
+		video_format m_native;
+		uint64_t m_nativeFrames;
+
+		std::string m_simulcastGroup, m_simulcastSource;
+		uint32_t m_simulcastSourceWidth, m_simulcastSourceHeight; // Rung a consumer hands out.
+		std::vector<std::shared_ptr<VFW::Encoder>> m_simulcastRungs;
+		std::shared_ptr<VFW::Encoder> m_simulcastRung;
+		std::mutex m_rungLock; // Held by a rung while it takes a frame, is drained or checks its codec.
 	};
 };
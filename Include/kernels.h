@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Per-frame image kernels. These only depend on the C++ runtime and SSE2 so
+// that they can be used outside of the plugin.
+namespace VFW {
+	namespace Kernel {
+		// Scales a BGRA image. Exact halving uses a box filter, every other
+		// ratio is bilinear.
+		void ScaleBGRA(const uint8_t* src, size_t srcStride, uint32_t srcWidth, uint32_t srcHeight,
+			uint8_t* dst, size_t dstStride, uint32_t dstWidth, uint32_t dstHeight);
+
+		void ScaleBGRABox2x(const uint8_t* src, size_t srcStride,
+			uint8_t* dst, size_t dstStride, uint32_t dstWidth, uint32_t dstHeight);
+		void ScaleBGRABilinear(const uint8_t* src, size_t srcStride, uint32_t srcWidth, uint32_t srcHeight,
+			uint8_t* dst, size_t dstStride, uint32_t dstWidth, uint32_t dstHeight);
+
+		// Converts limited range BT.601 YUV to BGRA. Chroma is subsampled by
+		// 1 << chromaShift in both directions, so 0 is 4:4:4 and 1 is 4:2:0.
+		void ConvertYUVToBGRA(const uint8_t* const planes[3], const size_t strides[3], uint32_t chromaShift,
+			uint8_t* dst, size_t dstStride, uint32_t width, uint32_t height);
+
+		// Rough measure of the detail in a BGRA image: The mean absolute
+		// difference between horizontally adjacent pixels on every fourth
+		// row, in 1/16th steps.
+		uint32_t EstimateComplexity(const uint8_t* src, size_t stride, uint32_t width, uint32_t height);
+
+		// Swaps the rows of an image in place, top to bottom.
+		void FlipRows(uint8_t* data, size_t stride, uint32_t height);
+
+		// Copies rows of rowBytes each into a tightly packed destination,
+		// as a single copy if the source has no padding.
+		void CopyPlane(const uint8_t* src, size_t srcStride, uint8_t* dst, size_t rowBytes, uint32_t height);
+
+		// Histogram of the approximate luma of a BGRA image in 64 bins, taken
+		// from every fourth pixel of every fourth row.
+		void LumaHistogram(const uint8_t* src, size_t stride, uint32_t width, uint32_t height, uint32_t(&histogram)[64]);
+
+		struct Quality {
+			double psnr; // dB, 100 if identical.
+			double ssim;
+		};
+
+		// PSNR and SSIM of the luma of two BGRA images, in 8x8 blocks. Rows
+		// and columns past the last whole block are not compared.
+		Quality CompareBGRA(const uint8_t* a, size_t strideA, const uint8_t* b, size_t strideB, uint32_t width, uint32_t height);
+
+		// 64-bit hash of the first rowBytes of every row, to find the rows
+		// that changed between two frames.
+		void HashRows(const uint8_t* src, size_t stride, size_t rowBytes, uint32_t height, uint64_t* hashes);
+
+		// Returns the position of the next 00 00 01 start code, or end.
+		const uint8_t* FindStartCode(const uint8_t* begin, const uint8_t* end);
+
+		// An MPEG-2 frame_rate_code, and the frame_rate_extension_n/_d that
+		// scale it by (n + 1) / (d + 1).
+		struct MPEG2FrameRate {
+			uint8_t code, extN, extD;
+		};
+
+		// Closest frame rate an MPEG-2 sequence header can signal.
+		MPEG2FrameRate FindMPEG2FrameRate(uint32_t fpsNum, uint32_t fpsDen);
+
+		// Rewrites the sequence headers and picture coding extensions of
+		// Matrox MPEG-2 output, which claim interlaced content at the wrong
+		// frame rate, as progressive frames at the given frame rate.
+		void FixMatroxMPEG2(uint8_t* data, size_t size, MPEG2FrameRate rate);
+	};
+};
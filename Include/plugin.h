@@ -38,6 +38,8 @@
 #define PROP_KEYFRAME_INTERVAL			"KeyframeInterval"
 #define PROP_KEYFRAME_INTERVAL2			"KeyframeInterval2"
 #define PROP_FORCE_KEYFRAMES			"ForceKeyframes"
+#define PROP_SCENE_CUT				"SceneCut"
+#define PROP_SCENE_CUT_RESET			"SceneCutReset"
 #define PROP_MODE				"Mode"
 #define PROP_MODE_NORMAL			"Mode.Normal"
 #define PROP_MODE_TEMPORAL			"Mode.Temporal"
@@ -46,4 +48,25 @@
 #define PROP_ICMODE_COMPRESS			"ICMode.Normal"
 #define PROP_ICMODE_FASTCOMPRESS		"ICMode.Fast"
 #define PROP_LATENCY				"Latency"
+#define PROP_DECIMATION				"Decimation"
+#define PROP_INCREMENTAL			"Incremental"
+#define PROP_GOVERNOR				"Governor"
+#define PROP_RATE_CONTROL			"RateControl"
+#define PROP_RATE_CONTROL_BITRATE		"RateControlBitrate"
+#define PROP_RATE_CONTROL_BUFFER		"RateControlBuffer"
+#define PROP_MEMORY_LIMIT			"MemoryLimit"
+#define PROP_MEMORY_LIMIT_GLOBAL		"MemoryLimitGlobal"
+#define PROP_WATCHDOG				"Watchdog"
+#define PROP_QUALITY_SAMPLING			"QualitySampling"
+#define PROP_ERROR_POLICY			"ErrorPolicy"
+#define PROP_ERROR_LIMIT			"ErrorLimit"
+#define PROP_NATIVE				"Native"
+#define PROP_CAPTURE_PATH			"CapturePath"
+#define PROP_TRACE_PATH				"TracePath"
+#define PROP_SPILL_PATH				"SpillPath"
+#define PROP_SPILL_THRESHOLD			"SpillThreshold"
+#define PROP_SIMULCAST_GROUP			"SimulcastGroup"
+#define PROP_SIMULCAST_RUNGS			"SimulcastRungs"
+#define PROP_SIMULCAST_SOURCE			"SimulcastSource"
+#define PROP_BENCHMARK				"Benchmark"
 #define PROP_ABOUT				"About"
\ No newline at end of file
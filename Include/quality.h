@@ -0,0 +1,53 @@
+#pragma once
+#include "codec.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace VFW {
+	// Decodes sampled packets with the decompressor of the same driver and
+	// compares them to the frame that was compressed, on a low priority
+	// thread. A sample that arrives while another one is measured, or once
+	// the time budget is used up, is skipped, so encoding never waits.
+	class QualitySampler {
+		public:
+		struct Statistics {
+			uint64_t samples, skipped, failed;
+			double_t psnr, ssim; // Averages of all samples.
+			double_t milliseconds; // Per sample, decoding and comparing.
+		};
+
+		QualitySampler(VFW::Info* info, BITMAPINFO* inputFormat, BITMAPINFO* outputFormat);
+		~QualitySampler();
+
+		// Takes a copy of the packet, false if it was skipped.
+		bool submit(const std::vector<char>& packet, const std::shared_ptr<std::vector<char>>& input);
+		Statistics statistics();
+
+		private:
+		void workerMain();
+
+		VFW::Info* myInfo;
+		HIC hIC;
+		std::vector<uint8_t> m_bufferPacketInfo, m_bufferFrameInfo;
+		BITMAPINFO* m_packetInfo;
+		BITMAPINFO* m_frameInfo;
+		std::vector<char> m_decoded;
+
+		std::mutex m_lock;
+		std::condition_variable m_cv;
+		std::thread m_worker;
+		bool m_shutdown, m_pending;
+		std::vector<char> m_packet;
+		std::shared_ptr<std::vector<char>> m_input;
+
+		std::chrono::steady_clock::time_point m_start;
+		int64_t m_busy; // Nanoseconds spent on samples.
+		uint64_t m_samples, m_skipped, m_failed;
+		double_t m_psnrSum, m_ssimSum;
+	};
+};
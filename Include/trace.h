@@ -0,0 +1,91 @@
+#pragma once
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace VFW {
+	// Records timed spans per frame and writes them as Chrome trace events,
+	// which chrome://tracing and Perfetto can load. Every thread records into
+	// its own buffer without locking, a background thread writes them out.
+	class Tracer {
+		public:
+		enum Queue {
+			QueuePreProcess,
+			QueueEncode,
+			QueuePostProcess,
+			QueuePackets,
+			QueueCount
+		};
+
+		Tracer(const std::string& path, const std::string& name);
+		~Tracer();
+
+		int64_t now();
+		void span(const char* name, int64_t pts, int64_t begin, int64_t end);
+		void nameThread(const char* name);
+
+		// Time spent waiting in a queue, from enqueue() until dequeue().
+		void enqueue(Queue queue, int64_t pts);
+		void dequeue(Queue queue, int64_t pts, const char* name);
+
+		private:
+		static const size_t chunk_events = 1024;
+		static const size_t queue_slots = 64;
+
+		struct Event {
+			const char* name;
+			int64_t pts, begin, end;
+		};
+		struct Chunk {
+			Chunk();
+			Event events[chunk_events];
+			std::atomic<size_t> count;
+			std::atomic<Chunk*> next;
+		};
+		struct Buffer {
+			uint32_t tid;
+			std::atomic<const char*> name;
+			const char* writtenName;
+			Chunk* head; // Only used by the writer.
+			size_t read;
+			Chunk* tail; // Only used by the recording thread.
+		};
+
+		Buffer* buffer();
+		void writerMain();
+		void write();
+
+		uint64_t m_serial;
+		std::chrono::steady_clock::time_point m_start;
+		std::atomic<int64_t> m_queued[QueueCount][queue_slots];
+
+		std::mutex m_lock;
+		std::vector<Buffer*> m_buffers;
+		std::ofstream m_file;
+
+		std::condition_variable m_writerCV;
+		std::thread m_writer;
+		bool m_shutdown;
+	};
+
+	// Records a span until the end of the scope. Without a tracer this is
+	// a single branch.
+	class TraceSpan {
+		public:
+		TraceSpan(const std::shared_ptr<Tracer>& tracer, const char* name, int64_t pts);
+		~TraceSpan();
+
+		private:
+		std::shared_ptr<Tracer> m_tracer;
+		const char* m_name;
+		int64_t m_pts, m_begin;
+	};
+};
@@ -0,0 +1,235 @@
+#include "kernels.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Measures the per-frame kernels on synthetic frames from 720p to 8K and on
+// synthetic MPEG-2 packets, and writes the results as JSON for comparing runs.
+// Only depends on the kernels, so it builds without OBS Studio or Windows.
+//
+// Usage: enc-vfw-benchmark [-o Results.json] [-t Seconds per Measurement]
+
+struct resolution_t {
+	const char* name;
+	uint32_t width, height;
+};
+
+static const resolution_t resolutions[] = {
+	{ "720p", 1280, 720 },
+	{ "1080p", 1920, 1080 },
+	{ "1440p", 2560, 1440 },
+	{ "2160p", 3840, 2160 },
+	{ "4320p", 7680, 4320 },
+};
+
+struct result_t {
+	std::string kernel, variant, resolution;
+	uint64_t bytes, iterations;
+	double ns;
+};
+
+static std::vector<result_t> _results;
+static double _seconds = 0.25;
+static volatile uint64_t _sink; // Keeps results of the kernels alive.
+
+template<typename T>
+static void Measure(const char* kernel, const char* variant, const char* resolution, uint64_t bytes, T fn) {
+	fn(); // Warm up caches and page in the buffers.
+
+	uint64_t iterations = 0;
+	auto tbegin = std::chrono::steady_clock::now();
+	auto tend = tbegin;
+	do {
+		fn();
+		iterations++;
+		tend = std::chrono::steady_clock::now();
+	} while (std::chrono::duration<double>(tend - tbegin).count() < _seconds);
+
+	result_t result;
+	result.kernel = kernel;
+	result.variant = variant;
+	result.resolution = resolution;
+	result.bytes = bytes;
+	result.iterations = iterations;
+	result.ns = std::chrono::duration<double, std::nano>(tend - tbegin).count() / double(iterations);
+	_results.push_back(result);
+
+	printf("%-18s %-6s %-6s %14.0f ns %9.2f GB/s\n", kernel, variant, resolution,
+		result.ns, bytes > 0 ? double(bytes) / result.ns : 0.0);
+}
+
+// The row flip as pre-processing did it before FlipRows.
+static void FlipRowsScalar(uint8_t* data, size_t stride, uint32_t height) {
+	std::vector<uint8_t> tempBuf(stride);
+	for (uint32_t line = 0; line < height / 2; line++) {
+		uint8_t* front = data + size_t(line) * stride;
+		uint8_t* back = data + size_t(height - line - 1) * stride;
+		std::memcpy(tempBuf.data(), front, stride);
+		std::memcpy(front, back, stride);
+		std::memcpy(back, tempBuf.data(), stride);
+	}
+}
+
+// The start code search as the MPEG-2 rewrite did it before FindStartCode.
+static const uint8_t* FindStartCodeScalar(const uint8_t* begin, const uint8_t* end) {
+	const uint8_t* p = begin;
+	while (((end - p) >= 3) && ((p[0] != 0) || (p[1] != 0) || (p[2] != 1)))
+		p++;
+	return ((end - p) >= 3) ? p : end;
+}
+
+// An I-frame of roughly one bit per pixel: Sequence header and extension,
+// picture header and coding extension, then one slice per row of macroblocks.
+static std::vector<uint8_t> BuildMPEG2Packet(std::mt19937& rng, uint32_t width, uint32_t height) {
+	std::vector<uint8_t> packet;
+	auto startCode = [&packet](uint8_t id) {
+		packet.push_back(0);
+		packet.push_back(0);
+		packet.push_back(1);
+		packet.push_back(id);
+	};
+
+	startCode(0xB3);
+	const uint8_t sequenceHeader[] = { uint8_t(width >> 4), uint8_t(((width & 0xF) << 4) | (height >> 8)), uint8_t(height), 0x33,
+		0xFF, 0xFF, 0xE0, 0x18 };
+	packet.insert(packet.end(), sequenceHeader, sequenceHeader + sizeof(sequenceHeader));
+	startCode(0xB5);
+	const uint8_t sequenceExtension[] = { 0x14, 0x82, 0x00, 0x01, 0x00, 0x00 };
+	packet.insert(packet.end(), sequenceExtension, sequenceExtension + sizeof(sequenceExtension));
+	startCode(0x00);
+	const uint8_t pictureHeader[] = { 0x00, 0x0F, 0xFF, 0xF8 };
+	packet.insert(packet.end(), pictureHeader, pictureHeader + sizeof(pictureHeader));
+	startCode(0xB5);
+	const uint8_t pictureExtension[] = { 0x8F, 0xFF, 0xF3, 0x82, 0x80 };
+	packet.insert(packet.end(), pictureExtension, pictureExtension + sizeof(pictureExtension));
+
+	uint32_t slices = (height + 15) / 16;
+	size_t sliceSize = size_t(width) * height / 8 / slices;
+	for (uint32_t slice = 1; slice <= slices; slice++) {
+		startCode(uint8_t((slice < 0xAF) ? slice : 0xAF));
+		for (size_t idx = 0; idx < sliceSize; idx++) {
+			uint8_t v = uint8_t(rng());
+			// Zeros are common in entropy coded data, but never two in a row.
+			if ((v == 0) && (packet.back() == 0))
+				v = 0x80;
+			packet.push_back(v);
+		}
+	}
+	return packet;
+}
+
+static bool WriteResults(const char* path) {
+	std::ofstream file(path, std::ios::out | std::ios::trunc);
+	if (!file.is_open())
+		return false;
+	file << "[\n";
+	for (size_t idx = 0; idx < _results.size(); idx++) {
+		const result_t& result = _results[idx];
+		char buf[512];
+		snprintf(buf, sizeof(buf),
+			"{\"kernel\":\"%s\",\"variant\":\"%s\",\"resolution\":\"%s\",\"bytes\":%llu,\"iterations\":%llu,"
+			"\"ns_per_frame\":%.1f,\"gb_per_s\":%.3f}%s\n",
+			result.kernel.c_str(), result.variant.c_str(), result.resolution.c_str(),
+			(unsigned long long)result.bytes, (unsigned long long)result.iterations,
+			result.ns, result.bytes > 0 ? double(result.bytes) / result.ns : 0.0,
+			(idx + 1 < _results.size()) ? "," : "");
+		file << buf;
+	}
+	file << "]\n";
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	const char* output = nullptr;
+	for (int arg = 1; arg < argc; arg++) {
+		if ((strcmp(argv[arg], "-o") == 0) && (arg + 1 < argc)) {
+			output = argv[++arg];
+		} else if ((strcmp(argv[arg], "-t") == 0) && (arg + 1 < argc)) {
+			_seconds = atof(argv[++arg]);
+		} else {
+			printf("Usage: %s [-o Results.json] [-t Seconds per Measurement]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	std::mt19937 rng(0x56465721);
+	for (const resolution_t& res : resolutions) {
+		// Frames as OBS hands them over: BGRA, rows padded to 64 bytes.
+		size_t rowBytes = size_t(res.width) * 4;
+		size_t stride = (rowBytes + 64 + 63) & ~size_t(63);
+		size_t frameBytes = rowBytes * res.height;
+		std::vector<uint8_t> source(stride * res.height), frame(frameBytes);
+		for (size_t idx = 0; idx < source.size(); idx += 4) {
+			uint32_t v = rng();
+			std::memcpy(source.data() + idx, &v, 4);
+		}
+
+		// Input copy in encode(), with and without padding to skip.
+		Measure("CopyPlane", "padded", res.name, frameBytes, [&]() {
+			VFW::Kernel::CopyPlane(source.data(), stride, frame.data(), rowBytes, res.height);
+		});
+		Measure("CopyPlane", "packed", res.name, frameBytes, [&]() {
+			VFW::Kernel::CopyPlane(source.data(), rowBytes, frame.data(), rowBytes, res.height);
+		});
+
+		// Row flip in pre-processing, every byte is read and written once.
+		Measure("FlipRows", "scalar", res.name, frameBytes, [&]() {
+			FlipRowsScalar(frame.data(), rowBytes, res.height);
+		});
+		Measure("FlipRows", "sse2", res.name, frameBytes, [&]() {
+			VFW::Kernel::FlipRows(frame.data(), rowBytes, res.height);
+		});
+
+		// Row hashes of incremental input, which read the frame once.
+		std::vector<uint64_t> hashes(res.height);
+		Measure("HashRows", "scalar", res.name, frameBytes, [&]() {
+			VFW::Kernel::HashRows(source.data(), stride, rowBytes, res.height, hashes.data());
+			_sink = hashes[0];
+		});
+
+		// Quality comparison of a sampled frame against its input.
+		Measure("CompareBGRA", "sse2", res.name, frameBytes * 2, [&]() {
+			VFW::Kernel::Quality quality = VFW::Kernel::CompareBGRA(source.data(), stride, frame.data(), rowBytes, res.width, res.height);
+			_sink = uint64_t(quality.psnr);
+		});
+
+		// Start code walk and rewrite of the Matrox MPEG-2 post-processing.
+		std::vector<uint8_t> packet = BuildMPEG2Packet(rng, res.width, res.height);
+		const uint8_t* begin = packet.data();
+		const uint8_t* end = begin + packet.size();
+		Measure("FindStartCode", "scalar", res.name, packet.size(), [&]() {
+			uint64_t count = 0;
+			for (const uint8_t* p = FindStartCodeScalar(begin, end); p != end; p = FindStartCodeScalar(p + 3, end))
+				count++;
+			_sink = count;
+		});
+		Measure("FindStartCode", "sse2", res.name, packet.size(), [&]() {
+			uint64_t count = 0;
+			for (const uint8_t* p = VFW::Kernel::FindStartCode(begin, end); p != end; p = VFW::Kernel::FindStartCode(p + 3, end))
+				count++;
+			_sink = count;
+		});
+		VFW::Kernel::MPEG2FrameRate rate = VFW::Kernel::FindMPEG2FrameRate(60, 1);
+		Measure("FixMatroxMPEG2", "sse2", res.name, packet.size(), [&]() {
+			VFW::Kernel::FixMatroxMPEG2(packet.data(), packet.size(), rate);
+		});
+	}
+
+	// The frame rate lookup, which the MPEG-2 rewrite did for every packet.
+	Measure("FindMPEG2FrameRate", "scalar", "-", 0, [&]() {
+		VFW::Kernel::MPEG2FrameRate match = VFW::Kernel::FindMPEG2FrameRate(30000, 1001);
+		_sink = match.code + match.extN + match.extD;
+	});
+
+	if (output && !WriteResults(output)) {
+		printf("Unable to write results to '%s'.\n", output);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,806 @@
+#include "capture.h"
+
+#include <stdexcept>
+#include <cstring>
+#include <sstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const size_t mappedfile_chunk = 64 * 1024 * 1024;
+
+// Frames the capture writer may fall behind by before frames are dropped.
+static const size_t capture_queue_frames = 8;
+
+// AVI: Every RIFF is closed at about 1 GB like VFW does, which also keeps the
+// offsets in its standard index within 32 bits. The super index has room for
+// an entry per RIFF.
+static const uint64_t avi_riff_size = 1024ull * 1024 * 1024;
+static const uint32_t avi_superindex_entries = 1024;
+static const uint32_t avi_hasindex = 0x10; // AVIF_HASINDEX
+static const uint32_t avi_keyframe = 0x10; // AVIIF_KEYFRAME
+static const uint32_t avi_deltaframe = 0x80000000; // Size flag in standard indexes.
+
+#ifdef _WIN32
+VFW::MappedFile::MappedFile(const std::string& path, bool writable) {
+	m_path = path;
+	m_writable = writable;
+	m_mapping = NULL;
+	m_view = nullptr;
+	m_size = m_capacity = 0;
+
+	m_file = CreateFileA(path.c_str(),
+		writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+		FILE_SHARE_READ, NULL,
+		writable ? CREATE_ALWAYS : OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (m_file == INVALID_HANDLE_VALUE) {
+		PLOG_ERROR("Unable to open '%s'.", path.c_str());
+		throw std::runtime_error("Unable to open file");
+	}
+
+	if (!writable) {
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size) || (size.QuadPart == 0)) {
+			CloseHandle(m_file);
+			PLOG_ERROR("'%s' is empty.", path.c_str());
+			throw std::runtime_error("Empty file");
+		}
+		m_size = size_t(size.QuadPart);
+		map(m_size);
+	}
+}
+
+VFW::MappedFile::~MappedFile() {
+	unmap();
+	if (m_writable) {
+		// Drop the unused part of the last chunk.
+		LARGE_INTEGER size; size.QuadPart = LONGLONG(m_size);
+		SetFilePointerEx(m_file, size, NULL, FILE_BEGIN);
+		SetEndOfFile(m_file);
+	}
+	CloseHandle(m_file);
+}
+#else
+VFW::MappedFile::MappedFile(const std::string& path, bool writable) {
+	m_path = path;
+	m_writable = writable;
+	m_view = nullptr;
+	m_size = m_capacity = 0;
+
+	m_file = open(path.c_str(), writable ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY, 0644);
+	if (m_file < 0) {
+		PLOG_ERROR("Unable to open '%s'.", path.c_str());
+		throw std::runtime_error("Unable to open file");
+	}
+
+	if (!writable) {
+		struct stat st;
+		if ((fstat(m_file, &st) != 0) || (st.st_size == 0)) {
+			close(m_file);
+			PLOG_ERROR("'%s' is empty.", path.c_str());
+			throw std::runtime_error("Empty file");
+		}
+		m_size = size_t(st.st_size);
+		map(m_size);
+	}
+}
+
+VFW::MappedFile::~MappedFile() {
+	unmap();
+	if (m_writable) {
+		// Drop the unused part of the last chunk.
+		if (ftruncate(m_file, off_t(m_size)) != 0)
+			PLOG_WARNING("Unable to truncate '%s'.", m_path.c_str());
+	}
+	close(m_file);
+}
+#endif
+
+uint8_t* VFW::MappedFile::data() {
+	return m_view;
+}
+
+size_t VFW::MappedFile::size() {
+	return m_size;
+}
+
+void VFW::MappedFile::reserve(size_t size) {
+	if (size <= m_capacity)
+		return;
+
+	size_t capacity = ((size / mappedfile_chunk) + 1) * mappedfile_chunk;
+	unmap();
+	map(capacity);
+}
+
+void VFW::MappedFile::append(const void* data, size_t size) {
+	reserve(m_size + size);
+	std::memcpy(m_view + m_size, data, size);
+	m_size += size;
+}
+
+void VFW::MappedFile::pad(size_t alignment) {
+	size_t padding = (alignment - (m_size % alignment)) % alignment;
+	reserve(m_size + padding);
+	std::memset(m_view + m_size, 0, padding);
+	m_size += padding;
+}
+
+void VFW::MappedFile::reset() {
+	// Start over at the beginning, the mapping stays for reuse.
+	m_size = 0;
+}
+
+void VFW::MappedFile::discard(size_t size) {
+	// Drop the front, the rest moves to the beginning.
+	if (size > m_size)
+		size = m_size;
+	std::memmove(m_view, m_view + size, m_size - size);
+	m_size -= size;
+}
+
+#ifdef _WIN32
+void VFW::MappedFile::map(size_t capacity) {
+	LARGE_INTEGER size; size.QuadPart = LONGLONG(capacity);
+	m_mapping = CreateFileMappingA(m_file, NULL,
+		m_writable ? PAGE_READWRITE : PAGE_READONLY,
+		DWORD(size.HighPart), size.LowPart, NULL);
+	if (m_mapping == NULL) {
+		PLOG_ERROR("Unable to map '%s' (%" PRIu64 " bytes).", m_path.c_str(), uint64_t(capacity));
+		throw std::runtime_error("Unable to map file");
+	}
+
+	m_view = reinterpret_cast<uint8_t*>(MapViewOfFile(m_mapping,
+		m_writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, capacity));
+	if (m_view == nullptr) {
+		CloseHandle(m_mapping);
+		m_mapping = NULL;
+		PLOG_ERROR("Unable to map view of '%s' (%" PRIu64 " bytes).", m_path.c_str(), uint64_t(capacity));
+		throw std::runtime_error("Unable to map view of file");
+	}
+	m_capacity = capacity;
+}
+
+void VFW::MappedFile::unmap() {
+	if (m_view)
+		UnmapViewOfFile(m_view);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	m_view = nullptr;
+	m_mapping = NULL;
+	m_capacity = 0;
+}
+#else
+void VFW::MappedFile::map(size_t capacity) {
+	// Unlike a file mapping on Windows, mmap does not grow the file.
+	if (m_writable && (ftruncate(m_file, off_t(capacity)) != 0)) {
+		PLOG_ERROR("Unable to grow '%s' to %" PRIu64 " bytes.", m_path.c_str(), uint64_t(capacity));
+		throw std::runtime_error("Unable to grow file");
+	}
+
+	void* view = mmap(nullptr, capacity, m_writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+		MAP_SHARED, m_file, 0);
+	if (view == MAP_FAILED) {
+		PLOG_ERROR("Unable to map '%s' (%" PRIu64 " bytes).", m_path.c_str(), uint64_t(capacity));
+		throw std::runtime_error("Unable to map file");
+	}
+	m_view = reinterpret_cast<uint8_t*>(view);
+	m_capacity = capacity;
+}
+
+void VFW::MappedFile::unmap() {
+	if (m_view)
+		munmap(m_view, m_capacity);
+	m_view = nullptr;
+	m_capacity = 0;
+}
+#endif
+
+void VFW::GetPlaneHeights(video_format format, uint32_t height, uint32_t(&heights)[MAX_AV_PLANES]) {
+	std::memset(heights, 0, sizeof(heights));
+	switch (format) {
+		case VIDEO_FORMAT_I420:
+			heights[0] = height;
+			heights[1] = heights[2] = (height + 1) / 2;
+			break;
+		case VIDEO_FORMAT_NV12:
+			heights[0] = height;
+			heights[1] = (height + 1) / 2;
+			break;
+		case VIDEO_FORMAT_I444:
+			heights[0] = heights[1] = heights[2] = height;
+			break;
+		default:
+			heights[0] = height;
+			break;
+	}
+}
+
+void VFW::GetPlaneRowBytes(video_format format, uint32_t width, uint32_t(&bytes)[MAX_AV_PLANES]) {
+	std::memset(bytes, 0, sizeof(bytes));
+	switch (format) {
+		case VIDEO_FORMAT_I420:
+			bytes[0] = width;
+			bytes[1] = bytes[2] = (width + 1) / 2;
+			break;
+		case VIDEO_FORMAT_NV12:
+			bytes[0] = width;
+			bytes[1] = ((width + 1) / 2) * 2;
+			break;
+		case VIDEO_FORMAT_I444:
+			bytes[0] = bytes[1] = bytes[2] = width;
+			break;
+		case VIDEO_FORMAT_YVYU:
+		case VIDEO_FORMAT_YUY2:
+		case VIDEO_FORMAT_UYVY:
+			bytes[0] = ((width + 1) / 2) * 4;
+			break;
+		default:
+			bytes[0] = width * 4;
+			break;
+	}
+}
+
+VFW::CaptureWriter::CaptureWriter(const std::string& path, uint32_t width, uint32_t height,
+	uint32_t fpsNum, uint32_t fpsDen, video_format format) : m_file(path, true) {
+	std::memset(&m_header, 0, sizeof(CaptureHeader));
+	m_header.magic = CAPTURE_MAGIC;
+	m_header.version = CAPTURE_VERSION;
+	m_header.width = width;
+	m_header.height = height;
+	m_header.fpsNum = fpsNum;
+	m_header.fpsDen = fpsDen;
+	m_header.format = format;
+
+	GetPlaneHeights(format, height, m_heights);
+	for (size_t plane = 0; plane < MAX_AV_PLANES; plane++) {
+		if (m_heights[plane] != 0)
+			m_header.planes++;
+	}
+
+	m_file.append(&m_header, sizeof(CaptureHeader));
+	m_file.pad(CAPTURE_ALIGNMENT);
+	m_count = m_dropped = 0;
+	m_shutdown = m_failed = false;
+	m_writer = std::thread(&CaptureWriter::writerMain, this);
+}
+
+VFW::CaptureWriter::~CaptureWriter() {
+	finish();
+}
+
+void VFW::CaptureWriter::finish() {
+	{
+		std::unique_lock<std::mutex> ulock(m_lock);
+		m_shutdown = true;
+		m_cv.notify_all();
+	}
+	if (m_writer.joinable())
+		m_writer.join();
+}
+
+void VFW::CaptureWriter::write(struct encoder_frame* frame) {
+	std::unique_ptr<record_t> record;
+	{
+		std::unique_lock<std::mutex> ulock(m_lock);
+		if (m_failed)
+			throw std::runtime_error("Capture failed");
+		if (m_queue.size() >= capture_queue_frames) {
+			m_dropped++;
+			return;
+		}
+		if (m_free.size() > 0) {
+			record = std::move(m_free.back());
+			m_free.pop_back();
+		}
+	}
+	if (!record)
+		record = std::unique_ptr<record_t>(new record_t());
+
+	// Lay out the record first so that it can be written in one pass.
+	CaptureFrameHeader& fh = record->header;
+	std::memset(&fh, 0, sizeof(CaptureFrameHeader));
+	fh.pts = frame->pts;
+	size_t offset = sizeof(CaptureFrameHeader);
+	for (size_t plane = 0; plane < m_header.planes; plane++) {
+		offset = ((offset + CAPTURE_ALIGNMENT - 1) / CAPTURE_ALIGNMENT) * CAPTURE_ALIGNMENT;
+		fh.linesize[plane] = frame->linesize[plane];
+		fh.offset[plane] = offset;
+		offset += size_t(frame->linesize[plane]) * m_heights[plane];
+	}
+	fh.size = ((offset + CAPTURE_ALIGNMENT - 1) / CAPTURE_ALIGNMENT) * CAPTURE_ALIGNMENT;
+
+	// The frame is only valid during the call, so it is copied as laid out.
+	record->data.resize(size_t(fh.size) - sizeof(CaptureFrameHeader));
+	uint8_t* data = record->data.data();
+	size_t position = 0;
+	for (size_t plane = 0; plane < m_header.planes; plane++) {
+		size_t start = size_t(fh.offset[plane]) - sizeof(CaptureFrameHeader);
+		size_t bytes = size_t(frame->linesize[plane]) * m_heights[plane];
+		std::memset(data + position, 0, start - position);
+		std::memcpy(data + start, frame->data[plane], bytes);
+		position = start + bytes;
+	}
+	std::memset(data + position, 0, record->data.size() - position);
+
+	std::unique_lock<std::mutex> ulock(m_lock);
+	m_queue.push_back(std::move(record));
+	m_cv.notify_all();
+}
+
+size_t VFW::CaptureWriter::count() {
+	std::unique_lock<std::mutex> ulock(m_lock);
+	return m_count;
+}
+
+size_t VFW::CaptureWriter::dropped() {
+	std::unique_lock<std::mutex> ulock(m_lock);
+	return m_dropped;
+}
+
+void VFW::CaptureWriter::writerMain() {
+	std::unique_lock<std::mutex> ulock(m_lock);
+	while (true) {
+		m_cv.wait(ulock, [this] {
+			return m_shutdown || (m_queue.size() > 0);
+		});
+		if (m_queue.size() == 0)
+			break; // Shutdown, and everything queued is written.
+
+		std::unique_ptr<record_t> record = std::move(m_queue.front());
+		m_queue.pop_front();
+		ulock.unlock();
+
+		bool success = true;
+		try {
+			m_file.reserve(m_file.size() + size_t(record->header.size));
+			m_file.append(&record->header, sizeof(CaptureFrameHeader));
+			m_file.append(record->data.data(), record->data.size());
+		} catch (...) {
+			success = false;
+		}
+
+		ulock.lock();
+		if (!success) {
+			m_failed = true;
+			m_queue.clear();
+			break;
+		}
+		m_count++;
+		m_free.push_back(std::move(record));
+	}
+}
+
+VFW::CaptureReader::CaptureReader(const std::string& path) : m_file(path, false) {
+	if (m_file.size() < sizeof(CaptureHeader))
+		throw std::runtime_error("Truncated capture");
+	std::memcpy(&m_header, m_file.data(), sizeof(CaptureHeader));
+	if ((m_header.magic != CAPTURE_MAGIC) || (m_header.version != CAPTURE_VERSION)) {
+		PLOG_ERROR("'%s' is not a supported capture file.", path.c_str());
+		throw std::runtime_error("Invalid capture");
+	}
+
+	// Index all complete records, a capture may have been cut short.
+	size_t offset = ((sizeof(CaptureHeader) + CAPTURE_ALIGNMENT - 1) / CAPTURE_ALIGNMENT) * CAPTURE_ALIGNMENT;
+	while ((m_file.size() - offset) >= sizeof(CaptureFrameHeader)) {
+		const CaptureFrameHeader* fh = reinterpret_cast<const CaptureFrameHeader*>(m_file.data() + offset);
+		if ((fh->size == 0) || (fh->size > (m_file.size() - offset)))
+			break;
+		m_offsets.push_back(offset);
+		offset += size_t(fh->size);
+	}
+
+	PLOG_INFO("Opened capture '%s' (%" PRIu32 "x%" PRIu32 ", %" PRIu32 "/%" PRIu32 " FPS, %" PRIu64 " Frames).",
+		path.c_str(), m_header.width, m_header.height, m_header.fpsNum, m_header.fpsDen, uint64_t(m_offsets.size()));
+}
+
+const VFW::CaptureHeader& VFW::CaptureReader::header() {
+	return m_header;
+}
+
+size_t VFW::CaptureReader::count() {
+	return m_offsets.size();
+}
+
+void VFW::CaptureReader::read(size_t index, struct encoder_frame* frame) {
+	uint8_t* record = m_file.data() + m_offsets[index];
+	const CaptureFrameHeader* fh = reinterpret_cast<const CaptureFrameHeader*>(record);
+
+	std::memset(frame, 0, sizeof(encoder_frame));
+	frame->pts = fh->pts;
+	frame->frames = 1;
+	for (size_t plane = 0; plane < m_header.planes; plane++) {
+		frame->data[plane] = record + fh->offset[plane];
+		frame->linesize[plane] = fh->linesize[plane];
+	}
+}
+
+VFW::RawReader::RawReader(const std::string& path, uint32_t width, uint32_t height,
+	uint32_t fpsNum, uint32_t fpsDen, video_format format) : m_file(path, false) {
+	std::memset(&m_header, 0, sizeof(CaptureHeader));
+	m_header.width = width;
+	m_header.height = height;
+	m_header.fpsNum = fpsNum;
+	m_header.fpsDen = fpsDen;
+	m_header.format = format;
+
+	static const char y4mMagic[] = "YUV4MPEG2 ";
+	bool isY4M = (m_file.size() > (sizeof(y4mMagic) - 1))
+		&& (std::memcmp(m_file.data(), y4mMagic, sizeof(y4mMagic) - 1) == 0);
+	if (isY4M)
+		parseY4M();
+
+	if ((m_header.width == 0) || (m_header.height == 0) || (m_header.fpsNum == 0) || (m_header.fpsDen == 0)
+		|| ((m_header.format != VIDEO_FORMAT_I420) && (m_header.format != VIDEO_FORMAT_I444)
+			&& (m_header.format != VIDEO_FORMAT_BGRA))) {
+		PLOG_ERROR("'%s' has an unknown or unsupported format.", path.c_str());
+		throw std::runtime_error("Unsupported raw video");
+	}
+
+	GetPlaneHeights(video_format(m_header.format), m_header.height, m_heights);
+	GetPlaneRowBytes(video_format(m_header.format), m_header.width, m_bytes);
+	size_t frameSize = 0;
+	for (size_t plane = 0; plane < MAX_AV_PLANES; plane++) {
+		if (m_heights[plane] != 0)
+			m_header.planes++;
+		frameSize += size_t(m_bytes[plane]) * m_heights[plane];
+	}
+
+	if (isY4M) {
+		// Every frame has its own header line, which may carry parameters.
+		size_t offset = m_offsets.size() > 0 ? m_offsets.back() : 0;
+		m_offsets.clear();
+		while ((m_file.size() - offset) > 6) {
+			if (std::memcmp(m_file.data() + offset, "FRAME", 5) != 0)
+				break;
+			const uint8_t* eol = reinterpret_cast<const uint8_t*>(std::memchr(
+				m_file.data() + offset, '\n', m_file.size() - offset));
+			if (!eol)
+				break;
+			offset = size_t(eol - m_file.data()) + 1;
+			if ((m_file.size() - offset) < frameSize)
+				break;
+			m_offsets.push_back(offset);
+			offset += frameSize;
+		}
+	} else {
+		for (size_t offset = 0; (m_file.size() - offset) >= frameSize; offset += frameSize) {
+			m_offsets.push_back(offset);
+		}
+	}
+
+	PLOG_INFO("Opened raw video '%s' (%" PRIu32 "x%" PRIu32 ", %" PRIu32 "/%" PRIu32 " FPS, %" PRIu64 " Frames).",
+		path.c_str(), m_header.width, m_header.height, m_header.fpsNum, m_header.fpsDen, uint64_t(m_offsets.size()));
+}
+
+void VFW::RawReader::parseY4M() {
+	const uint8_t* eol = reinterpret_cast<const uint8_t*>(std::memchr(m_file.data(), '\n', m_file.size()));
+	if (!eol)
+		throw std::runtime_error("Truncated YUV4MPEG2 header");
+
+	// Remember where the first frame starts, the constructor indexes from there.
+	std::string line(reinterpret_cast<const char*>(m_file.data()), eol - m_file.data());
+	m_offsets.push_back(size_t(eol - m_file.data()) + 1);
+
+	m_header.format = VIDEO_FORMAT_I420;
+	std::stringstream tokens(line);
+	std::string token;
+	while (tokens >> token) {
+		char separator = 0;
+		std::stringstream value(token.substr(1));
+		switch (token[0]) {
+			case 'W':
+				value >> m_header.width;
+				break;
+			case 'H':
+				value >> m_header.height;
+				break;
+			case 'F':
+				value >> m_header.fpsNum >> separator >> m_header.fpsDen;
+				break;
+			case 'C':
+				if (token.compare(0, 4, "C420") == 0) {
+					m_header.format = VIDEO_FORMAT_I420;
+				} else if (token == "C444") {
+					m_header.format = VIDEO_FORMAT_I444;
+				} else {
+					m_header.format = VIDEO_FORMAT_NONE;
+				}
+				break;
+		}
+	}
+}
+
+const VFW::CaptureHeader& VFW::RawReader::header() {
+	return m_header;
+}
+
+size_t VFW::RawReader::count() {
+	return m_offsets.size();
+}
+
+void VFW::RawReader::read(size_t index, struct encoder_frame* frame) {
+	uint8_t* data = m_file.data() + m_offsets[index];
+
+	std::memset(frame, 0, sizeof(encoder_frame));
+	frame->pts = int64_t(index);
+	frame->frames = 1;
+	for (size_t plane = 0; plane < m_header.planes; plane++) {
+		frame->data[plane] = data;
+		frame->linesize[plane] = m_bytes[plane];
+		data += size_t(m_bytes[plane]) * m_heights[plane];
+	}
+}
+
+static void PutFourCC(std::vector<char>& buffer, const char* code) {
+	buffer.insert(buffer.end(), code, code + 4);
+}
+
+static void Put16(std::vector<char>& buffer, uint16_t value) {
+	buffer.insert(buffer.end(), reinterpret_cast<const char*>(&value), reinterpret_cast<const char*>(&value) + 2);
+}
+
+static void Put32(std::vector<char>& buffer, uint32_t value) {
+	buffer.insert(buffer.end(), reinterpret_cast<const char*>(&value), reinterpret_cast<const char*>(&value) + 4);
+}
+
+static void Put64(std::vector<char>& buffer, uint64_t value) {
+	buffer.insert(buffer.end(), reinterpret_cast<const char*>(&value), reinterpret_cast<const char*>(&value) + 8);
+}
+
+// Sizes of lists and chunks are only known once their content is.
+static void Set32(std::vector<char>& buffer, size_t offset, uint32_t value) {
+	std::memcpy(buffer.data() + offset, &value, 4);
+}
+
+VFW::AVIWriter::AVIWriter(const std::string& path, const std::vector<char>& format, uint32_t handler,
+	uint32_t width, uint32_t height, uint32_t fpsNum, uint32_t fpsDen)
+	: m_file(path, std::ios::out | std::ios::binary | std::ios::trunc) {
+	if (!m_file.is_open())
+		throw std::runtime_error("Unable to open '" + path + "' for writing");
+	m_fpsNum = fpsNum;
+	m_fpsDen = fpsDen;
+	m_frames = m_bytes = 0;
+	m_legacyFrames = m_maxChunk = 0;
+	m_finished = false;
+
+	std::vector<char> header;
+	PutFourCC(header, "RIFF");
+	Put32(header, 0);
+	PutFourCC(header, "AVI ");
+	PutFourCC(header, "LIST");
+	size_t hdrl = header.size();
+	Put32(header, 0);
+	PutFourCC(header, "hdrl");
+
+	// MainAVIHeader, frame count and buffer size follow in finish().
+	PutFourCC(header, "avih");
+	Put32(header, 56);
+	m_avihOffset = header.size();
+	Put32(header, uint32_t(uint64_t(1000000) * fpsDen / fpsNum));
+	Put32(header, 0); // Max Bytes per Second
+	Put32(header, 0); // Padding Granularity
+	Put32(header, avi_hasindex);
+	Put32(header, 0); // Total Frames (first RIFF)
+	Put32(header, 0); // Initial Frames
+	Put32(header, 1); // Streams
+	Put32(header, 0); // Suggested Buffer Size
+	Put32(header, width);
+	Put32(header, height);
+	for (size_t reserved = 0; reserved < 4; reserved++)
+		Put32(header, 0);
+
+	PutFourCC(header, "LIST");
+	size_t strl = header.size();
+	Put32(header, 0);
+	PutFourCC(header, "strl");
+
+	// AVIStreamHeader
+	PutFourCC(header, "strh");
+	Put32(header, 56);
+	m_strhOffset = header.size();
+	PutFourCC(header, "vids");
+	Put32(header, handler);
+	Put32(header, 0); // Flags
+	Put16(header, 0); // Priority
+	Put16(header, 0); // Language
+	Put32(header, 0); // Initial Frames
+	Put32(header, fpsDen); // Scale
+	Put32(header, fpsNum); // Rate
+	Put32(header, 0); // Start
+	Put32(header, 0); // Length
+	Put32(header, 0); // Suggested Buffer Size
+	Put32(header, 0xFFFFFFFF); // Quality (Default)
+	Put32(header, 0); // Sample Size (varies)
+	Put16(header, 0);
+	Put16(header, 0);
+	Put16(header, uint16_t(width));
+	Put16(header, uint16_t(height));
+
+	// The BITMAPINFO as is, codecs keep what their decoder needs after it.
+	PutFourCC(header, "strf");
+	Put32(header, uint32_t(format.size()));
+	header.insert(header.end(), format.begin(), format.end());
+	if (format.size() & 1)
+		header.push_back(0);
+
+	// OpenDML super index, filled in by finish().
+	PutFourCC(header, "indx");
+	Put32(header, 24 + 16 * avi_superindex_entries);
+	m_indxOffset = header.size();
+	Put16(header, 4); // Longs per Entry
+	header.push_back(0); // Sub Type
+	header.push_back(0); // Type: AVI_INDEX_OF_INDEXES
+	Put32(header, 0); // Entries in Use
+	PutFourCC(header, "00dc");
+	header.resize(header.size() + 12 + 16 * avi_superindex_entries, 0);
+	Set32(header, strl, uint32_t(header.size() - strl - 4));
+
+	PutFourCC(header, "LIST");
+	size_t odml = header.size();
+	Put32(header, 0);
+	PutFourCC(header, "odml");
+	PutFourCC(header, "dmlh");
+	Put32(header, 248);
+	m_dmlhOffset = header.size();
+	header.resize(header.size() + 248, 0);
+	Set32(header, odml, uint32_t(header.size() - odml - 4));
+	Set32(header, hdrl, uint32_t(header.size() - hdrl - 4));
+
+	m_file.write(header.data(), header.size());
+	m_offset = header.size();
+	m_riffOffset = 0;
+	beginSegment();
+	if (!m_file)
+		throw std::runtime_error("Unable to write '" + path + "'");
+}
+
+VFW::AVIWriter::~AVIWriter() {
+	try {
+		finish();
+	} catch (...) {
+	}
+}
+
+void VFW::AVIWriter::write(const struct encoder_packet* packet) {
+	if (packet->pts < int64_t(m_frames))
+		throw std::runtime_error("Packets out of order");
+	while (int64_t(m_frames) < packet->pts)
+		writeChunk(nullptr, 0, false);
+	writeChunk(packet->data, uint32_t(packet->size), packet->keyframe);
+	if (!m_file)
+		throw std::runtime_error("Unable to write packet");
+}
+
+void VFW::AVIWriter::finish() {
+	if (m_finished)
+		return;
+	m_finished = true;
+	endSegment();
+
+	uint64_t maxBytesPerSecond = uint64_t(m_maxChunk) * m_fpsNum / m_fpsDen;
+	patch(m_avihOffset + 4, uint32_t((maxBytesPerSecond > 0xFFFFFFFF) ? 0xFFFFFFFF : maxBytesPerSecond));
+	patch(m_avihOffset + 16, m_legacyFrames);
+	patch(m_avihOffset + 28, m_maxChunk);
+	patch(m_strhOffset + 32, uint32_t(m_frames));
+	patch(m_strhOffset + 36, m_maxChunk);
+	patch(m_dmlhOffset, uint32_t(m_frames));
+
+	std::vector<char> entries;
+	for (segment_t& segment : m_segments) {
+		Put64(entries, segment.offset);
+		Put32(entries, segment.size);
+		Put32(entries, segment.frames);
+	}
+	patch(m_indxOffset + 4, uint32_t(m_segments.size()));
+	patch(m_indxOffset + 24, entries.data(), entries.size());
+
+	m_file.close();
+	if (m_file.fail())
+		throw std::runtime_error("Unable to complete AVI file");
+}
+
+void VFW::AVIWriter::writeChunk(const void* data, uint32_t size, bool keyframe) {
+	uint32_t padded = size + (size & 1);
+	if ((m_chunks.size() > 0) && ((m_offset + 8 + padded - m_riffOffset) > avi_riff_size)) {
+		endSegment();
+		beginSegment();
+	}
+
+	std::vector<char> header;
+	PutFourCC(header, "00dc");
+	Put32(header, size);
+	m_file.write(header.data(), header.size());
+	if (size > 0)
+		m_file.write(reinterpret_cast<const char*>(data), size);
+	if (size & 1)
+		m_file.put(0);
+
+	chunk_t chunk;
+	chunk.offset = m_offset;
+	chunk.size = size;
+	chunk.keyframe = keyframe;
+	m_chunks.push_back(chunk);
+	m_offset += 8 + padded;
+	m_frames++;
+	m_bytes += size;
+	if (size > m_maxChunk)
+		m_maxChunk = size;
+}
+
+void VFW::AVIWriter::beginSegment() {
+	std::vector<char> header;
+	if (m_segments.size() > 0) {
+		if (m_segments.size() >= avi_superindex_entries)
+			throw std::runtime_error("AVI file too large");
+		m_riffOffset = m_offset;
+		PutFourCC(header, "RIFF");
+		Put32(header, 0);
+		PutFourCC(header, "AVIX");
+	}
+	m_moviOffset = m_offset + header.size();
+	PutFourCC(header, "LIST");
+	Put32(header, 0);
+	PutFourCC(header, "movi");
+	m_file.write(header.data(), header.size());
+	m_offset += header.size();
+}
+
+void VFW::AVIWriter::endSegment() {
+	// Standard index of this RIFF, at the end of its movi LIST.
+	std::vector<char> index;
+	PutFourCC(index, "ix00");
+	Put32(index, uint32_t(24 + 8 * m_chunks.size()));
+	Put16(index, 2); // Longs per Entry
+	index.push_back(0); // Sub Type
+	index.push_back(1); // Type: AVI_INDEX_OF_CHUNKS
+	Put32(index, uint32_t(m_chunks.size()));
+	PutFourCC(index, "00dc");
+	Put64(index, m_moviOffset);
+	Put32(index, 0);
+	for (chunk_t& chunk : m_chunks) {
+		Put32(index, uint32_t(chunk.offset + 8 - m_moviOffset));
+		Put32(index, chunk.size | (chunk.keyframe ? 0 : avi_deltaframe));
+	}
+	segment_t segment;
+	segment.offset = m_offset;
+	segment.size = uint32_t(index.size());
+	segment.frames = uint32_t(m_chunks.size());
+	m_segments.push_back(segment);
+	m_file.write(index.data(), index.size());
+	m_offset += index.size();
+	patch(m_moviOffset + 4, uint32_t(m_offset - m_moviOffset - 8));
+
+	// Players without OpenDML support only see the first RIFF.
+	if (m_segments.size() == 1) {
+		std::vector<char> legacy;
+		PutFourCC(legacy, "idx1");
+		Put32(legacy, uint32_t(16 * m_chunks.size()));
+		for (chunk_t& chunk : m_chunks) {
+			PutFourCC(legacy, "00dc");
+			Put32(legacy, chunk.keyframe ? avi_keyframe : 0);
+			Put32(legacy, uint32_t(chunk.offset - (m_moviOffset + 8))); // From the 'movi' FourCC.
+			Put32(legacy, chunk.size);
+		}
+		m_file.write(legacy.data(), legacy.size());
+		m_offset += legacy.size();
+		m_legacyFrames = uint32_t(m_chunks.size());
+	}
+	patch(m_riffOffset + 4, uint32_t(m_offset - m_riffOffset - 8));
+	m_chunks.clear();
+}
+
+void VFW::AVIWriter::patch(uint64_t offset, const void* data, size_t size) {
+	m_file.seekp(std::streamoff(offset));
+	m_file.write(reinterpret_cast<const char*>(data), size);
+	m_file.seekp(std::streamoff(m_offset));
+}
+
+void VFW::AVIWriter::patch(uint64_t offset, uint32_t value) {
+	patch(offset, &value, sizeof(value));
+}
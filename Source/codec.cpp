@@ -0,0 +1,524 @@
+#include "codec.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+// Warm instances kept at most, and for how long while unused.
+static const size_t pool_size = 4;
+static const std::chrono::seconds pool_idle_timeout(300);
+
+// Background threads, so that closing one codec does not hold up opening
+// another, and how long acquire() waits for a codec that is still closing
+// if the driver refuses to open another instance meanwhile.
+static const size_t pool_workers = 2;
+static const std::chrono::milliseconds pool_acquire_wait(2000);
+
+struct pool_entry_t {
+	VFW::Info* info;
+	std::shared_ptr<VFW::Codec> codec;
+	std::chrono::steady_clock::time_point since;
+};
+
+std::mutex _poolLock;
+std::condition_variable _poolTaskCV, _poolDoneCV;
+std::list<pool_entry_t> _poolEntries; // Most recently warmed first.
+std::deque<std::pair<VFW::Info*, std::function<void()>>> _poolTasks;
+std::map<VFW::Info*, size_t> _poolPending;
+std::vector<std::thread> _poolWorkers;
+bool _poolShutdown = false;
+
+std::string FormattedICCError(LRESULT error) {
+	switch (error) {
+		case ICERR_OK:
+			return "Ok";
+		case ICERR_UNSUPPORTED:
+			return "Unsupported";
+		case ICERR_BADFORMAT:
+			return "Bad Format";
+		case ICERR_MEMORY:
+			return "Memory";
+		case ICERR_INTERNAL:
+			return "Internal";
+		case ICERR_BADFLAGS:
+			return "Bad Flags";
+		case ICERR_BADPARAM:
+			return "Bad Parameter";
+		case ICERR_BADSIZE:
+			return "Bad Size";
+		case ICERR_BADHANDLE:
+			return "Bad Handle";
+		case ICERR_CANTUPDATE:
+			return "Can't Update";
+		case ICERR_ABORT:
+			return "Abort";
+		case ICERR_ERROR:
+			return "Generic Error";
+		case ICERR_BADBITDEPTH:
+			return "Bad Bit Depth";
+		case ICERR_BADIMAGESIZE:
+			return "Bad Image Size";
+		case ICERR_CUSTOM:
+		default:
+			return "Custom Error";
+	}
+}
+
+VFW::Codec::Codec(VFW::Info* info, const CodecSettings& settings) {
+	myInfo = info;
+	m_settings = settings;
+	m_started = false;
+
+	UINT mainIC = settings.mode;
+	const char* mainICs = (mainIC == ICMODE_COMPRESS) ? "Normal" : "Fast";
+	UINT backupIC = (mainIC == ICMODE_COMPRESS) ? ICMODE_FASTCOMPRESS : ICMODE_COMPRESS;
+	const char* backupICs = (mainIC == ICMODE_COMPRESS) ? "Fast" : "Normal";
+
+	m_mode = mainIC;
+	hIC = ICOpen(myInfo->icInfo.fccType, myInfo->icInfo.fccHandler, mainIC);
+	if (hIC == 0) {
+		PLOG_WARNING(
+			"<%s> Failed to initialize with %s compression mode, "
+			"falling back to %s compression mode...",
+			myInfo->Name.c_str(), mainICs, backupICs);
+		m_mode = backupIC;
+		hIC = ICOpen(myInfo->icInfo.fccType, myInfo->icInfo.fccHandler, backupIC);
+		if (hIC == 0) {
+			PLOG_ERROR("<%s> Failed to initialize.",
+				myInfo->Name.c_str());
+			throw std::exception();
+		}
+	} else {
+		PLOG_DEBUG("<%s> Initialized with %s compression mode, setting up...",
+			myInfo->Name.c_str(), mainICs);
+	}
+
+	try {
+		LRESULT err = ICERR_OK;
+
+		// Load State from memory.
+		if (settings.state.size() > 0) {
+			err = ICSetState(hIC, const_cast<uint8_t*>(settings.state.data()), (DWORD)settings.state.size());
+			if (err != ICERR_OK) {
+				PLOG_ERROR("Failed to set state before encoding: %s.",
+					FormattedICCError(err).c_str());
+			}
+		} else {
+			ICSetState(hIC, NULL, 0);
+		}
+
+	#pragma region Get Bitmap Information
+		m_bufferInputBitmapInfo.resize(sizeof(BITMAPINFOHEADER));
+		std::memset(m_bufferInputBitmapInfo.data(), 0, m_bufferInputBitmapInfo.size());
+		m_inputBitmapInfo = reinterpret_cast<BITMAPINFO*>(m_bufferInputBitmapInfo.data());
+		m_inputBitmapInfo->bmiHeader.biSize = (DWORD)m_bufferInputBitmapInfo.size();
+		m_inputBitmapInfo->bmiHeader.biWidth = settings.width;
+		m_inputBitmapInfo->bmiHeader.biHeight = settings.height;
+		m_inputBitmapInfo->bmiHeader.biPlanes = 1;
+		m_inputBitmapInfo->bmiHeader.biBitCount = 32;
+		m_inputBitmapInfo->bmiHeader.biCompression = BI_RGB;
+		m_inputBitmapInfo->bmiHeader.biSizeImage = settings.width * settings.height * (m_inputBitmapInfo->bmiHeader.biBitCount / 8) * m_inputBitmapInfo->bmiHeader.biPlanes;
+
+		err = ICSendMessage(hIC, ICM_COMPRESS_GET_FORMAT, (DWORD_PTR)m_inputBitmapInfo, 0);
+		if (err <= 0) {
+			PLOG_ERROR("Unable to retrieve format information size: %s.",
+				FormattedICCError(err).c_str());
+			throw std::exception();
+		}
+
+		m_bufferOutputBitmapInfo.resize(err);
+		std::memset(m_bufferOutputBitmapInfo.data(), 0, m_bufferOutputBitmapInfo.size());
+		m_outputBitmapInfo = (BITMAPINFO*)m_bufferOutputBitmapInfo.data();
+		m_outputBitmapInfo->bmiHeader.biSize = (DWORD)m_bufferOutputBitmapInfo.size();
+		err = ICSendMessage(hIC, ICM_COMPRESS_GET_FORMAT, (DWORD_PTR)m_inputBitmapInfo, (DWORD_PTR)m_outputBitmapInfo);
+		if (err != ICERR_OK) {
+			PLOG_ERROR("Unable to retrieve format information: %s.",
+				FormattedICCError(err).c_str());
+			throw std::exception();
+		}
+	#pragma endregion Get Bitmap Information
+
+		// Output buffers are sized for the worst case.
+		m_maxOutputSize = ICCompressGetSize(hIC, m_inputBitmapInfo, m_outputBitmapInfo);
+
+		// Begin Compression
+		err = ICCompressBegin(hIC, m_inputBitmapInfo, m_outputBitmapInfo);
+		if (err != ICERR_OK) {
+			PLOG_ERROR("Unable to begin encoding: %s.", FormattedICCError(err).c_str());
+			throw std::runtime_error(FormattedICCError(err));
+		}
+
+		// Sequential encoding does what ICSeqCompressFrame would, but into our
+		// own buffers, so it keeps the key frame counter and frame number here.
+		// Set up as ICSeqCompressFrameStart was given it (see encodeVariant).
+		std::memset(&cv, 0, sizeof(COMPVARS));
+		if (settings.sequential) {
+			cv.cbSize = sizeof(COMPVARS);
+			cv.dwFlags = ICMF_COMPVARS_VALID;
+			cv.hic = hIC;
+			cv.fccType = myInfo->icInfo2.fccType;
+			cv.fccHandler = myInfo->icInfo2.fccHandler;
+			cv.lpbiOut = m_outputBitmapInfo;
+			cv.lKey = settings.keyframeInterval;
+			cv.lDataRate = settings.bitrate;
+			cv.lpbiIn = m_inputBitmapInfo;
+			cv.lQ = settings.quality;
+		}
+		m_started = true;
+	} catch (...) {
+		ICClose(hIC);
+		throw;
+	}
+}
+
+VFW::Codec::~Codec() {
+	if (m_started)
+		ICCompressEnd(hIC);
+	ICClose(hIC);
+}
+
+VFW::Info* VFW::Codec::info() {
+	return myInfo;
+}
+
+const VFW::CodecSettings& VFW::Codec::settings() {
+	return m_settings;
+}
+
+HIC VFW::Codec::handle() {
+	return hIC;
+}
+
+UINT VFW::Codec::mode() {
+	return m_mode;
+}
+
+COMPVARS* VFW::Codec::compVars() {
+	return &cv;
+}
+
+BITMAPINFO* VFW::Codec::inputFormat() {
+	return m_inputBitmapInfo;
+}
+
+BITMAPINFO* VFW::Codec::outputFormat() {
+	return m_outputBitmapInfo;
+}
+
+size_t VFW::Codec::outputFormatSize() {
+	return m_bufferOutputBitmapInfo.size();
+}
+
+size_t VFW::Codec::maxOutputSize() {
+	return m_maxOutputSize;
+}
+
+static bool IsSameSettings(const VFW::CodecSettings& a, const VFW::CodecSettings& b) {
+	return (a.width == b.width) && (a.height == b.height)
+		&& (a.mode == b.mode) && (a.sequential == b.sequential)
+		&& (a.keyframeInterval == b.keyframeInterval)
+		&& (a.bitrate == b.bitrate) && (a.quality == b.quality)
+		&& (a.state == b.state);
+}
+
+static void PoolMain() {
+	std::unique_lock<std::mutex> ulock(_poolLock);
+	while (true) {
+		_poolTaskCV.wait_for(ulock, pool_idle_timeout / 10, [] {
+			return _poolShutdown || (_poolTasks.size() > 0);
+		});
+
+		if (_poolTasks.size() > 0) {
+			auto task = _poolTasks.front();
+			_poolTasks.pop_front();
+			ulock.unlock();
+			try {
+				task.second();
+			} catch (...) {
+				PLOG_WARNING("<%s> Background task failed.", task.first->Name.c_str());
+			}
+			ulock.lock();
+			if (--_poolPending[task.first] == 0)
+				_poolPending.erase(task.first);
+			_poolDoneCV.notify_all();
+			continue;
+		}
+		if (_poolShutdown)
+			break;
+
+		// Close instances that have not been used for a while.
+		std::list<pool_entry_t> expired;
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = _poolEntries.begin(); it != _poolEntries.end();) {
+			auto current = it++;
+			if ((now - current->since) > pool_idle_timeout)
+				expired.splice(expired.end(), _poolEntries, current);
+		}
+		ulock.unlock();
+		expired.clear();
+		ulock.lock();
+	}
+}
+
+std::shared_ptr<VFW::Codec> VFW::CodecPool::acquire(VFW::Info* info, const CodecSettings& settings) {
+	{
+		std::unique_lock<std::mutex> ulock(_poolLock);
+		for (auto it = _poolEntries.begin(); it != _poolEntries.end(); it++) {
+			if ((it->info == info) && IsSameSettings(it->codec->settings(), settings)) {
+				std::shared_ptr<VFW::Codec> codec = it->codec;
+				_poolEntries.erase(it);
+				PLOG_DEBUG("<%s> Using warm codec instance.", info->Name.c_str());
+				return codec;
+			}
+		}
+	}
+
+	try {
+		return std::make_shared<VFW::Codec>(info, settings);
+	} catch (...) {
+	}
+
+	// Drivers that only allow a few instances may be held up by warm ones.
+	std::list<pool_entry_t> evicted;
+	{
+		std::unique_lock<std::mutex> ulock(_poolLock);
+		for (auto it = _poolEntries.begin(); it != _poolEntries.end();) {
+			auto current = it++;
+			if (current->info == info)
+				evicted.splice(evicted.end(), _poolEntries, current);
+		}
+	}
+	if (evicted.size() > 0) {
+		evicted.clear();
+		try {
+			return std::make_shared<VFW::Codec>(info, settings);
+		} catch (...) {
+		}
+	}
+
+	// A codec that is still being stopped may be holding the only instance
+	// the driver allows, so give it a moment before giving up.
+	{
+		std::unique_lock<std::mutex> ulock(_poolLock);
+		if (!_poolDoneCV.wait_for(ulock, pool_acquire_wait, [info] {
+			return _poolPending.count(info) == 0;
+		}))
+			throw std::runtime_error("Unable to open codec");
+	}
+	return std::make_shared<VFW::Codec>(info, settings);
+}
+
+void VFW::CodecPool::release(std::shared_ptr<Codec> codec) {
+	VFW::Info* info = codec->info();
+	CodecSettings settings = codec->settings();
+	std::shared_ptr<std::shared_ptr<Codec>> holder = std::make_shared<std::shared_ptr<Codec>>(codec);
+	codec = nullptr;
+
+	post(info, [info, settings, holder]() {
+		*holder = nullptr;
+
+		std::list<pool_entry_t> evicted;
+		{
+			// Other work goes first, a warm codec is only nice to have.
+			std::unique_lock<std::mutex> ulock(_poolLock);
+			if (_poolShutdown || (_poolTasks.size() > 0))
+				return;
+			for (auto& entry : _poolEntries) {
+				if ((entry.info == info) && IsSameSettings(entry.codec->settings(), settings))
+					return;
+			}
+		}
+
+		pool_entry_t entry;
+		entry.info = info;
+		entry.codec = std::make_shared<VFW::Codec>(info, settings);
+		entry.since = std::chrono::steady_clock::now();
+		{
+			std::unique_lock<std::mutex> ulock(_poolLock);
+			_poolEntries.push_front(entry);
+			while (_poolEntries.size() > pool_size)
+				evicted.splice(evicted.end(), _poolEntries, std::prev(_poolEntries.end()));
+		}
+	});
+}
+
+void VFW::CodecPool::post(VFW::Info* info, std::function<void()> task) {
+	{
+		std::unique_lock<std::mutex> ulock(_poolLock);
+		if (!_poolShutdown) {
+			while (_poolWorkers.size() < pool_workers)
+				_poolWorkers.push_back(std::thread(PoolMain));
+			_poolTasks.push_back(std::make_pair(info, task));
+			_poolPending[info]++;
+			_poolTaskCV.notify_all();
+			return;
+		}
+	}
+
+	// Nothing runs in the background anymore.
+	task();
+}
+
+void VFW::CodecPool::shutdown() {
+	{
+		std::unique_lock<std::mutex> ulock(_poolLock);
+		_poolShutdown = true;
+		_poolTaskCV.notify_all();
+	}
+	for (std::thread& worker : _poolWorkers)
+		worker.join();
+	_poolWorkers.clear();
+
+	std::list<pool_entry_t> entries;
+	{
+		std::unique_lock<std::mutex> ulock(_poolLock);
+		entries.swap(_poolEntries);
+	}
+	entries.clear();
+}
+
+#ifndef _WIN32
+// Video for Windows on other platforms: Drivers installed with ICInstall,
+// every call is a message to the driver procedure as it would be on Windows.
+struct HIC__ {
+	DRIVERPROC proc;
+	DWORD_PTR id;
+};
+
+struct installed_driver_t {
+	DWORD fccType, fccHandler;
+	DRIVERPROC proc;
+};
+
+std::mutex _installedLock;
+std::vector<installed_driver_t> _installed;
+
+static DWORD FourCCLower(DWORD fcc) {
+	DWORD result = 0;
+	for (size_t shift = 0; shift < 32; shift += 8) {
+		result |= DWORD(tolower(int((fcc >> shift) & 0xFF))) << shift;
+	}
+	return result;
+}
+
+BOOL ICInstall(DWORD fccType, DWORD fccHandler, LPARAM lParam, LPSTR szDesc, UINT wFlags) {
+	UNREFERENCED_PARAMETER(szDesc);
+	if ((wFlags & ICINSTALL_FUNCTION) == 0)
+		return FALSE;
+
+	std::unique_lock<std::mutex> ulock(_installedLock);
+	for (auto& driver : _installed) {
+		if ((driver.fccType == FourCCLower(fccType)) && (driver.fccHandler == FourCCLower(fccHandler)))
+			return FALSE;
+	}
+	installed_driver_t driver;
+	driver.fccType = FourCCLower(fccType);
+	driver.fccHandler = FourCCLower(fccHandler);
+	driver.proc = reinterpret_cast<DRIVERPROC>(lParam);
+	_installed.push_back(driver);
+	driver.proc(0, nullptr, DRV_LOAD, 0, 0);
+	driver.proc(0, nullptr, DRV_ENABLE, 0, 0);
+	return TRUE;
+}
+
+BOOL ICInfo(DWORD fccType, DWORD fccHandler, ICINFO* lpicinfo) {
+	// Like on Windows, fccHandler is either an index or a FourCC.
+	std::unique_lock<std::mutex> ulock(_installedLock);
+	DWORD index = 0;
+	for (auto& driver : _installed) {
+		if ((fccType != 0) && (driver.fccType != FourCCLower(fccType)))
+			continue;
+		if ((index++ == fccHandler) || (driver.fccHandler == FourCCLower(fccHandler))) {
+			std::memset(lpicinfo, 0, sizeof(ICINFO));
+			lpicinfo->dwSize = sizeof(ICINFO);
+			lpicinfo->fccType = driver.fccType;
+			lpicinfo->fccHandler = driver.fccHandler;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+HIC ICOpen(DWORD fccType, DWORD fccHandler, UINT wMode) {
+	DRIVERPROC proc = nullptr;
+	{
+		std::unique_lock<std::mutex> ulock(_installedLock);
+		for (auto& driver : _installed) {
+			if ((driver.fccType == FourCCLower(fccType)) && (driver.fccHandler == FourCCLower(fccHandler)))
+				proc = driver.proc;
+		}
+	}
+	if (!proc)
+		return nullptr;
+
+	ICOPEN icopen;
+	std::memset(&icopen, 0, sizeof(ICOPEN));
+	icopen.dwSize = sizeof(ICOPEN);
+	icopen.fccType = fccType;
+	icopen.fccHandler = fccHandler;
+	icopen.dwVersion = ICVERSION;
+	icopen.dwFlags = wMode;
+	LRESULT id = proc(0, nullptr, DRV_OPEN, 0, reinterpret_cast<LPARAM>(&icopen));
+	if (id == 0)
+		return nullptr;
+
+	HIC hic = new HIC__();
+	hic->proc = proc;
+	hic->id = DWORD_PTR(id);
+	return hic;
+}
+
+LRESULT ICClose(HIC hic) {
+	if (!hic)
+		return ICERR_BADHANDLE;
+	hic->proc(hic->id, nullptr, DRV_CLOSE, 0, 0);
+	delete hic;
+	return ICERR_OK;
+}
+
+LRESULT ICSendMessage(HIC hic, UINT msg, DWORD_PTR dw1, DWORD_PTR dw2) {
+	if (!hic)
+		return ICERR_BADHANDLE;
+	return hic->proc(hic->id, nullptr, msg, LPARAM(dw1), LPARAM(dw2));
+}
+
+LRESULT ICGetInfo(HIC hic, ICINFO* picinfo, DWORD cb) {
+	return ICSendMessage(hic, ICM_GETINFO, DWORD_PTR(picinfo), cb);
+}
+
+DWORD ICCompress(HIC hic, DWORD dwFlags, LPBITMAPINFOHEADER lpbiOutput, LPVOID lpData,
+	LPBITMAPINFOHEADER lpbiInput, LPVOID lpBits, DWORD* lpckid, DWORD* lpdwFlags,
+	LONG lFrameNum, DWORD dwFrameSize, DWORD dwQuality, LPBITMAPINFOHEADER lpbiPrev, LPVOID lpPrev) {
+	ICCOMPRESS icc;
+	icc.dwFlags = dwFlags;
+	icc.lpbiOutput = lpbiOutput;
+	icc.lpOutput = lpData;
+	icc.lpbiInput = lpbiInput;
+	icc.lpInput = lpBits;
+	icc.lpckid = lpckid;
+	icc.lpdwFlags = lpdwFlags;
+	icc.lFrameNum = lFrameNum;
+	icc.dwFrameSize = dwFrameSize;
+	icc.dwQuality = dwQuality;
+	icc.lpbiPrev = lpbiPrev;
+	icc.lpPrev = lpPrev;
+	return DWORD(ICSendMessage(hic, ICM_COMPRESS, DWORD_PTR(&icc), sizeof(ICCOMPRESS)));
+}
+
+DWORD ICDecompress(HIC hic, DWORD dwFlags, LPBITMAPINFOHEADER lpbiFormat, LPVOID lpData,
+	LPBITMAPINFOHEADER lpbi, LPVOID lpBits) {
+	ICDECOMPRESS icd;
+	icd.dwFlags = dwFlags;
+	icd.lpbiInput = lpbiFormat;
+	icd.lpInput = lpData;
+	icd.lpbiOutput = lpbi;
+	icd.lpOutput = lpBits;
+	icd.ckid = 0;
+	return DWORD(ICSendMessage(hic, ICM_DECOMPRESS, DWORD_PTR(&icd), sizeof(ICDECOMPRESS)));
+}
+#endif
@@ -1,4 +1,5 @@
 #include "enc-vfw.h"
+#include "kernels.h"
 #include "libobs/obs-encoder.h"
 
 #include <chrono>
@@ -6,15 +7,134 @@
 #include <tuple>
 #include <vector>
 #include <map>
+#include <set>
 #include <sstream>
 #include <emmintrin.h>
 #include <sstream>
 
 std::map<std::string, VFW::Info*> _IdToInfo;
 
+// Memory held by all encoders, and the ceiling for all of them (0 = none),
+// which is the lowest one any running encoder asks for.
+VFW::MemoryUsage _moduleMemory;
+std::atomic<int64_t> _moduleMemoryLimit(0);
+std::mutex _moduleMemoryLimitsLock;
+std::multiset<int64_t> _moduleMemoryLimits;
+
+// Frames taken by more than one encoder: Data, Frame, Width, Height, Line Size
+typedef std::tuple<uintptr_t, int64_t, uint32_t, uint32_t, uint32_t> shared_frame_key_t;
+std::mutex _sharedFramesLock;
+std::map<shared_frame_key_t, std::pair<std::weak_ptr<std::vector<char>>, std::shared_ptr<VFW::SharedFrame>>> _sharedFrames;
+
+// Simulcast rungs by group name, consumers attach to these.
+std::mutex _simulcastLock;
+std::map<std::string, std::vector<std::weak_ptr<VFW::Encoder>>> _simulcastGroups;
+
+// Encode workers abandoned by the watchdog, which may still be inside a codec,
+// and those of them that have since left it.
+std::mutex _abandonedLock;
+std::condition_variable _abandonedCV;
+std::list<std::thread> _abandonedThreads;
+std::set<std::thread::id> _abandonedDone;
+
+// Modes compress as named since this version, which is pointed out once.
+std::atomic<bool> _modeChangeWarned(false);
+
 #define snprintf sprintf_s
 static const size_t preprocessthreads = 4;
 
+// Inline encoding is entered when all stages together take less than
+// inline_enter_percent of the frame time and left above inline_leave_percent.
+static const int64_t inline_enter_percent = 50;
+static const int64_t inline_leave_percent = 80;
+static const uint64_t inline_min_samples = 30;
+
+// The governor lowers quality (and then compression mode) above
+// governor_over_percent of the frame time spent in compression and steps back
+// up below governor_under_percent, waiting governor_cooldown frames after each
+// change for the timing to settle.
+static const int64_t governor_over_percent = 90;
+static const int64_t governor_under_percent = 60;
+static const int64_t governor_restore_percent = 40;
+static const uint32_t governor_quality_step = 500;
+static const uint32_t governor_quality_min = 1000;
+static const uint32_t governor_cooldown = 15;
+
+// Rate control: Lowest quality, largest change per frame, the time over which
+// the bucket is brought back to half full, and how strongly a mismatch
+// between predicted and wanted size moves the quality.
+static const uint32_t ratecontrol_quality_min = 500;
+static const uint32_t ratecontrol_quality_step = 1000;
+static const double_t ratecontrol_reaction_seconds = 0.5;
+static const double_t ratecontrol_gain = 0.5;
+
+// Scene cuts: Percentage of the luma histogram that has to move to count as a
+// cut, and the least number of frames between a keyframe and a cut keyframe.
+static const uint32_t scenecut_threshold_percent = 40;
+static const int64_t scenecut_min_frames = 10;
+
+// Backlog catch-up: Calls in a row with more packets queued than the latency
+// asks for, before input frames are skipped to work them off.
+static const uint32_t backlog_frames = 30;
+
+// Milliseconds flush() waits on a stage before it checks the watchdog.
+static const int64_t flush_watchdog_interval = 100;
+
+// Milliseconds Finalize() waits for abandoned encode workers to leave their codec.
+static const int64_t abandoned_unload_wait = 5000;
+
+// Packet Spill: Bytes already read back before the file is compacted.
+static const size_t spill_compact_min = 16 * 1024 * 1024;
+
+// Seconds between statistics in the log.
+static const uint32_t stats_interval = 60;
+
+// Benchmark: Run time per compression mode, and frames skipped while the codec warms up.
+static const int64_t benchmark_time_ms = 1000;
+static const uint32_t benchmark_warmup = 5;
+static const uint32_t benchmark_max_latency = 10;
+
+struct benchmark_mode_t {
+	bool available;
+	uint64_t frames;
+	double_t fps, averageMs, maximumMs;
+	uint32_t latency; // Smallest frame latency that absorbs the slow frames, or UINT32_MAX.
+};
+
+// What is measured: The codec set up as the encoder sets it up, and what it
+// is handed per frame. The Compress Mode is replaced per measurement.
+struct benchmark_config_t {
+	VFW::CodecSettings codec;
+	uint32_t fpsNum, fpsDen;
+	DWORD frameSize, frameQuality;
+	bool usePrev; // Temporal, or Sequential for codecs that need the previous frame.
+	const char* modeName;
+};
+
+struct benchmark_t {
+	bool running, shown;
+	benchmark_config_t config;
+	benchmark_mode_t modes[2]; // Normal, Fast
+};
+
+// Last result by Id, measured on a pool thread.
+std::mutex _benchmarkLock;
+std::map<std::string, benchmark_t> _benchmarkResults;
+
+// Parameter of the properties: The codec, and the settings being edited as
+// the modified callback last saw them, which the Benchmark measures.
+struct properties_param_t {
+	VFW::Info* info;
+	obs_data_t* settings;
+};
+
+static void DestroyPropertiesParam(void* data) {
+	properties_param_t* param = static_cast<properties_param_t*>(data);
+	if (param->settings)
+		obs_data_release(param->settings);
+	delete param;
+}
+
 std::vector<std::pair<const char*, const char*>> codecCorrections = {
 	// Cinepak Codec
 	{ "cvid", "cinepak" }, //AV_CODEC_ID_CINEPAK
@@ -48,87 +168,30 @@ std::vector<std::pair<const char*, const char*>> codecCorrections = {
 	{ "dv50", "dvvideo" }, // Matrox DVCPRO50
 };
 
-std::map<uint64_t, std::tuple<uint8_t, uint8_t, uint8_t>> mpeg2hertz;
-const uint64_t mpeg2hertz_mult = 0xFFFFFFFF;
+// Codecs whose output is nothing but the raw frame in a format that OBS can
+// deliver directly: FourCC (lower case), Format. OBS converts with its own
+// BT.601 limited range matrix, so the output is not identical to the driver's.
+static const std::pair<const char*, video_format> nativeFormats[] = {
+	std::make_pair("i420", VIDEO_FORMAT_I420),
+	std::make_pair("iyuv", VIDEO_FORMAT_I420),
+};
 
-std::string FourCCFromInt32(DWORD& fccHandler) {
-	return std::string(reinterpret_cast<char*>(&fccHandler), 4);
+static video_format NativeFormat(VFW::Info* info) {
+	std::string fourcc = info->FourCC;
+	for (char& ch : fourcc)
+		ch = char(tolower(ch));
+	for (auto& kv : nativeFormats) {
+		if (fourcc == kv.first)
+			return kv.second;
+	}
+	return VIDEO_FORMAT_NONE;
 }
 
-std::string FormattedICCError(LRESULT error) {
-	switch (error) {
-		case ICERR_OK:
-			return "Ok";
-		case ICERR_UNSUPPORTED:
-			return "Unsupported";
-		case ICERR_BADFORMAT:
-			return "Bad Format";
-		case ICERR_MEMORY:
-			return "Memory";
-		case ICERR_INTERNAL:
-			return "Internal";
-		case ICERR_BADFLAGS:
-			return "Bad Flags";
-		case ICERR_BADPARAM:
-			return "Bad Parameter";
-		case ICERR_BADSIZE:
-			return "Bad Size";
-		case ICERR_BADHANDLE:
-			return "Bad Handle";
-		case ICERR_CANTUPDATE:
-			return "Can't Update";
-		case ICERR_ABORT:
-			return "Abort";
-		case ICERR_ERROR:
-			return "Generic Error";
-		case ICERR_BADBITDEPTH:
-			return "Bad Bit Depth";
-		case ICERR_BADIMAGESIZE:
-			return "Bad Image Size";
-		case ICERR_CUSTOM:
-		default:
-			return "Custom Error";
-	}
+std::string FourCCFromInt32(DWORD& fccHandler) {
+	return std::string(reinterpret_cast<char*>(&fccHandler), 4);
 }
 
 bool VFW::Initialize() {
-	// Initialize MPEG-2 Rewriting Map
-	std::pair<uint8_t, double_t> native_hertz[] = {
-		std::make_pair(8, 60.0),
-		std::make_pair(7, (60000.0 / 1001.0)),
-		std::make_pair(6, 50.0),
-		std::make_pair(5, 30.0),
-		std::make_pair(4, (30000.0 / 1001.0)),
-		std::make_pair(3, 25.0),
-		std::make_pair(2, 24.0),
-		std::make_pair(1, (24000.0 / 1001.0)),
-	};
-	for (auto kv : native_hertz) {
-		PLOG_DEBUG("(MPEG-2 Rewrite) Native Framerate: %f", kv.second);
-		mpeg2hertz.insert(std::make_pair(uint64_t(kv.second * mpeg2hertz_mult),
-			std::make_tuple(kv.first, 0, 0)));
-
-	}
-	for (auto kv : native_hertz) {
-		std::stringstream buf;
-		for (uint8_t num = 0; num < (1 << 2); num++) {
-			for (uint8_t den = 0; den < (1 << 5); den++) {
-				if (num == den)
-					continue; // Don't need the 1:1 ones >_>
-
-				double_t fps = kv.second * (double_t(num + 1) / double_t(den + 1));
-				uint64_t key = uint64_t(fps * mpeg2hertz_mult);
-				if (mpeg2hertz.count(key)) {
-					continue; // Duplicate.
-				}
-
-				mpeg2hertz.insert(std::make_pair(key, std::make_tuple(kv.first, num, den)));
-				buf << fps << " (" << kv.second << " * " << num + 1 << " / " << den + 1 << "), ";
-			}
-		}
-		PLOG_DEBUG("(MPEG-2 Rewrite) Extended Framerates for native %f: %s", kv.second, buf.str().c_str());
-	}
-
 	// Initialize all VFW Encoders (we can only use one anyway)
 	ICINFO icinfo;
 	std::memset(&icinfo, 0, sizeof(ICINFO));
@@ -187,7 +250,7 @@ bool VFW::Initialize() {
 				info->hasConfigure = ICQueryConfigure(hIC);
 				info->hasAbout = ICQueryAbout(hIC);
 
-				PLOG_INFO("Registering '%s' (Id: %s, FourCC1: %s, FourCC2: %s, Codec: %s, Driver: '%s', DefQual: %ld, DefKfR: %ld)",
+				PLOG_INFO("Registering '%s' (Id: %s, FourCC1: %s, FourCC2: %s, Codec: %s, Driver: '%s', DefQual: %" PRId32 ", DefKfR: %" PRId32 ")",
 					info->Name.c_str(),
 					info->Id.c_str(),
 					info->FourCC.c_str(),
@@ -207,9 +270,229 @@ bool VFW::Initialize() {
 }
 
 bool VFW::Finalize() {
+	VFW::CodecPool::shutdown();
+
+	// Abandoned workers run our code again once their codec returns, so the
+	// module must stay loaded for as long as any of them is still stuck.
+	std::unique_lock<std::mutex> alock(_abandonedLock);
+	_abandonedCV.wait_for(alock, std::chrono::milliseconds(abandoned_unload_wait), [] {
+		return _abandonedDone.size() == _abandonedThreads.size();
+	});
+	size_t stuck = 0;
+	for (std::thread& worker : _abandonedThreads) {
+		if (_abandonedDone.count(worker.get_id()) > 0) {
+			worker.join();
+		} else {
+			worker.detach();
+			stuck++;
+		}
+	}
+	_abandonedThreads.clear();
+	_abandonedDone.clear();
+	if (stuck > 0) {
+		PLOG_WARNING("Watchdog: %" PRIu64 " abandoned codec calls never returned, keeping the plugin loaded.",
+			uint64_t(stuck));
+#ifdef _WIN32
+		HMODULE module;
+		GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+			reinterpret_cast<LPCSTR>(&VFW::Finalize), &module);
+#endif
+	}
+	return true;
+}
+
+VFW::MemoryUsage::MemoryUsage() : current(0), peak(0) {}
+
+void VFW::MemoryUsage::add(int64_t bytes) {
+	int64_t now = (current += bytes);
+	int64_t previous = peak.load();
+	while ((now > previous) && !peak.compare_exchange_weak(previous, now)) {}
+}
+
+void VFW::MemoryUsage::remove(int64_t bytes) {
+	current -= bytes;
+}
+
+VFW::SharedFrame::SharedFrame() : state(Pending), complexity(0) {}
+
+VFW::Watchdog::Watchdog() : generation(0), busy(false) {}
+
+uint64_t VFW::Watchdog::begin() {
+	std::unique_lock<std::mutex> ulock(lock);
+	busy = true;
+	started = std::chrono::high_resolution_clock::now();
+	return generation;
+}
+
+bool VFW::Watchdog::end(uint64_t generation) {
+	std::unique_lock<std::mutex> ulock(lock);
+	busy = false;
+	return this->generation == generation;
+}
+
+bool VFW::Watchdog::expire(int64_t timeout) {
+	std::unique_lock<std::mutex> ulock(lock);
+	if (!busy || (std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::high_resolution_clock::now() - started).count() < timeout))
+		return false;
+	busy = false;
+	generation++;
 	return true;
 }
 
+uint64_t VFW::Watchdog::current() {
+	std::unique_lock<std::mutex> ulock(lock);
+	return generation;
+}
+
+VFW::Info* VFW::GetInfo(const std::string& id) {
+	auto kv = _IdToInfo.find(id);
+	if (kv == _IdToInfo.end())
+		return nullptr;
+	return kv->second;
+}
+
+// Moving gradient with noise in the lower bits, so that neither spatial
+// nor temporal prediction gets it for free.
+static std::vector<std::vector<char>> BuildBenchmarkFrames(uint32_t width, uint32_t height) {
+	std::vector<std::vector<char>> frames(4);
+	uint32_t noise = 0x12345678;
+	for (size_t index = 0; index < frames.size(); index++) {
+		frames[index].resize(size_t(width) * height * 4);
+		uint8_t* px = reinterpret_cast<uint8_t*>(frames[index].data());
+		for (uint32_t y = 0; y < height; y++) {
+			for (uint32_t x = 0; x < width; x++, px += 4) {
+				noise = noise * 1664525 + 1013904223;
+				uint32_t shifted = x + uint32_t(index) * 8;
+				px[0] = uint8_t((shifted ^ y) + (noise >> 28));
+				px[1] = uint8_t(shifted + y + (noise >> 24));
+				px[2] = uint8_t(y + (noise >> 20));
+				px[3] = 255;
+			}
+		}
+	}
+	return frames;
+}
+
+static benchmark_mode_t RunBenchmarkMode(VFW::Info* info, UINT mode, const benchmark_config_t& config,
+	std::vector<std::vector<char>>& frames) {
+	benchmark_mode_t result;
+	std::memset(&result, 0, sizeof(benchmark_mode_t));
+	result.latency = UINT32_MAX;
+
+	VFW::CodecSettings settings = config.codec;
+	settings.mode = mode;
+	uint32_t fpsNum = config.fpsNum, fpsDen = config.fpsDen;
+	uint32_t keyframeInterval = (settings.keyframeInterval > 0) ? settings.keyframeInterval : UINT32_MAX;
+	std::unique_ptr<VFW::Codec> codec;
+	try {
+		codec = std::unique_ptr<VFW::Codec>(new VFW::Codec(info, settings));
+	} catch (...) {
+		return result;
+	}
+	if (codec->mode() != mode)
+		return result;
+	result.available = true;
+
+	namespace sc = std::chrono;
+	using schrc = std::chrono::high_resolution_clock;
+	int64_t frameTime = int64_t((double_t(fpsDen) / double_t(fpsNum)) * 1000000000.0);
+	std::vector<char> outbuf(codec->maxOutputSize());
+	std::vector<int64_t> times;
+	auto tbegin = schrc::now();
+	for (uint64_t index = 0; sc::duration_cast<sc::milliseconds>(schrc::now() - tbegin).count() < benchmark_time_ms; index++) {
+		bool keyframe = (index % keyframeInterval) == 0;
+		bool usePrev = config.usePrev && !keyframe;
+		DWORD dwFlags = 0, cwCompFlags = 0;
+		auto tframe = schrc::now();
+		LRESULT err = ICCompress(codec->handle(), keyframe ? ICCOMPRESS_KEYFRAME : 0,
+			&(codec->outputFormat()->bmiHeader), outbuf.data(),
+			&(codec->inputFormat()->bmiHeader), frames[index % frames.size()].data(),
+			&dwFlags, &cwCompFlags, LONG(index), config.frameSize, config.frameQuality,
+			usePrev ? &(codec->inputFormat()->bmiHeader) : NULL,
+			usePrev ? frames[(index + frames.size() - 1) % frames.size()].data() : NULL);
+		int64_t time = sc::duration_cast<sc::nanoseconds>(schrc::now() - tframe).count();
+		if (err != ICERR_OK) {
+			PLOG_WARNING("<%s> Benchmark: Unable to encode: %s.",
+				info->Name.c_str(), FormattedICCError(err).c_str());
+			result.available = false;
+			return result;
+		}
+		if (index >= benchmark_warmup)
+			times.push_back(time);
+	}
+	if (times.size() == 0)
+		return result;
+
+	// Frames that take longer than a frame period are absorbed by the queue
+	// in front of the codec, as long as the average keeps up.
+	int64_t total = 0, maximum = 0, backlog = 0, maxBacklog = 0;
+	for (int64_t time : times) {
+		total += time;
+		maximum = max(maximum, time);
+		backlog = max(backlog + time - frameTime, int64_t(0));
+		maxBacklog = max(maxBacklog, backlog);
+	}
+	result.frames = times.size();
+	result.fps = double_t(times.size()) * 1000000000.0 / double_t(total);
+	result.averageMs = double_t(total) / double_t(times.size()) / 1000000.0;
+	result.maximumMs = double_t(maximum) / 1000000.0;
+	if ((total / int64_t(times.size())) < frameTime) {
+		uint32_t latency = uint32_t((maxBacklog + frameTime - 1) / frameTime);
+		if (latency <= benchmark_max_latency)
+			result.latency = latency;
+	}
+	return result;
+}
+
+static void DescribeBenchmark(obs_property_t* p, const benchmark_t& result) {
+	const benchmark_config_t& config = result.config;
+	if (result.running) {
+		// OBS only refreshes properties after a callback, so the result shows
+		// up on the next press or when the properties are opened again.
+		obs_property_set_description(p, "Benchmark (Running, press again for the Result)");
+		obs_property_set_long_description(p, "");
+		return;
+	}
+
+	// Normal gives the better result, so it is preferred if it keeps up.
+	const char* names[] = { "Normal", "Fast" };
+	int32_t suggested = -1;
+	for (int32_t mode = 0; mode < 2; mode++) {
+		if (result.modes[mode].available && (result.modes[mode].latency != UINT32_MAX)) {
+			suggested = mode;
+			break;
+		}
+	}
+
+	std::vector<char> buf(1024);
+	if (suggested >= 0) {
+		snprintf(buf.data(), buf.size(), "Benchmark (Suggested: %s Compress Mode, Frame Latency %" PRIu32 ")",
+			names[suggested], result.modes[suggested].latency);
+	} else {
+		snprintf(buf.data(), buf.size(), "Benchmark (Codec can not keep up)");
+	}
+	obs_property_set_description(p, buf.data());
+
+	std::stringstream details;
+	snprintf(buf.data(), buf.size(), "%" PRIu32 "x%" PRIu32 " at %0.2f FPS, %s Mode, Quality %0.2f%%\n",
+		config.codec.width, config.codec.height, double_t(config.fpsNum) / double_t(config.fpsDen),
+		config.modeName, config.codec.quality / 100.0);
+	details << buf.data();
+	for (int32_t mode = 0; mode < 2; mode++) {
+		const benchmark_mode_t& bm = result.modes[mode];
+		if (!bm.available) {
+			snprintf(buf.data(), buf.size(), "%s: Unavailable\n", names[mode]);
+		} else {
+			snprintf(buf.data(), buf.size(), "%s: %0.1f FPS, %0.2f ms average, %0.2f ms maximum per frame, %s\n",
+				names[mode], bm.fps, bm.averageMs, bm.maximumMs,
+				bm.latency != UINT32_MAX ? (std::string("needs a Frame Latency of ") + std::to_string(bm.latency)).c_str() : "too slow");
+		}
+		details << buf.data();
+	}
+	obs_property_set_long_description(p, details.str().c_str());
+}
+
 const char* VFW::Encoder::get_name(void* type_data) {
 	VFW::Info* info = static_cast<VFW::Info*>(type_data);
 	return info->Name.data();
@@ -222,16 +505,41 @@ void VFW::Encoder::get_defaults(obs_data_t *settings) {
 	obs_data_set_default_double(settings, PROP_KEYFRAME_INTERVAL, 1.0);
 	obs_data_set_default_int(settings, PROP_KEYFRAME_INTERVAL2, 30);
 	obs_data_set_default_bool(settings, PROP_FORCE_KEYFRAMES, true);
+	obs_data_set_default_bool(settings, PROP_SCENE_CUT, false);
+	obs_data_set_default_bool(settings, PROP_SCENE_CUT_RESET, true);
 	obs_data_set_default_string(settings, PROP_MODE, PROP_MODE_SEQUENTIAL);
 	obs_data_set_default_string(settings, PROP_ICMODE, PROP_ICMODE_FASTCOMPRESS);
 	obs_data_set_default_int(settings, PROP_LATENCY, 3);
+	obs_data_set_default_int(settings, PROP_DECIMATION, 1);
+	obs_data_set_default_bool(settings, PROP_INCREMENTAL, false);
+	obs_data_set_default_string(settings, PROP_CAPTURE_PATH, "");
+	obs_data_set_default_string(settings, PROP_TRACE_PATH, "");
+	obs_data_set_default_string(settings, PROP_SPILL_PATH, "");
+	obs_data_set_default_int(settings, PROP_SPILL_THRESHOLD, 30);
+	obs_data_set_default_string(settings, PROP_SIMULCAST_GROUP, "");
+	obs_data_set_default_string(settings, PROP_SIMULCAST_RUNGS, "");
+	obs_data_set_default_string(settings, PROP_SIMULCAST_SOURCE, "");
+	obs_data_set_default_bool(settings, PROP_GOVERNOR, false);
+	obs_data_set_default_bool(settings, PROP_RATE_CONTROL, false);
+	obs_data_set_default_int(settings, PROP_RATE_CONTROL_BITRATE, 6000);
+	obs_data_set_default_int(settings, PROP_RATE_CONTROL_BUFFER, 1000);
+	obs_data_set_default_int(settings, PROP_MEMORY_LIMIT, 0);
+	obs_data_set_default_int(settings, PROP_MEMORY_LIMIT_GLOBAL, 0);
+	obs_data_set_default_int(settings, PROP_WATCHDOG, 0);
+	obs_data_set_default_int(settings, PROP_QUALITY_SAMPLING, 0);
+	obs_data_set_default_int(settings, PROP_ERROR_POLICY, 0);
+	obs_data_set_default_int(settings, PROP_ERROR_LIMIT, 30);
+	obs_data_set_default_bool(settings, PROP_NATIVE, false);
 }
 
 obs_properties_t* VFW::Encoder::get_properties(void *data) {
 	VFW::Info* info = static_cast<VFW::Info*>(data);
 
 	obs_properties_t* pr = obs_properties_create();
-	obs_properties_set_param(pr, data, nullptr);
+	properties_param_t* param = new properties_param_t();
+	param->info = info;
+	param->settings = nullptr;
+	obs_properties_set_param(pr, param, DestroyPropertiesParam);
 	obs_property_t* p;
 
 	p = obs_properties_add_button(pr, PROP_CONFIGURE, "Configure", cb_configure);
@@ -251,6 +559,8 @@ obs_properties_t* VFW::Encoder::get_properties(void *data) {
 	p = obs_properties_add_float(pr, PROP_KEYFRAME_INTERVAL, "Keyframe Interval", 0.00, 30.00, 0.01);
 	p = obs_properties_add_int(pr, PROP_KEYFRAME_INTERVAL2, "Keyframe Interval", 0, 300, 1);
 	p = obs_properties_add_bool(pr, PROP_FORCE_KEYFRAMES, "Force Keyframes");
+	p = obs_properties_add_bool(pr, PROP_SCENE_CUT, "Insert Keyframes at Scene Cuts");
+	p = obs_properties_add_bool(pr, PROP_SCENE_CUT_RESET, "Restart Keyframe Interval at Scene Cuts");
 
 	p = obs_properties_add_list(pr, PROP_MODE, "Mode", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
 	obs_property_list_add_string(p, "Normal", PROP_MODE_NORMAL);
@@ -263,6 +573,50 @@ obs_properties_t* VFW::Encoder::get_properties(void *data) {
 	obs_property_list_add_string(p, "Fast", PROP_ICMODE_FASTCOMPRESS);
 
 	p = obs_properties_add_int_slider(pr, PROP_LATENCY, "Frame Latency", 0, 10, 1);
+	p = obs_properties_add_list(pr, PROP_DECIMATION, "Decimation", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(p, "Every Frame", 1);
+	obs_property_list_add_int(p, "Every 2nd Frame", 2);
+	obs_property_list_add_int(p, "Every 3rd Frame", 3);
+	obs_property_list_add_int(p, "Every 4th Frame", 4);
+	p = obs_properties_add_bool(pr, PROP_INCREMENTAL, "Only copy changed Rows (Static Content)");
+	p = obs_properties_add_bool(pr, PROP_GOVERNOR, "Adapt Quality and Compress Mode to CPU Load");
+	p = obs_properties_add_bool(pr, PROP_RATE_CONTROL, "Limit Bitrate by adapting Quality");
+	obs_property_set_visible(p, ((info->icInfo2.dwFlags & VIDCF_QUALITY) != 0));
+	p = obs_properties_add_int(pr, PROP_RATE_CONTROL_BITRATE, "Bitrate Limit (kbit/s)", 100, 1000000, 100);
+	obs_property_set_visible(p, ((info->icInfo2.dwFlags & VIDCF_QUALITY) != 0));
+	p = obs_properties_add_int(pr, PROP_RATE_CONTROL_BUFFER, "Bitrate Limit Buffer (ms)", 100, 10000, 100);
+	obs_property_set_visible(p, ((info->icInfo2.dwFlags & VIDCF_QUALITY) != 0));
+	p = obs_properties_add_int(pr, PROP_MEMORY_LIMIT, "Memory Limit (MB, 0 = Unlimited)", 0, 65536, 64);
+	p = obs_properties_add_int(pr, PROP_MEMORY_LIMIT_GLOBAL, "Memory Limit for all Encoders (MB, lowest set applies, 0 = Unlimited)", 0, 65536, 64);
+	p = obs_properties_add_int(pr, PROP_WATCHDOG, "Restart stalled Codec after (Frames, 0 = Never)", 0, 300, 1);
+	p = obs_properties_add_int(pr, PROP_QUALITY_SAMPLING, "Measure Quality of every n-th Frame (0 = Never)", 0, 3600, 1);
+	p = obs_properties_add_list(pr, PROP_ERROR_POLICY, "On Compression Error", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(p, "Drop Frame", 0);
+	if ((info->icInfo2.dwFlags & VIDCF_TEMPORAL) == 0)
+		obs_property_list_add_int(p, "Repeat last Packet", 1);
+	obs_property_list_add_int(p, "Drop Frame and make next a Keyframe", 2);
+	p = obs_properties_add_int(pr, PROP_ERROR_LIMIT, "Stop after Errors in a Row (0 = Never)", 0, 1000, 1);
+	p = obs_properties_add_bool(pr, PROP_NATIVE, "Encode without the Driver (different colour conversion)");
+	obs_property_set_visible(p, NativeFormat(info) != VIDEO_FORMAT_NONE);
+
+	p = obs_properties_add_path(pr, PROP_CAPTURE_PATH, "Capture Frames To", OBS_PATH_FILE_SAVE, "Frame Capture (*.vfwc)", nullptr);
+	p = obs_properties_add_path(pr, PROP_TRACE_PATH, "Trace Frames To", OBS_PATH_FILE_SAVE, "Chrome Trace (*.json)", nullptr);
+	p = obs_properties_add_path(pr, PROP_SPILL_PATH, "Spill Packets To", OBS_PATH_FILE_SAVE, "Packet Spill (*.vfws)", nullptr);
+	p = obs_properties_add_int(pr, PROP_SPILL_THRESHOLD, "Spill Packets after (Packets)", 1, 3600, 1);
+
+	p = obs_properties_add_text(pr, PROP_SIMULCAST_GROUP, "Simulcast Group", OBS_TEXT_DEFAULT);
+	p = obs_properties_add_text(pr, PROP_SIMULCAST_RUNGS, "Simulcast Resolutions (e.g. 1280x720, 640x360)", OBS_TEXT_DEFAULT);
+	p = obs_properties_add_text(pr, PROP_SIMULCAST_SOURCE, "Use Simulcast Group (e.g. Group@640x360)", OBS_TEXT_DEFAULT);
+
+	p = obs_properties_add_button(pr, PROP_BENCHMARK, "Benchmark", cb_benchmark);
+	{
+		std::unique_lock<std::mutex> ulock(_benchmarkLock);
+		auto kv = _benchmarkResults.find(info->Id);
+		if (kv != _benchmarkResults.end()) {
+			DescribeBenchmark(p, kv->second);
+			kv->second.shown = !kv->second.running;
+		}
+	}
 
 	p = obs_properties_add_button(pr, PROP_ABOUT, "About", cb_about);
 	obs_property_set_visible(p, info->hasAbout);
@@ -275,7 +629,7 @@ bool VFW::Encoder::cb_configure(obs_properties_t *pr, obs_property_t *p, void *d
 	UNREFERENCED_PARAMETER(p);
 	UNREFERENCED_PARAMETER(data);
 
-	VFW::Info* info = static_cast<VFW::Info*>(obs_properties_get_param(pr));
+	VFW::Info* info = static_cast<properties_param_t*>(obs_properties_get_param(pr))->info;
 
 	HIC hIC = ICOpen(info->icInfo.fccType, info->icInfo.fccHandler, ICMODE_COMPRESS);
 	if (hIC == 0)
@@ -312,7 +666,7 @@ bool VFW::Encoder::cb_about(obs_properties_t *pr, obs_property_t *p, void *data)
 	UNREFERENCED_PARAMETER(p);
 	UNREFERENCED_PARAMETER(data);
 
-	VFW::Info* info = static_cast<VFW::Info*>(obs_properties_get_param(pr));
+	VFW::Info* info = static_cast<properties_param_t*>(obs_properties_get_param(pr))->info;
 	HIC hIC = ICOpen(info->icInfo.fccType, info->icInfo.fccHandler, ICMODE_COMPRESS);
 	if (hIC == 0)
 		hIC = ICOpen(info->icInfo.fccType, info->icInfo.fccHandler, ICMODE_FASTCOMPRESS);
@@ -324,10 +678,130 @@ bool VFW::Encoder::cb_about(obs_properties_t *pr, obs_property_t *p, void *data)
 	return false;
 }
 
+bool VFW::Encoder::cb_benchmark(obs_properties_t *pr, obs_property_t *p, void *data) {
+	properties_param_t* param = static_cast<properties_param_t*>(obs_properties_get_param(pr));
+	VFW::Info* info = param->info;
+	VFW::Encoder* encoder = static_cast<VFW::Encoder*>(data);
+
+	// Measure what the encoder does: A running encoder knows its scaled
+	// resolution, otherwise the settings being edited are applied to the
+	// output resolution, which is all OBS tells the properties.
+	benchmark_config_t config;
+	CompressPath path;
+	uint32_t quality, bitrate;
+	if (encoder) {
+		config.codec = encoder->m_codecSettings;
+		config.fpsNum = encoder->m_fpsNum;
+		config.fpsDen = encoder->m_fpsDen;
+		path = encoder->m_useNormalCompress ? (encoder->m_useTemporalFlag ? PathTemporal : PathNormal) : PathSequential;
+		quality = encoder->m_quality;
+		bitrate = encoder->m_bitrate;
+	} else {
+		obs_video_info ovi;
+		if (!obs_get_video_info(&ovi))
+			return false;
+		obs_data_t* settings = param->settings;
+		if (settings) {
+			obs_data_addref(settings);
+		} else {
+			settings = obs_data_create();
+			get_defaults(settings);
+		}
+		uint32_t decimation = uint32_t(max(obs_data_get_int(settings, PROP_DECIMATION), 1ll));
+		config.fpsNum = ovi.fps_num;
+		config.fpsDen = ovi.fps_den * decimation;
+		path = selectPath(obs_data_get_string(settings, PROP_MODE));
+		quality = uint32_t(obs_data_get_double(settings, PROP_QUALITY) * 100);
+		bitrate = uint32_t(obs_data_get_int(settings, PROP_BITRATE));
+		config.codec.width = ovi.output_width;
+		config.codec.height = ovi.output_height;
+		if (obs_data_get_int(settings, PROP_INTERVAL_TYPE) == 0) {
+			config.codec.keyframeInterval = uint32_t(double_t(config.fpsNum) / double_t(config.fpsDen)
+				* obs_data_get_double(settings, PROP_KEYFRAME_INTERVAL));
+		} else {
+			config.codec.keyframeInterval = (uint32_t(obs_data_get_int(settings, PROP_KEYFRAME_INTERVAL2))
+				+ decimation - 1) / decimation;
+		}
+		config.codec.sequential = (path == PathSequential);
+		config.codec.bitrate = bitrate;
+		config.codec.quality = quality;
+		config.codec.state = info->stateInfo;
+		obs_data_release(settings);
+	}
+
+	// Per frame parameters as encodeVariant() passes them.
+	bool sequential = (path == PathSequential);
+	config.usePrev = (path == PathTemporal) || (sequential
+		&& ((info->icInfo2.dwFlags & VIDCF_TEMPORAL) != 0)
+		&& ((info->icInfo2.dwFlags & VIDCF_FASTTEMPORALC) == 0));
+	config.frameQuality = (sequential || ((info->icInfo2.dwFlags & VIDCF_QUALITY) != 0)) ? quality : 0;
+	if (sequential) {
+		config.frameSize = (bitrate > 0) ? DWORD(int64_t(bitrate) * 1024 * config.fpsDen / config.fpsNum) : 0;
+	} else {
+		config.frameSize = ((info->icInfo2.dwFlags & VIDCF_CRUNCH) != 0) ? bitrate : 0;
+	}
+	config.modeName = sequential ? "Sequential" : ((path == PathTemporal) ? "Temporal" : "Normal");
+
+	// Compressing for a few seconds would freeze the properties, so it runs
+	// on a pool thread and the result is picked up by a later refresh, or
+	// by the next press if nothing refreshed them since.
+	bool start = false;
+	{
+		std::unique_lock<std::mutex> ulock(_benchmarkLock);
+		auto kv = _benchmarkResults.find(info->Id);
+		if (kv == _benchmarkResults.end()) {
+			kv = _benchmarkResults.insert(std::make_pair(info->Id, benchmark_t())).first;
+			kv->second.shown = true; // Nothing to show, start right away.
+		}
+		benchmark_t& state = kv->second;
+		if (!state.running && state.shown) {
+			state.running = true;
+			state.config = config;
+			start = true;
+		}
+		DescribeBenchmark(p, state);
+		state.shown = !state.running;
+	}
+	if (!start)
+		return true;
+
+	VFW::CodecPool::post(info, [info, config]() {
+		std::vector<std::vector<char>> frames = BuildBenchmarkFrames(config.codec.width, config.codec.height);
+		benchmark_t result;
+		result.running = false;
+		result.shown = false;
+		result.config = config;
+		result.modes[0] = RunBenchmarkMode(info, ICMODE_COMPRESS, config, frames);
+		result.modes[1] = RunBenchmarkMode(info, ICMODE_FASTCOMPRESS, config, frames);
+		for (int32_t mode = 0; mode < 2; mode++) {
+			PLOG_INFO("<%s> Benchmark at %" PRIu32 "x%" PRIu32 " %" PRIu32 "/%" PRIu32 " FPS, %s Mode, Quality %0.2f%%, "
+				"%s Compress Mode: %0.1f FPS (%0.2f ms average, %0.2f ms maximum), Frame Latency: %" PRId64 ".",
+				info->Name.c_str(), config.codec.width, config.codec.height, config.fpsNum, config.fpsDen,
+				config.modeName, config.codec.quality / 100.0,
+				mode == 0 ? "Normal" : "Fast",
+				result.modes[mode].fps, result.modes[mode].averageMs, result.modes[mode].maximumMs,
+				result.modes[mode].latency == UINT32_MAX ? int64_t(-1) : int64_t(result.modes[mode].latency));
+		}
+
+		std::unique_lock<std::mutex> ulock(_benchmarkLock);
+		_benchmarkResults[info->Id] = result;
+	});
+	return true;
+}
+
 bool VFW::Encoder::cb_modified(obs_properties_t *pr, obs_property_t *, obs_data_t *data) {
 	int64_t v = obs_data_get_int(data, PROP_INTERVAL_TYPE);
 	obs_property_set_visible(obs_properties_get(pr, PROP_KEYFRAME_INTERVAL), v == 0);
 	obs_property_set_visible(obs_properties_get(pr, PROP_KEYFRAME_INTERVAL2), v == 1);
+
+	// The settings being edited, for the Benchmark.
+	properties_param_t* param = static_cast<properties_param_t*>(obs_properties_get_param(pr));
+	if (param->settings != data) {
+		obs_data_addref(data);
+		if (param->settings)
+			obs_data_release(param->settings);
+		param->settings = data;
+	}
 	return true;
 }
 
@@ -339,18 +813,30 @@ void* VFW::Encoder::create(obs_data_t *settings, obs_encoder_t *encoder) {
 	}
 }
 
-VFW::Encoder::Encoder(obs_data_t *settings, obs_encoder_t *encoder) {
-	PLOG_DEBUG(__FUNCTION_NAME__);
+VFW::Encoder::Encoder(obs_data_t *settings, obs_encoder_t *encoder)
+	: Encoder(static_cast<VFW::Info*>(obs_encoder_get_type_data(encoder)), settings,
+		obs_encoder_get_width(encoder), obs_encoder_get_height(encoder),
+		video_output_get_info(obs_encoder_video(encoder))->fps_num,
+		video_output_get_info(obs_encoder_video(encoder))->fps_den) {
+	const video_output_info* voi = video_output_get_info(obs_encoder_video(encoder));
+	if ((m_simulcastSource.size() > 0) && !strchr(obs_data_get_string(settings, PROP_SIMULCAST_SOURCE), '@')
+		&& ((m_width != voi->width) || (m_height != voi->height))) {
+		PLOG_WARNING("<%s> OBS scales frames for this simulcast consumer only for them to be ignored, "
+			"use '%s@%" PRIu32 "x%" PRIu32 "' without rescaling the output instead.",
+			myInfo->Name.c_str(), m_simulcastSource.c_str(), m_width, m_height);
+	}
+}
 
-	myInfo = static_cast<VFW::Info*>(obs_encoder_get_type_data(encoder));
+VFW::Encoder::Encoder(VFW::Info* info, obs_data_t *settings,
+	uint32_t width, uint32_t height, uint32_t fpsNum, uint32_t fpsDen) {
+	PLOG_DEBUG("%s", __FUNCTION_NAME__);
 
-	LRESULT err = ICERR_OK;
+	myInfo = info;
 
 	// Generic information.
-	video_t* obsVideo = obs_encoder_video(encoder);
-	const struct video_output_info *voi = video_output_get_info(obsVideo);
-	m_width = obs_encoder_get_width(encoder);	m_height = obs_encoder_get_height(encoder);
-	m_fpsNum = voi->fps_num;	m_fpsDen = voi->fps_den;
+	m_width = width;	m_height = height;
+	m_decimation = uint32_t(max(obs_data_get_int(settings, PROP_DECIMATION), 1ll));
+	m_fpsNum = fpsNum;	m_fpsDen = fpsDen * m_decimation;
 	double_t factor = double_t(m_fpsNum) / double_t(m_fpsDen);
 	switch (obs_data_get_int(settings, PROP_INTERVAL_TYPE)) {
 		case 0:
@@ -359,15 +845,83 @@ VFW::Encoder::Encoder(obs_data_t *settings, obs_encoder_t *encoder) {
 			), 0);
 			break;
 		case 1:
+			// Given in source frames.
 			m_keyframeInterval =
-				(uint32_t)obs_data_get_int(settings, PROP_KEYFRAME_INTERVAL2);
+				((uint32_t)obs_data_get_int(settings, PROP_KEYFRAME_INTERVAL2) + m_decimation - 1) / m_decimation;
 			break;
 	}
 	m_forceKeyframes = obs_data_get_bool(settings, PROP_FORCE_KEYFRAMES);
+	m_sceneCut = obs_data_get_bool(settings, PROP_SCENE_CUT);
+	m_sceneCutReset = m_sceneCut && obs_data_get_bool(settings, PROP_SCENE_CUT_RESET);
+	m_sceneHistogramValid = false;
+	m_lastKeyframe = INT64_MIN / 2;
+	m_sceneCuts = 0;
 	m_bitrate = uint32_t(obs_data_get_int(settings, PROP_BITRATE));
 	m_quality = uint32_t(obs_data_get_double(settings, PROP_QUALITY) * 100);
 	m_latency = uint32_t(obs_data_get_int(settings, PROP_LATENCY));
 	m_maxQueueSize = (m_latency + 1) * 2;
+	m_memory = std::make_shared<VFW::MemoryUsage>();
+	m_memoryLimit = obs_data_get_int(settings, PROP_MEMORY_LIMIT) * 1024 * 1024;
+	m_memoryRejected = 0;
+	m_moduleMemoryLimit = 0; // Takes part once the encoder is running.
+	m_statsFrames = 0;
+	m_framesShared = 0;
+	m_backlogDepth = m_backlogPeak = m_backlogSkipped = 0;
+	m_backlogFrames = 0;
+	m_incremental = obs_data_get_bool(settings, PROP_INCREMENTAL);
+	m_incrementalUses = m_incrementalRows = m_incrementalRowsCopied = 0;
+	m_extraDataServed = false;
+	m_extraDataMismatch = false;
+	m_native = VIDEO_FORMAT_NONE;
+	m_encodeVariant = nullptr;
+	m_postProcessVariant = nullptr;
+	m_nativeFrames = 0;
+
+	// Simulcast consumers only hand out the packets of a rung of another
+	// encoder and never touch a codec themselves. OBS still scales and
+	// converts the frames for a consumer with a rescaled output, which are
+	// then ignored, so "Group@WidthxHeight" picks the rung explicitly and
+	// lets the consumer run unscaled on the output OBS renders anyway.
+	m_simulcastSource = obs_data_get_string(settings, PROP_SIMULCAST_SOURCE);
+	if (m_simulcastSource.size() > 0) {
+		m_simulcastSourceWidth = m_width;
+		m_simulcastSourceHeight = m_height;
+		size_t at = m_simulcastSource.rfind('@');
+		if (at != std::string::npos) {
+			std::stringstream rungParser(m_simulcastSource.substr(at + 1));
+			uint32_t width = 0, height = 0; char separator = 0;
+			rungParser >> width >> separator >> height;
+			if ((separator == 'x') && (width > 0) && (height > 0)) {
+				m_simulcastSourceWidth = width;
+				m_simulcastSourceHeight = height;
+			} else {
+				PLOG_WARNING("<%s> Ignoring invalid simulcast resolution '%s'.",
+					myInfo->Name.c_str(), m_simulcastSource.substr(at + 1).c_str());
+			}
+			m_simulcastSource.resize(at);
+		}
+		PLOG_INFO("<%s> Using %" PRIu32 "x%" PRIu32 " rung of simulcast group '%s'.",
+			myInfo->Name.c_str(), m_simulcastSourceWidth, m_simulcastSourceHeight, m_simulcastSource.c_str());
+		return;
+	}
+
+	// Native formats need nothing but a copy of the frame, so the driver and
+	// all threads are skipped. Simulcast rungs are fed BGRA and need a codec.
+	if (obs_data_get_bool(settings, PROP_NATIVE)) {
+		video_format native = NativeFormat(myInfo);
+		if (native == VIDEO_FORMAT_NONE) {
+			PLOG_WARNING("<%s> No native encoder for FourCC '%s', using the driver.",
+				myInfo->Name.c_str(), myInfo->FourCC.c_str());
+		} else if (strlen(obs_data_get_string(settings, PROP_SIMULCAST_GROUP)) > 0) {
+			PLOG_WARNING("<%s> Native encoding does not support simulcast, using the driver.",
+				myInfo->Name.c_str());
+		} else {
+			m_native = native;
+			PLOG_INFO("<%s> Encoding %" PRIu32 "x%" PRIu32 " natively without the driver.",
+				myInfo->Name.c_str(), m_width, m_height);
+			return;
+		}
+	}
 
 	PLOG_INFO("<%s> Initializing... ("
 		"Resolution: %" PRIu32 "x%" PRIu32 ", "
@@ -381,166 +935,364 @@ VFW::Encoder::Encoder(obs_data_t *settings, obs_encoder_t *encoder) {
 		myInfo->Name.c_str(),
 		m_width, m_height,
 		m_fpsNum, m_fpsDen, (double_t)m_fpsNum / (double_t)m_fpsDen,
-		m_bitrate, m_quality,
+		m_bitrate, m_quality / 100.0,
 		m_keyframeInterval, m_forceKeyframes ? "Enforced" : "Standard",
 		obs_data_get_string(settings, PROP_MODE),
 		obs_data_get_string(settings, PROP_ICMODE));
 
-	UINT mainIC = ICMODE_FASTCOMPRESS;
-	const char* mainICs = "Fast";
-	UINT backupIC = ICMODE_COMPRESS;
-	const char* backupICs = "Normal";
-
-	if (strcmp(obs_data_get_string(settings, PROP_ICMODE), PROP_ICMODE_COMPRESS) == 0) {
-		std::swap(mainIC, backupIC);
-		std::swap(mainICs, backupICs);
-	}
-
-	hIC = ICOpen(myInfo->icInfo.fccType, myInfo->icInfo.fccHandler, mainIC);
-	if (hIC == 0) {
-		PLOG_WARNING(
-			"<%s> Failed to initialize with %s compression mode, "
-			"falling back to %s compression mode...",
-			myInfo->Name.c_str(), mainICs, backupICs);
-		hIC = ICOpen(myInfo->icInfo.fccType, myInfo->icInfo.fccHandler, backupIC);
-		if (hIC == 0) {
-			PLOG_ERROR("<%s> Failed to initialize.",
-				myInfo->Name.c_str());
-			throw std::exception();
-		}
-	} else {
-		PLOG_DEBUG("<%s> Initialized with %s compression mode, setting up...",
-			myInfo->Name.c_str(), mainICs);
+	if (m_decimation > 1) {
+		PLOG_INFO("<%s> Encoding 1 of every %" PRIu32 " frames, %0.2f FPS output.",
+			myInfo->Name.c_str(), m_decimation, (double_t)m_fpsNum / (double_t)m_fpsDen);
 	}
 
 	// Store temporary flags
 	m_useBitrateFlag = (myInfo->icInfo2.dwFlags & VIDCF_CRUNCH) != 0;
 	m_useQualityFlag = (myInfo->icInfo2.dwFlags & VIDCF_QUALITY) != 0;
 
-	const char* emode = obs_data_get_string(settings, PROP_MODE);
-	if (strcmp(emode, PROP_MODE_NORMAL)) {
-		m_useTemporalFlag = false;
-		m_useNormalCompress = true;
-	} else if (strcmp(emode, PROP_MODE_TEMPORAL)) {
-		m_useTemporalFlag = true;
-		m_useNormalCompress = true;
-	} else {
-		m_useTemporalFlag = false;
-		m_useNormalCompress = false;
+	CompressPath path = selectPath(obs_data_get_string(settings, PROP_MODE));
+	if (!_modeChangeWarned.exchange(true)) {
+		PLOG_WARNING("<%s> Modes now compress as named. Earlier versions compressed Normal as Temporal, "
+			"and Temporal and Sequential as Normal, so output of existing configurations changes.",
+			myInfo->Name.c_str());
 	}
+	m_useTemporalFlag = (path == PathTemporal);
+	m_useNormalCompress = (path != PathSequential);
+	m_encodeVariant = selectEncodeVariant(path, m_useQualityFlag, m_forceKeyframes);
+	m_compressBitrate = m_useBitrateFlag ? m_bitrate : 0;
+	// Same as ICSeqCompressFrame: Only codecs that can't keep the previous
+	// frame themselves are handed it.
+	m_sequentialPrev = (path == PathSequential)
+		&& ((myInfo->icInfo2.dwFlags & VIDCF_TEMPORAL) != 0)
+		&& ((myInfo->icInfo2.dwFlags & VIDCF_FASTTEMPORALC) == 0);
 
-	// Load State from memory.
-	if (myInfo->stateInfo.size() > 0) {
-		err = ICSetState(hIC, myInfo->stateInfo.data(), myInfo->stateInfo.size());
-		if (err != ICERR_OK) {
-			PLOG_ERROR("Failed to set state before encoding: %s.",
-				FormattedICCError(err).c_str());
-		}
+	if ((myInfo->Id == "mvcVfwMpeg2-mmes")
+		|| (myInfo->Id == "mvcVfwMpeg2Alpha-m704")
+		|| (myInfo->Id == "mvcVfwMpeg2HD-m701")
+		|| (myInfo->Id == "mvcVfwMpeg2Alpha-m705")) {
+		m_postProcessVariant = &Encoder::postProcessVariant<QuirkMatroxMPEG2>;
+		m_mpeg2FrameRate = VFW::Kernel::FindMPEG2FrameRate(m_fpsNum, m_fpsDen);
+		PLOG_DEBUG("<%s> (MPEG-2 Rewrite) Best Match for Content: frame_rate_code %" PRIu8 ", extn: %" PRIu8 ", extd: %" PRIu8,
+			myInfo->Name.c_str(), m_mpeg2FrameRate.code, m_mpeg2FrameRate.extN, m_mpeg2FrameRate.extD);
+	} else if (strcmp(myInfo->obsInfo.codec, "h264") == 0) {
+		m_postProcessVariant = &Encoder::postProcessVariant<QuirkH264>;
 	} else {
-		ICSetState(hIC, NULL, 0);
+		m_postProcessVariant = &Encoder::postProcessVariant<QuirkNone>;
 	}
 
-#pragma region Get Bitmap Information
-	m_bufferInputBitmapInfo.resize(sizeof(BITMAPINFOHEADER));
-	std::memset(m_bufferInputBitmapInfo.data(), 0, m_bufferInputBitmapInfo.size());
-	m_inputBitmapInfo = reinterpret_cast<BITMAPINFO*>(m_bufferInputBitmapInfo.data());
-	m_inputBitmapInfo->bmiHeader.biSize = (DWORD)m_bufferInputBitmapInfo.size();
-	m_inputBitmapInfo->bmiHeader.biWidth = m_width;
-	m_inputBitmapInfo->bmiHeader.biHeight = m_height;
-	m_inputBitmapInfo->bmiHeader.biPlanes = 1;
-	m_inputBitmapInfo->bmiHeader.biBitCount = 32;
-	m_inputBitmapInfo->bmiHeader.biCompression = BI_RGB;
-	m_inputBitmapInfo->bmiHeader.biSizeImage = m_width * m_height * (m_inputBitmapInfo->bmiHeader.biBitCount / 8) * m_inputBitmapInfo->bmiHeader.biPlanes;
-
-	err = ICSendMessage(hIC, ICM_COMPRESS_GET_FORMAT, (DWORD_PTR)m_inputBitmapInfo, NULL);
-	if (err <= 0) {
-		PLOG_ERROR("Unable to retrieve format information size: %s.",
-			FormattedICCError(err).c_str());
-		throw std::exception();
+	m_codecSettings.width = m_width;
+	m_codecSettings.height = m_height;
+	m_codecSettings.mode = ICMODE_FASTCOMPRESS;
+	if (strcmp(obs_data_get_string(settings, PROP_ICMODE), PROP_ICMODE_COMPRESS) == 0)
+		m_codecSettings.mode = ICMODE_COMPRESS;
+	m_codecSettings.sequential = !m_useNormalCompress;
+	m_codecSettings.keyframeInterval = m_keyframeInterval;
+	m_codecSettings.bitrate = m_bitrate;
+	m_codecSettings.quality = m_quality;
+	m_codecSettings.state = myInfo->stateInfo;
+	m_codec = VFW::CodecPool::acquire(myInfo, m_codecSettings);
+	m_codecSettings.mode = m_codec->mode();
+	m_codecLag = 0;
+	m_flushed = true;
+
+	// Quality Sampling
+	m_qualityInterval = uint32_t(obs_data_get_int(settings, PROP_QUALITY_SAMPLING));
+	m_qualitySince = 0;
+	if (m_qualityInterval > 0) {
+		try {
+			m_qualitySampler = std::unique_ptr<VFW::QualitySampler>(
+				new VFW::QualitySampler(myInfo, m_codec->inputFormat(), m_codec->outputFormat()));
+		} catch (...) {
+			PLOG_WARNING("<%s> Unable to measure quality, continuing without.", myInfo->Name.c_str());
+		}
 	}
 
-	if (m_useTemporalFlag) {
-		m_bufferPrevInputBitmapInfo.resize(m_bufferInputBitmapInfo.size());
-		std::memcpy(m_bufferPrevInputBitmapInfo.data(), m_bufferInputBitmapInfo.data(), m_bufferInputBitmapInfo.size());
+	// CPU Budget Governor
+	m_governor = obs_data_get_bool(settings, PROP_GOVERNOR);
+	m_governorQuality = m_quality;
+	m_governorMode = m_codec->mode();
+	m_governorCooldown = governor_cooldown;
+	m_governorModeLocked = false;
+	m_governorQualityChanges = m_governorModeChanges = 0;
+
+	// External Rate Control
+	m_rateControl = obs_data_get_bool(settings, PROP_RATE_CONTROL);
+	if (m_rateControl && !m_useQualityFlag) {
+		PLOG_WARNING("<%s> Codec does not support quality, unable to limit the bitrate.",
+			myInfo->Name.c_str());
+		m_rateControl = false;
+	}
+	m_rateControlQuality = m_quality;
+	m_rateControlTarget = double_t(obs_data_get_int(settings, PROP_RATE_CONTROL_BITRATE)) * 1000.0
+		* double_t(m_fpsDen) / double_t(m_fpsNum);
+	m_rateControlBuffer = double_t(obs_data_get_int(settings, PROP_RATE_CONTROL_BITRATE))
+		* double_t(obs_data_get_int(settings, PROP_RATE_CONTROL_BUFFER));
+	m_rateControlFullness = 0;
+	m_rateControlRatio[0] = m_rateControlRatio[1] = 0;
+	m_rateControlBits = m_rateControlFrames = m_rateControlOverflows = 0;
+
+	// Stall Watchdog
+	m_watchdog = std::make_shared<VFW::Watchdog>();
+	m_watchdogTimeout = obs_data_get_int(settings, PROP_WATCHDOG)
+		* int64_t((double_t(m_fpsDen) / double_t(m_fpsNum)) * 1000000000.0);
+	m_watchdogPending = false;
+	m_encodeStopped = false;
+	m_watchdogStalls = m_watchdogRestarts = 0;
+	m_forceKeyframe = false;
+
+	// Compression Errors
+	m_errorPolicy = ErrorPolicy(max(min(obs_data_get_int(settings, PROP_ERROR_POLICY), 2ll), 0ll));
+	if ((m_errorPolicy == ErrorRepeat) && ((myInfo->icInfo2.dwFlags & VIDCF_TEMPORAL) != 0)) {
+		// A repeated packet of a codec that refers to other frames breaks
+		// every frame that refers to the one it stands in for.
+		PLOG_WARNING("<%s> Repeating the last packet needs an intra-only codec, dropping failed frames instead.",
+			myInfo->Name.c_str());
+		m_errorPolicy = ErrorDrop;
+	}
+	m_errorLimit = uint32_t(obs_data_get_int(settings, PROP_ERROR_LIMIT));
+	m_errorsConsecutive = 0;
+	m_errors = 0;
+	m_failed = false;
+	m_lastGoodKeyframe = false;
+
+	// Frame Capture
+	const char* capturePath = obs_data_get_string(settings, PROP_CAPTURE_PATH);
+	if (capturePath && (strlen(capturePath) > 0)) {
+		try {
+			m_captureWriter = std::unique_ptr<VFW::CaptureWriter>(new VFW::CaptureWriter(
+				capturePath, m_width, m_height, m_fpsNum, m_fpsDen, VIDEO_FORMAT_BGRA));
+			PLOG_INFO("<%s> Capturing frames to '%s'.", myInfo->Name.c_str(), capturePath);
+		} catch (...) {
+			PLOG_WARNING("<%s> Unable to capture frames to '%s', continuing without.",
+				myInfo->Name.c_str(), capturePath);
+		}
 	}
 
-	m_bufferOutputBitmapInfo.resize(err);
-	std::memset(m_bufferOutputBitmapInfo.data(), 0, m_bufferOutputBitmapInfo.size());
-	m_outputBitmapInfo = (BITMAPINFO*)m_bufferOutputBitmapInfo.data();
-	m_outputBitmapInfo->bmiHeader.biSize = (DWORD)m_bufferOutputBitmapInfo.size();
-	err = ICSendMessage(hIC, ICM_COMPRESS_GET_FORMAT, (DWORD_PTR)m_inputBitmapInfo, (DWORD_PTR)m_outputBitmapInfo);
-	if (err != ICERR_OK) {
-		PLOG_ERROR("Unable to retrieve format information: %s.",
-			FormattedICCError(err).c_str());
-		throw std::exception();
+	// Frame Trace
+	const char* tracePath = obs_data_get_string(settings, PROP_TRACE_PATH);
+	if (tracePath && (strlen(tracePath) > 0)) {
+		try {
+			m_tracer = std::make_shared<VFW::Tracer>(tracePath, myInfo->Name);
+			PLOG_INFO("<%s> Tracing frames to '%s'.", myInfo->Name.c_str(), tracePath);
+		} catch (...) {
+			PLOG_WARNING("<%s> Unable to trace frames to '%s', continuing without.",
+				myInfo->Name.c_str(), tracePath);
+		}
 	}
-#pragma endregion Get Bitmap Information
 
-	// Prepare Input Buffers
-	size_t alignedWidth = (m_width / 16 + 1) * 16;
-	const size_t bufferSize = alignedWidth * m_height * 4;
-	m_bufferInput.resize(bufferSize);
-	m_bufferPrevInput.resize(bufferSize);
+	// Packet Spill, the file is only created once it is needed.
+	m_spillPath = obs_data_get_string(settings, PROP_SPILL_PATH);
+	m_spillThreshold = 0;
+	if (m_spillPath.size() > 0) {
+		m_spillThreshold = size_t(max(obs_data_get_int(settings, PROP_SPILL_THRESHOLD), 1ll));
+		PLOG_INFO("<%s> Spilling packets to '%s' after %" PRIu64 " packets.",
+			myInfo->Name.c_str(), m_spillPath.c_str(), uint64_t(m_spillThreshold));
+	}
+	m_spilledCount = 0;
+	m_spillPackets = m_spillBytes = m_spillCompactions = 0;
+	m_spillPeak = 0;
+
+	// Simulcast Rungs, each one a full encoder that is fed from our pre-processing.
+	m_simulcastGroup = obs_data_get_string(settings, PROP_SIMULCAST_GROUP);
+	if (m_simulcastGroup.size() > 0) {
+		obs_data_t* rungSettings = obs_data_create();
+		obs_data_apply(rungSettings, settings);
+		obs_data_set_string(rungSettings, PROP_SIMULCAST_GROUP, "");
+		obs_data_set_string(rungSettings, PROP_SIMULCAST_RUNGS, "");
+		obs_data_set_string(rungSettings, PROP_CAPTURE_PATH, "");
+		obs_data_set_string(rungSettings, PROP_TRACE_PATH, "");
+		obs_data_set_string(rungSettings, PROP_SPILL_PATH, "");
+		obs_data_set_bool(rungSettings, PROP_NATIVE, false);
+		obs_data_set_int(rungSettings, PROP_QUALITY_SAMPLING, 0);
+
+		std::stringstream rungs(obs_data_get_string(settings, PROP_SIMULCAST_RUNGS));
+		std::string rung;
+		while (std::getline(rungs, rung, ',')) {
+			std::stringstream rungParser(rung);
+			uint32_t width = 0, height = 0; char separator = 0;
+			rungParser >> width >> separator >> height;
+			if ((separator != 'x') || (width == 0) || (height == 0)
+				|| (width > m_width) || (height > m_height)) {
+				PLOG_WARNING("<%s> Ignoring invalid simulcast resolution '%s'.",
+					myInfo->Name.c_str(), rung.c_str());
+				continue;
+			}
 
-	// Begin Compression
-	if (m_useNormalCompress) {
-		err = ICCompressBegin(hIC, m_inputBitmapInfo, m_outputBitmapInfo);
-		if (err != ICERR_OK) {
-			PLOG_ERROR("Unable to begin encoding: %s.", FormattedICCError(err).c_str());
-			throw std::runtime_error(FormattedICCError(err));
+			try {
+				m_simulcastRungs.push_back(std::make_shared<VFW::Encoder>(
+					myInfo, rungSettings, width, height, fpsNum, fpsDen));
+			} catch (...) {
+				PLOG_WARNING("<%s> Unable to create %" PRIu32 "x%" PRIu32 " simulcast rung.",
+					myInfo->Name.c_str(), width, height);
+			}
 		}
+		obs_data_release(rungSettings);
 
-		DWORD size = ICCompressGetSize(hIC, m_inputBitmapInfo, m_outputBitmapInfo);
-		m_bufferOutput.resize(size);
-	} else {
-		std::memset(&cv, 0, sizeof(COMPVARS));
-		cv.cbSize = sizeof(COMPVARS);
-		cv.dwFlags = ICMF_COMPVARS_VALID;
-		cv.hic = hIC;
-		cv.fccType = myInfo->icInfo2.fccType;
-		cv.fccHandler = myInfo->icInfo2.fccHandler;
-		cv.lpbiOut = m_outputBitmapInfo;
-		cv.lKey = m_keyframeInterval;
-		cv.lDataRate = m_bitrate;
-		cv.lQ = m_quality;
-
-		if (!ICSeqCompressFrameStart(&cv, m_inputBitmapInfo)) {
-			PLOG_ERROR("Unable to begin encoding.");
-			throw std::exception();
+		std::unique_lock<std::mutex> slock(_simulcastLock);
+		auto& group = _simulcastGroups[m_simulcastGroup];
+		for (auto& rungEncoder : m_simulcastRungs) {
+			group.push_back(rungEncoder);
 		}
+		PLOG_INFO("<%s> Simulcast group '%s' with %" PRIu64 " additional rungs.",
+			myInfo->Name.c_str(), m_simulcastGroup.c_str(), uint64_t(m_simulcastRungs.size()));
 	}
 
 	// Thread stuff. These can't fail in most situations.
+	m_inline = false;
+	m_timePreProcess = m_timeEncode = m_timePostProcess = 0;
+	m_timingSamples = 0;
 	m_threadShutdown = false;
 	m_preProcessData.worker = std::thread(threadMain, this, 0);
 	m_encodeData.worker = std::thread(threadMain, this, 1);
 	m_postProcessData.worker = std::thread(threadMain, this, 2);
 
+	m_moduleMemoryLimit = obs_data_get_int(settings, PROP_MEMORY_LIMIT_GLOBAL) * 1024 * 1024;
+	if (m_moduleMemoryLimit > 0) {
+		std::unique_lock<std::mutex> mlock(_moduleMemoryLimitsLock);
+		_moduleMemoryLimits.insert(m_moduleMemoryLimit);
+		_moduleMemoryLimit = *_moduleMemoryLimits.begin();
+	}
+
 	PLOG_INFO("<%s> Started.",
 		myInfo->Name.c_str());
 }
 
 void VFW::Encoder::destroy(void* data) {
-	delete static_cast<VFW::Encoder*>(data);
+	// OBS needs nothing from us anymore, so stopping happens in the background.
+	VFW::Encoder* encoder = static_cast<VFW::Encoder*>(data);
+	VFW::CodecPool::post(encoder->myInfo, [encoder]() {
+		delete encoder;
+	});
 }
 
 VFW::Encoder::~Encoder() {
+	if (m_moduleMemoryLimit > 0) {
+		std::unique_lock<std::mutex> mlock(_moduleMemoryLimitsLock);
+		_moduleMemoryLimits.erase(_moduleMemoryLimits.find(m_moduleMemoryLimit));
+		_moduleMemoryLimit = (_moduleMemoryLimits.size() > 0) ? *_moduleMemoryLimits.begin() : 0;
+	}
+
+	if (m_simulcastSource.size() > 0)
+		return;
+	if (m_native != VIDEO_FORMAT_NONE) {
+		PLOG_INFO("<%s> Encoded %" PRIu64 " frames natively.", myInfo->Name.c_str(), m_nativeFrames);
+		return;
+	}
+
+	// Packets can only be handed out by encode(), so whatever OBS did not
+	// retrieve with encode() without a frame before this is lost.
+	if (!m_flushed) {
+		std::unique_lock<std::mutex> ulock(m_preProcessData.lock);
+		std::unique_lock<std::mutex> elock(m_encodeData.lock);
+		std::unique_lock<std::mutex> plock(m_postProcessData.lock);
+		PLOG_WARNING("<%s> Destroyed without being drained, %" PRIu64 " frames in the pipeline and %" PRIu64 " in the codec are lost.",
+			myInfo->Name.c_str(),
+			uint64_t(m_preProcessData.data.size() + m_encodeData.data.size() + m_postProcessData.data.size()),
+			uint64_t(m_pendingFrames.size()));
+	}
+	if ((m_finalPackets.size() + m_spilledCount) > 0) {
+		PLOG_WARNING("<%s> Discarding %" PRIu64 " packets that were not retrieved.",
+			myInfo->Name.c_str(), uint64_t(m_finalPackets.size() + m_spilledCount));
+	}
+
 	m_threadShutdown = true;
 	m_preProcessData.cv.notify_all();
 	m_preProcessData.worker.join();
 	m_encodeData.cv.notify_all();
-	m_encodeData.worker.join();
+	if (m_encodeData.worker.joinable()) {
+		// This runs on a pool thread, which CodecPool::shutdown() waits for
+		// when OBS exits, so a codec that stalls now is left behind too.
+		int64_t timeout = (m_watchdogTimeout > 0) ? m_watchdogTimeout : (abandoned_unload_wait * 1000000);
+		bool stopped = false;
+		while (!stopped) {
+			if (m_watchdog->expire(timeout)) {
+				PLOG_WARNING("<%s> Watchdog: Codec did not return within %" PRId64 "ms while stopping, abandoning it.",
+					myInfo->Name.c_str(), timeout / 1000000);
+				m_watchdogStalls++;
+				abandonWorker();
+				break;
+			}
+			std::unique_lock<std::mutex> elock(m_encodeData.lock);
+			m_encodeData.cv.notify_all();
+			stopped = m_encodeData.cv.wait_for(elock, std::chrono::milliseconds(flush_watchdog_interval), [this] {
+				return m_encodeStopped;
+			});
+		}
+		if (m_encodeData.worker.joinable())
+			m_encodeData.worker.join();
+	}
 	m_postProcessData.cv.notify_all();
 	m_postProcessData.worker.join();
 
-	if (m_useNormalCompress) {
-		ICCompressEnd(hIC);
-	} else {
-		ICSeqCompressFrameEnd(&cv);
-		//ICCompressorFree(&cv);		
+	if (m_simulcastGroup.size() > 0) {
+		std::unique_lock<std::mutex> slock(_simulcastLock);
+		auto& group = _simulcastGroups[m_simulcastGroup];
+		for (auto& rungEncoder : m_simulcastRungs) {
+			for (auto it = group.begin(); it != group.end(); it++) {
+				if (it->lock() == rungEncoder) {
+					group.erase(it);
+					break;
+				}
+			}
+		}
+		if (group.size() == 0)
+			_simulcastGroups.erase(m_simulcastGroup);
 	}
 
-	ICClose(hIC);
+	VFW::CodecPool::release(m_codec);
+	m_codec = nullptr;
+
+	m_prevInput = nullptr;
+	logStatistics();
+
+	if (m_rateControl && (m_rateControlFrames > 0)) {
+		PLOG_INFO("<%s> Rate Control: %0.0f kbit/s average of %0.0f kbit/s, buffer overflowed %" PRIu64 " times, quality now %0.2f%%.",
+			myInfo->Name.c_str(),
+			double_t(m_rateControlBits) / double_t(m_rateControlFrames) * double_t(m_fpsNum) / double_t(m_fpsDen) / 1000.0,
+			m_rateControlTarget * double_t(m_fpsNum) / double_t(m_fpsDen) / 1000.0,
+			m_rateControlOverflows, double_t(m_rateControlQuality) / 100.0);
+	}
+
+	if (m_sceneCut) {
+		PLOG_INFO("<%s> Scene Cuts: %" PRIu64 " keyframes inserted.", myInfo->Name.c_str(), m_sceneCuts);
+	}
+
+	if (m_incremental && (m_incrementalRows > 0)) {
+		PLOG_INFO("<%s> Incremental Input: %0.2f%% of rows copied, %" PRIu64 " buffers.",
+			myInfo->Name.c_str(), double_t(m_incrementalRowsCopied) * 100.0 / double_t(m_incrementalRows),
+			uint64_t(m_incrementalBuffers.size()));
+	}
+	m_incrementalBuffers.clear();
+
+	if (m_errors > 0) {
+		PLOG_WARNING("<%s> Compression failed for %" PRIu64 " frames.", myInfo->Name.c_str(), m_errors);
+	}
+
+	if (m_watchdogStalls > 0) {
+		PLOG_WARNING("<%s> Watchdog: Codec stalled %" PRIu64 " times, restarted %" PRIu64 " times.",
+			myInfo->Name.c_str(), m_watchdogStalls, m_watchdogRestarts);
+	}
+
+	if (m_governor) {
+		PLOG_INFO("<%s> Governor: %" PRIu64 " quality changes (now %0.2f%%), %" PRIu64 " compression mode changes (now %s).",
+			myInfo->Name.c_str(),
+			m_governorQualityChanges, double_t(m_governorQuality) / 100.0,
+			m_governorModeChanges, m_governorMode == ICMODE_COMPRESS ? "Normal" : "Fast");
+	}
+
+	if (m_captureWriter) {
+		m_captureWriter->finish();
+		PLOG_INFO("<%s> Captured %" PRIu64 " frames, %" PRIu64 " dropped while writing fell behind.",
+			myInfo->Name.c_str(), uint64_t(m_captureWriter->count()), uint64_t(m_captureWriter->dropped()));
+	}
+
+	if (m_spillPackets > 0) {
+		PLOG_INFO("<%s> Spilled %" PRIu64 " packets (%0.1f MB) to disk, at most %" PRIu64 " at once, compacted %" PRIu64 " times.",
+			myInfo->Name.c_str(), m_spillPackets, double_t(m_spillBytes) / 1048576.0, uint64_t(m_spillPeak), m_spillCompactions);
+	}
+	if (m_spillFile) {
+		m_spillFile = nullptr;
+		DeleteFileA(m_spillPath.c_str());
+	}
 }
 
 bool VFW::Encoder::encode(void *data, struct encoder_frame *frame, struct encoder_packet *packet, bool *received_packet) {
@@ -553,8 +1305,107 @@ bool VFW::Encoder::encode(struct encoder_frame *frame, struct encoder_packet *pa
 	namespace sc = std::chrono;
 	using schrc = std::chrono::high_resolution_clock;
 
+	if (m_simulcastSource.size() > 0)
+		return encodeSimulcast(frame, packet, received_packet);
+
+	// Decimated frames are dropped before anything touches them. Packets keep
+	// their original timestamps, so the spacing stays correct.
+	if (frame && (m_decimation > 1) && ((frame->pts % m_decimation) != 0)) {
+		if (m_native == VIDEO_FORMAT_NONE)
+			*received_packet = takePacket(packet, m_latency);
+		return true;
+	}
+
+	if (m_native != VIDEO_FORMAT_NONE)
+		return encodeNative(frame, packet, received_packet);
+	if (m_failed)
+		return false;
+	checkWatchdog();
+	VFW::TraceSpan traceSpan(m_tracer, "Encode Call", frame ? frame->pts : -1);
+	if (m_tracer)
+		m_tracer->nameThread("OBS");
+
+	// Without a frame the pipeline and the codec are drained first, and then
+	// the remaining packets are handed out one per call.
+	if (!frame) {
+		if (!m_flushed)
+			flush();
+		*received_packet = takePacket(packet, 0);
+		return true;
+	}
+
+	m_flushed = false;
+	if (m_captureWriter) {
+		try {
+			m_captureWriter->write(frame);
+		} catch (...) {
+			PLOG_ERROR("<%s> Frame capture failed, stopping capture.", myInfo->Name.c_str());
+			m_captureWriter = nullptr;
+		}
+	}
+
+	// OBS still calls at the source frame rate.
+	long long maxTime = size_t((double_t(m_fpsDen / m_decimation) / double_t(m_fpsNum)) * 1000000000ll);
+	updateTopology(maxTime);
+	if ((++m_statsFrames % (uint64_t(stats_interval) * m_fpsNum / m_fpsDen)) == 0)
+		logStatistics();
+	if (m_inline) {
+		// Nothing is queued, but the frame copy still counts against the limits.
+		if (!isMemoryAvailable(int64_t(frame->linesize[0]) * m_height)) {
+			m_memoryRejected++;
+			return true;
+		}
+		std::shared_ptr<VFW::SharedFrame> shared;
+		frame_t kv = std::make_tuple(
+			acquireInput(frame, shared),
+			frame->pts,
+			false, 0u);
+		auto tstage = schrc::now();
+		{
+			VFW::TraceSpan span(m_tracer, "PreProcess", std::get<1>(kv));
+			bool sceneCut = false;
+			std::get<3>(kv) = preProcessFrame(std::get<0>(kv), std::get<1>(kv), shared, sceneCut);
+			std::get<2>(kv) = sceneCut;
+		}
+		updateTiming(m_timePreProcess, tstage);
+		tstage = schrc::now();
+		bool produced = encodeFrame(kv);
+		updateTiming(m_timeEncode, tstage);
+		m_timingSamples++;
+		if (produced) {
+			tstage = schrc::now();
+			{
+				VFW::TraceSpan span(m_tracer, "PostProcess", std::get<1>(kv));
+				postProcessFrame(kv);
+			}
+			updateTiming(m_timePostProcess, tstage);
+
+			getPacket(kv, packet);
+			*received_packet = true;
+		}
+		return true;
+	}
+
+	// One packet goes out per frame that comes in, so a backlog left by a
+	// stall would never shrink by itself. Skipped frames never reach the
+	// codec, which keeps this safe for codecs that refer to other frames,
+	// but frames the keyframe interval lands on are always taken.
 	bool submittedFrame = false;
-	long long maxTime = size_t((double_t(m_fpsDen) / double_t(m_fpsNum)) * 1000000000ll);
+	if (m_backlogDepth > m_latency) {
+		if (++m_backlogFrames == backlog_frames) {
+			PLOG_INFO("<%s> %" PRIu64 " packets queued for a latency of %" PRIu32 ", skipping frames to catch up.",
+				myInfo->Name.c_str(), m_backlogDepth, m_latency);
+		}
+		bool keyframeSlot = !m_sceneCutReset && (m_keyframeInterval > 0)
+			&& (((frame->pts / m_decimation) % m_keyframeInterval) == 0);
+		if ((m_backlogFrames >= backlog_frames) && !keyframeSlot) {
+			submittedFrame = true;
+			m_backlogSkipped++;
+		}
+	} else {
+		m_backlogFrames = 0;
+	}
+
 	while (((*received_packet == false) || (submittedFrame == false))
 		&& (sc::nanoseconds((schrc::now() - tbegin)).count() < maxTime)) {
 		// Submit frame to PreProcessor
@@ -564,78 +1415,545 @@ bool VFW::Encoder::encode(struct encoder_frame *frame, struct encoder_packet *pa
 			std::unique_lock<std::mutex> plock(m_postProcessData.lock);
 			if ((m_preProcessData.data.size() < m_maxQueueSize)
 				&& (m_encodeData.data.size() < m_maxQueueSize)
-				&& (m_postProcessData.data.size() < m_maxQueueSize)) {
+				&& (m_postProcessData.data.size() < m_maxQueueSize)
+				&& isMemoryAvailable(int64_t(frame->linesize[0]) * m_height)) {
+				std::shared_ptr<VFW::SharedFrame> shared;
 				m_preProcessData.data.push(std::make_tuple(
-					std::make_shared<std::vector<char>>(frame->data[0], frame->data[0] + (frame->linesize[0] * this->m_height)),
+					acquireInput(frame, shared),
 					frame->pts,
-					false));
+					false, 0u));
+				m_preProcessShared.push(shared);
+				if (m_tracer)
+					m_tracer->enqueue(VFW::Tracer::QueuePreProcess, frame->pts);
 				submittedFrame = true;
 				m_preProcessData.cv.notify_all();
 			}
 		}
 
 		if (!*received_packet) {
+			*received_packet = takePacket(packet, m_latency);
 			std::unique_lock<std::mutex> ulock(m_finalPacketsLock);
-			if (m_finalPackets.size() > m_latency) {
-				auto front = m_finalPackets.front();
-				m_donotuse_datastor = std::get<0>(front);
-				packet->type = OBS_ENCODER_VIDEO;
-				packet->data = reinterpret_cast<uint8_t*>(m_donotuse_datastor->data());
-				packet->size = m_donotuse_datastor->size();
-				packet->pts = packet->dts = std::get<1>(front);
-				packet->keyframe = std::get<2>(front);
-				*received_packet = true;
-				m_finalPackets.pop();
-			#ifdef _DEBUG
-				PLOG_DEBUG("<%s> PTS: %" PRIu32 ", DTS: %" PRIu32 ", Keyframe: %s, Size: %" PRIu32,
-					myInfo->Name.c_str(), packet->pts, packet->dts, packet->keyframe ? "Yes" : "No", packet->size);
-			#endif
-			}
+			m_backlogDepth = m_finalPackets.size() + m_spilledCount;
+			m_backlogPeak = max(m_backlogPeak, m_backlogDepth);
 		}
 
 		std::this_thread::sleep_for(sc::milliseconds(1));
 	}
+	if (!submittedFrame && !isMemoryAvailable(int64_t(frame->linesize[0]) * m_height))
+		m_memoryRejected++;
 
 	return true;
 }
 
-bool VFW::Encoder::update(void *data, obs_data_t *settings) {
-	return static_cast<VFW::Encoder*>(data)->update(settings);
-}
-
-bool VFW::Encoder::update(obs_data_t* settings) {
-	UNREFERENCED_PARAMETER(settings);
-	return false;
-}
+bool VFW::Encoder::encodeOffline(struct encoder_frame *frame, struct encoder_packet *packet, bool *received_packet) {
+	if (!frame || (m_simulcastSource.size() > 0)) {
+		encode(frame, packet, received_packet);
+		return false;
+	}
+	if (m_failed)
+		return false;
+	if ((m_decimation > 1) && ((frame->pts % m_decimation) != 0))
+		return false;
+	if (m_native != VIDEO_FORMAT_NONE)
+		return encodeNative(frame, packet, received_packet);
+
+	// Always on the worker threads, nothing here is timed.
+	m_flushed = false;
+	while (!m_failed) {
+		checkWatchdog();
+		{
+			std::unique_lock<std::mutex> ulock(m_preProcessData.lock);
+			std::unique_lock<std::mutex> elock(m_encodeData.lock);
+			std::unique_lock<std::mutex> plock(m_postProcessData.lock);
+			if ((m_preProcessData.data.size() < m_maxQueueSize)
+				&& (m_encodeData.data.size() < m_maxQueueSize)
+				&& (m_postProcessData.data.size() < m_maxQueueSize)
+				&& isMemoryAvailable(int64_t(frame->linesize[0]) * m_height)) {
+				std::shared_ptr<VFW::SharedFrame> shared;
+				m_preProcessData.data.push(std::make_tuple(
+					acquireInput(frame, shared),
+					frame->pts,
+					false, 0u));
+				m_preProcessShared.push(shared);
+				if (m_tracer)
+					m_tracer->enqueue(VFW::Tracer::QueuePreProcess, frame->pts);
+				m_preProcessData.cv.notify_all();
+				break;
+			}
+		}
 
-bool VFW::Encoder::get_extra_data(void *data, uint8_t **extra_data, size_t *size) {
-	return static_cast<VFW::Encoder*>(data)->get_extra_data(extra_data, size);
-}
+		// Packets keep coming out while waiting, so hand one out if there is
+		// none yet to keep the backlog from growing.
+		if (!*received_packet)
+			*received_packet = takePacket(packet, m_latency);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	if (m_failed)
+		return false;
 
-bool VFW::Encoder::get_extra_data(uint8_t** extra_data, size_t* size) {
-	UNREFERENCED_PARAMETER(extra_data);
-	UNREFERENCED_PARAMETER(size);
-	extra_data = nullptr;
-	size = 0;
+	if (!*received_packet)
+		*received_packet = takePacket(packet, m_latency);
 	return true;
 }
 
-bool VFW::Encoder::get_sei_data(void *data, uint8_t **sei_data, size_t *size) {
-	return static_cast<VFW::Encoder*>(data)->get_sei_data(sei_data, size);
-}
+std::vector<char> VFW::Encoder::outputFormat() {
+	if (m_native == VIDEO_FORMAT_NONE) {
+		const char* format = reinterpret_cast<const char*>(m_codec->outputFormat());
+		return std::vector<char>(format, format + m_codec->outputFormatSize());
+	}
 
-bool VFW::Encoder::get_sei_data(uint8_t** sei_data, size_t* size) {
-	UNREFERENCED_PARAMETER(sei_data);
-	UNREFERENCED_PARAMETER(size);
-	return false;
+	// What the driver would report, packets are the planes one after another.
+	uint32_t heights[MAX_AV_PLANES], bytes[MAX_AV_PLANES];
+	VFW::GetPlaneHeights(m_native, m_height, heights);
+	VFW::GetPlaneRowBytes(m_native, m_width, bytes);
+	std::vector<char> format(sizeof(BITMAPINFOHEADER), 0);
+	BITMAPINFOHEADER* header = reinterpret_cast<BITMAPINFOHEADER*>(format.data());
+	header->biSize = sizeof(BITMAPINFOHEADER);
+	header->biWidth = m_width;
+	header->biHeight = m_height;
+	header->biPlanes = 1;
+	header->biBitCount = 12;
+	header->biCompression = mmioFOURCC('I', '4', '2', '0');
+	for (size_t plane = 0; plane < MAX_AV_PLANES; plane++) {
+		header->biSizeImage += bytes[plane] * heights[plane];
+	}
+	return format;
 }
 
-void VFW::Encoder::get_video_info(void *data, struct video_scale_info *info) {
-	return static_cast<VFW::Encoder*>(data)->get_video_info(info);
-}
+std::shared_ptr<std::vector<char>> VFW::Encoder::acquireInput(struct encoder_frame* frame, std::shared_ptr<VFW::SharedFrame>& shared) {
+	if (m_incremental)
+		return acquireIncremental(frame);
 
-void VFW::Encoder::get_video_info(struct video_scale_info *info) {
-	info->format = VIDEO_FORMAT_BGRA;
+	// Encoders on the same video output get the same frame data, so the
+	// first one to see a frame makes the copy that all of them use.
+	shared_frame_key_t key = std::make_tuple(uintptr_t(frame->data[0]), frame->pts,
+		m_width, m_height, uint32_t(frame->linesize[0]));
+	{
+		std::unique_lock<std::mutex> slock(_sharedFramesLock);
+		for (auto it = _sharedFrames.begin(); it != _sharedFrames.end();) {
+			if (it->second.first.expired()) {
+				it = _sharedFrames.erase(it);
+			} else {
+				it++;
+			}
+		}
+
+		auto kv = _sharedFrames.find(key);
+		if (kv != _sharedFrames.end()) {
+			std::shared_ptr<std::vector<char>> buffer = kv->second.first.lock();
+			if (buffer) {
+				shared = kv->second.second;
+				m_framesShared++;
+				return buffer;
+			}
+		}
+	}
+
+	std::shared_ptr<std::vector<char>> buffer = allocateBuffer(frame->data[0], frame->linesize[0] * this->m_height);
+	shared = std::make_shared<VFW::SharedFrame>();
+	std::unique_lock<std::mutex> slock(_sharedFramesLock);
+	if (_sharedFrames.count(key) == 0)
+		_sharedFrames.insert(std::make_pair(key, std::make_pair(std::weak_ptr<std::vector<char>>(buffer), shared)));
+	return buffer;
+}
+
+std::shared_ptr<std::vector<char>> VFW::Encoder::acquireIncremental(struct encoder_frame* frame) {
+	size_t lineSize = frame->linesize[0];
+	size_t rowBytes = size_t(m_width) * 4;
+	m_incrementalHashes.resize(m_height);
+	VFW::Kernel::HashRows(frame->data[0], lineSize, rowBytes, m_height, m_incrementalHashes.data());
+
+	// Only buffers that no stage and no codec holds anymore can be written
+	// to, and the most recently used of those has the fewest rows to copy.
+	incremental_t* entry = nullptr;
+	for (incremental_t& kv : m_incrementalBuffers) {
+		if ((kv.buffer.use_count() == 1) && (!entry || (kv.used > entry->used)))
+			entry = &kv;
+	}
+	bool fresh = false;
+	if (!entry || (entry->buffer->size() != (lineSize * m_height))) {
+		if (!entry) {
+			m_incrementalBuffers.push_back(incremental_t());
+			entry = &m_incrementalBuffers.back();
+		}
+		entry->buffer = allocateBuffer(lineSize * m_height);
+		fresh = true;
+	}
+	entry->used = ++m_incrementalUses;
+
+	uint8_t* dst = reinterpret_cast<uint8_t*>(entry->buffer->data());
+	for (uint32_t row = 0; row < m_height; row++) {
+		if (!fresh && (entry->hashes[row] == m_incrementalHashes[row]))
+			continue;
+		std::memcpy(dst + size_t(m_height - row - 1) * lineSize, frame->data[0] + size_t(row) * lineSize, rowBytes);
+		m_incrementalRowsCopied++;
+	}
+	m_incrementalRows += m_height;
+	entry->hashes.swap(m_incrementalHashes);
+	return entry->buffer;
+}
+
+std::shared_ptr<std::vector<char>> VFW::Encoder::allocateBuffer(size_t size) {
+	// Buffers are accounted with their allocated size until they are released.
+	std::shared_ptr<VFW::MemoryUsage> memory = m_memory;
+	int64_t bytes = int64_t(size);
+	memory->add(bytes);
+	_moduleMemory.add(bytes);
+	return std::shared_ptr<std::vector<char>>(new std::vector<char>(size), [memory, bytes](std::vector<char>* buffer) {
+		memory->remove(bytes);
+		_moduleMemory.remove(bytes);
+		delete buffer;
+	});
+}
+
+std::shared_ptr<std::vector<char>> VFW::Encoder::allocateBuffer(const void* data, size_t size) {
+	std::shared_ptr<std::vector<char>> buffer = allocateBuffer(size);
+	std::memcpy(buffer->data(), data, size);
+	return buffer;
+}
+
+bool VFW::Encoder::isMemoryAvailable(int64_t bytes) {
+	if ((m_memoryLimit > 0) && ((m_memory->current + bytes) > m_memoryLimit))
+		return false;
+	int64_t moduleLimit = _moduleMemoryLimit;
+	if ((moduleLimit > 0) && ((_moduleMemory.current + bytes) > moduleLimit))
+		return false;
+	return true;
+}
+
+void VFW::Encoder::logStatistics() {
+	PLOG_INFO("<%s> Statistics: "
+		"Memory: %0.1f MB (Peak %0.1f MB), "
+		"All Encoders: %0.1f MB (Peak %0.1f MB), "
+		"Frames rejected for Memory: %" PRIu64 ", "
+		"Codec Stalls: %" PRIu64 " (%" PRIu64 " Restarts), "
+		"Frames shared with other Encoders: %" PRIu64 ", "
+		"Packets queued: %" PRIu64 " for a Latency of %" PRIu32 " (Peak %" PRIu64 ", %" PRIu64 " Frames skipped to catch up)",
+		myInfo->Name.c_str(),
+		double_t(m_memory->current) / 1048576.0, double_t(m_memory->peak) / 1048576.0,
+		double_t(_moduleMemory.current) / 1048576.0, double_t(_moduleMemory.peak) / 1048576.0,
+		m_memoryRejected,
+		m_watchdogStalls, m_watchdogRestarts,
+		m_framesShared,
+		m_backlogDepth, m_latency, m_backlogPeak, m_backlogSkipped);
+
+	// Next to the time it took, so the cost of faster settings is visible.
+	if (m_qualitySampler) {
+		VFW::QualitySampler::Statistics stats = m_qualitySampler->statistics();
+		PLOG_INFO("<%s> Quality: PSNR %0.2f dB, SSIM %0.4f "
+			"(%" PRIu64 " Samples, %" PRIu64 " skipped, %" PRIu64 " failed, %0.2f ms each), "
+			"Encode: %0.2f ms per Frame",
+			myInfo->Name.c_str(), stats.psnr, stats.ssim,
+			stats.samples, stats.skipped, stats.failed, stats.milliseconds,
+			double_t(m_timeEncode) / 1000000.0);
+	}
+}
+
+bool VFW::Encoder::encodeSimulcast(struct encoder_frame* frame, struct encoder_packet* packet, bool* received_packet) {
+	if (!m_simulcastRung) {
+		std::unique_lock<std::mutex> slock(_simulcastLock);
+		auto group = _simulcastGroups.find(m_simulcastSource);
+		if (group == _simulcastGroups.end())
+			return true;
+		for (auto& weakRung : group->second) {
+			auto rung = weakRung.lock();
+			if (rung && (rung->m_width == m_simulcastSourceWidth) && (rung->m_height == m_simulcastSourceHeight)) {
+				m_simulcastRung = rung;
+				PLOG_INFO("<%s> Attached to simulcast group '%s'.",
+					myInfo->Name.c_str(), m_simulcastSource.c_str());
+				break;
+			}
+		}
+		if (!m_simulcastRung)
+			return true;
+	}
+
+	return m_simulcastRung->encodeRung(frame == nullptr, packet, received_packet);
+}
+
+bool VFW::Encoder::encodeRung(bool drain, struct encoder_packet* packet, bool* received_packet) {
+	if (m_failed)
+		return false;
+	{
+		std::unique_lock<std::mutex> rlock(m_rungLock);
+		checkWatchdog();
+		if (drain && !m_flushed)
+			flush();
+	}
+	*received_packet = takePacket(packet, 0);
+	return true;
+}
+
+void VFW::Encoder::flushRung() {
+	std::unique_lock<std::mutex> rlock(m_rungLock);
+	if (!m_flushed)
+		flush();
+}
+
+bool VFW::Encoder::encodeNative(struct encoder_frame* frame, struct encoder_packet* packet, bool* received_packet) {
+	// Nothing is ever held back.
+	if (!frame)
+		return true;
+
+	uint32_t heights[MAX_AV_PLANES], bytes[MAX_AV_PLANES];
+	VFW::GetPlaneHeights(m_native, m_height, heights);
+	VFW::GetPlaneRowBytes(m_native, m_width, bytes);
+	size_t size = 0;
+	for (size_t plane = 0; plane < MAX_AV_PLANES; plane++) {
+		size += size_t(bytes[plane]) * heights[plane];
+	}
+
+	frame_t kv = std::make_tuple(allocateBuffer(size), frame->pts, true, 0u);
+	uint8_t* dst = reinterpret_cast<uint8_t*>(std::get<0>(kv)->data());
+	for (size_t plane = 0; plane < MAX_AV_PLANES; plane++) {
+		if (heights[plane] == 0)
+			break;
+
+		VFW::Kernel::CopyPlane(frame->data[plane], frame->linesize[plane], dst, bytes[plane], heights[plane]);
+		dst += size_t(bytes[plane]) * heights[plane];
+	}
+
+	m_nativeFrames++;
+	getPacket(kv, packet);
+	*received_packet = true;
+	return true;
+}
+
+bool VFW::Encoder::submitPreprocessed(std::shared_ptr<std::vector<char>> buffer, int64_t pts, uint32_t complexity, bool sceneCut) {
+	// Waits while the rung is drained, flush() expects nothing to come in.
+	std::unique_lock<std::mutex> rlock(m_rungLock);
+	std::unique_lock<std::mutex> elock(m_encodeData.lock);
+	if (m_encodeData.data.size() >= m_maxQueueSize)
+		return false;
+	m_flushed = false;
+	m_encodeData.data.push(std::make_tuple(buffer, pts, sceneCut, complexity));
+	m_encodeData.cv.notify_all();
+	return true;
+}
+
+void VFW::Encoder::getPacket(frame_t& kv, struct encoder_packet* packet) {
+	if (m_tracer)
+		m_tracer->dequeue(VFW::Tracer::QueuePackets, std::get<1>(kv), "Queue Packets");
+	m_donotuse_datastor = std::get<0>(kv);
+	packet->type = OBS_ENCODER_VIDEO;
+	packet->data = reinterpret_cast<uint8_t*>(m_donotuse_datastor->data());
+	packet->size = m_donotuse_datastor->size();
+	packet->pts = packet->dts = std::get<1>(kv);
+	packet->keyframe = std::get<2>(kv);
+#ifdef _DEBUG
+	PLOG_DEBUG("<%s> PTS: %" PRIu32 ", DTS: %" PRIu32 ", Keyframe: %s, Size: %" PRIu32,
+		myInfo->Name.c_str(), packet->pts, packet->dts, packet->keyframe ? "Yes" : "No", packet->size);
+#endif
+}
+
+void VFW::Encoder::queuePacket(frame_t& kv) {
+	// Called without m_finalPacketsLock, which is only held around the queue
+	// itself, so that writing the file never holds up encode().
+	if (m_spillPath.size() == 0) {
+		std::unique_lock<std::mutex> flock(m_finalPacketsLock);
+		m_finalPackets.push(kv);
+		return;
+	}
+
+	// Older packets in the file come back first if there is room, so that a
+	// packet only goes to memory once nothing is waiting in front of it.
+	std::unique_lock<std::mutex> slock(m_spillLock);
+	if (m_spilled.size() > 0)
+		unspillPackets();
+	if (m_spilled.size() == 0) {
+		std::unique_lock<std::mutex> flock(m_finalPacketsLock);
+		if ((m_spillThreshold == 0) || (m_finalPackets.size() < m_spillThreshold)) {
+			m_finalPackets.push(kv);
+			return;
+		}
+	}
+
+	try {
+		if (!m_spillFile)
+			m_spillFile = std::unique_ptr<VFW::MappedFile>(new VFW::MappedFile(m_spillPath, true));
+
+		spill_t entry;
+		entry.offset = m_spillFile->size();
+		entry.size = std::get<0>(kv)->size();
+		entry.pts = std::get<1>(kv);
+		entry.keyframe = std::get<2>(kv);
+		m_spillFile->append(std::get<0>(kv)->data(), entry.size);
+		m_spilled.push_back(entry);
+		{
+			std::unique_lock<std::mutex> flock(m_finalPacketsLock);
+			m_spilledCount = m_spilled.size();
+		}
+
+		m_spillPackets++;
+		m_spillBytes += entry.size;
+		m_spillPeak = max(m_spillPeak, m_spilled.size());
+		return;
+	} catch (...) {
+		PLOG_ERROR("<%s> Unable to spill packets to '%s', keeping them in memory from now on.",
+			myInfo->Name.c_str(), m_spillPath.c_str());
+		m_spillThreshold = 0;
+		unspillPackets();
+	}
+	std::unique_lock<std::mutex> flock(m_finalPacketsLock);
+	m_finalPackets.push(kv);
+}
+
+bool VFW::Encoder::takePacket(struct encoder_packet* packet, size_t keep) {
+	// Refill from the file first, unless a packet is being written to it
+	// right now; the writer reads back itself once there is room.
+	if (m_spilledCount > 0) {
+		std::unique_lock<std::mutex> slock(m_spillLock, std::try_to_lock);
+		if (slock.owns_lock())
+			unspillPackets();
+	}
+
+	std::unique_lock<std::mutex> flock(m_finalPacketsLock);
+	if ((m_finalPackets.size() + m_spilledCount) <= keep)
+		return false;
+	if (m_finalPackets.size() == 0)
+		return false;
+
+	getPacket(m_finalPackets.front(), packet);
+	m_finalPackets.pop();
+	return true;
+}
+
+void VFW::Encoder::unspillPackets() {
+	// Called with m_spillLock held and without m_finalPacketsLock. Reads back
+	// as many packets as there is room for, all of them if spilling failed.
+	size_t room;
+	{
+		std::unique_lock<std::mutex> flock(m_finalPacketsLock);
+		room = m_spillThreshold - min(m_finalPackets.size(), m_spillThreshold);
+	}
+	if (m_spillThreshold == 0)
+		room = m_spilled.size();
+
+	std::vector<frame_t> packets;
+	for (; (room > 0) && (m_spilled.size() > 0); room--) {
+		spill_t entry = m_spilled.front();
+		m_spilled.pop_front();
+		if (!m_spillFile || !m_spillFile->data()) {
+			PLOG_ERROR("<%s> Lost spilled packet %" PRId64 ".", myInfo->Name.c_str(), entry.pts);
+			continue;
+		}
+		packets.push_back(std::make_tuple(
+			allocateBuffer(m_spillFile->data() + entry.offset, entry.size),
+			entry.pts, entry.keyframe, 0u));
+	}
+
+	// Everything is back in memory, so the file can be reused from the start.
+	// Otherwise the part that was read is dropped once it is most of the
+	// file, which moves less than it frees.
+	if (m_spillFile) {
+		if (m_spilled.size() == 0) {
+			m_spillFile->reset();
+		} else if ((m_spilled.front().offset >= spill_compact_min)
+			&& (m_spilled.front().offset >= (m_spillFile->size() / 2))) {
+			size_t head = m_spilled.front().offset;
+			m_spillFile->discard(head);
+			for (spill_t& entry : m_spilled)
+				entry.offset -= head;
+			m_spillCompactions++;
+		}
+	}
+
+	std::unique_lock<std::mutex> flock(m_finalPacketsLock);
+	for (frame_t& kv : packets)
+		m_finalPackets.push(kv);
+	m_spilledCount = m_spilled.size();
+}
+
+void VFW::Encoder::updateTiming(std::atomic<int64_t>& average, std::chrono::high_resolution_clock::time_point start) {
+	int64_t sample = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::high_resolution_clock::now() - start).count();
+	int64_t previous = average.load();
+	average.store(previous == 0 ? sample : ((previous * 7) + sample) / 8);
+}
+
+void VFW::Encoder::updateTopology(int64_t frameTime) {
+	// Only zero latency can be served from the caller thread.
+	if (m_latency > 0)
+		return;
+	if (m_timingSamples < inline_min_samples)
+		return;
+
+	int64_t stageTime = m_timePreProcess + m_timeEncode + m_timePostProcess;
+	if (!m_inline) {
+		if (m_watchdogPending || (stageTime >= (frameTime * inline_enter_percent / 100)))
+			return;
+
+		// Switch only once nothing is in flight, to keep packet order.
+		std::unique_lock<std::mutex> ulock(m_preProcessData.lock);
+		std::unique_lock<std::mutex> elock(m_encodeData.lock);
+		std::unique_lock<std::mutex> plock(m_postProcessData.lock);
+		std::unique_lock<std::mutex> flock(m_finalPacketsLock);
+		if (m_preProcessData.data.size() || m_encodeData.data.size()
+			|| m_postProcessData.data.size() || m_finalPackets.size() || m_spilledCount)
+			return;
+
+		m_inline = true;
+		PLOG_INFO("<%s> Switching to inline encoding (Stages: %" PRId64 "ns, Budget: %" PRId64 "ns).",
+			myInfo->Name.c_str(), stageTime, frameTime);
+	} else if (stageTime > (frameTime * inline_leave_percent / 100)) {
+		m_inline = false;
+		PLOG_INFO("<%s> Switching to threaded encoding (Stages: %" PRId64 "ns, Budget: %" PRId64 "ns).",
+			myInfo->Name.c_str(), stageTime, frameTime);
+	}
+}
+
+bool VFW::Encoder::update(void *data, obs_data_t *settings) {
+	return static_cast<VFW::Encoder*>(data)->update(settings);
+}
+
+bool VFW::Encoder::update(obs_data_t* settings) {
+	UNREFERENCED_PARAMETER(settings);
+	return false;
+}
+
+bool VFW::Encoder::get_extra_data(void *data, uint8_t **extra_data, size_t *size) {
+	return static_cast<VFW::Encoder*>(data)->get_extra_data(extra_data, size);
+}
+
+bool VFW::Encoder::get_extra_data(uint8_t** extra_data, size_t* size) {
+	if (m_simulcastSource.size() > 0) {
+		if (!m_simulcastRung)
+			return false;
+		return m_simulcastRung->get_extra_data(extra_data, size);
+	}
+
+	std::unique_lock<std::mutex> ulock(m_extraDataLock);
+	if (m_extraData.size() == 0)
+		return false;
+	*extra_data = m_extraData.data();
+	*size = m_extraData.size();
+	m_extraDataServed = true;
+	return true;
+}
+
+bool VFW::Encoder::get_sei_data(void *data, uint8_t **sei_data, size_t *size) {
+	return static_cast<VFW::Encoder*>(data)->get_sei_data(sei_data, size);
+}
+
+bool VFW::Encoder::get_sei_data(uint8_t** sei_data, size_t* size) {
+	UNREFERENCED_PARAMETER(sei_data);
+	UNREFERENCED_PARAMETER(size);
+	return false;
+}
+
+void VFW::Encoder::get_video_info(void *data, struct video_scale_info *info) {
+	return static_cast<VFW::Encoder*>(data)->get_video_info(info);
+}
+
+void VFW::Encoder::get_video_info(struct video_scale_info *info) {
+	if (m_native != VIDEO_FORMAT_NONE) {
+		// What players assume for raw YUV in AVI.
+		info->format = m_native;
+		info->range = VIDEO_RANGE_PARTIAL;
+		info->colorspace = VIDEO_CS_601;
+		return;
+	}
+	info->format = VIDEO_FORMAT_BGRA;
 	info->range = VIDEO_RANGE_FULL;
 	info->colorspace = VIDEO_CS_709;
 }
@@ -654,6 +1972,16 @@ void VFW::Encoder::threadLocal(int32_t flag) {
 		td = &m_postProcessData;
 	}
 
+	// The encode worker may be abandoned by the watchdog, after which it must
+	// not touch the encoder anymore.
+	std::shared_ptr<VFW::Watchdog> watchdog = m_watchdog;
+	uint64_t generation = watchdog->current();
+
+	if (m_tracer) {
+		const char* names[] = { "PreProcess", "Encode", "PostProcess" };
+		m_tracer->nameThread(names[flag]);
+	}
+
 	std::unique_lock<std::mutex> ulock(td->lock);
 	while (!m_threadShutdown) {
 		td->cv.wait(ulock, [this, td] {
@@ -666,37 +1994,125 @@ void VFW::Encoder::threadLocal(int32_t flag) {
 			preProcessLocal(ulock);
 		} else if (flag == 1) {
 			encodeLocal(ulock);
+			if (watchdog->current() != generation) {
+				std::unique_lock<std::mutex> alock(_abandonedLock);
+				_abandonedDone.insert(std::this_thread::get_id());
+				_abandonedCV.notify_all();
+				return;
+			}
 		} else if (flag == 2) {
 			postProcessLocal(ulock);
 		}
+
+		// flush() waits for the queue to run empty.
+		if (td->data.size() == 0)
+			td->cv.notify_all();
+	}
+
+	// The destructor waits for this, or abandons the worker if it stalls.
+	if (flag == 1) {
+		m_encodeStopped = true;
+		td->cv.notify_all();
 	}
 }
 
+uint32_t VFW::Encoder::preProcessFrame(std::shared_ptr<std::vector<char>>& buffer, int64_t pts, std::shared_ptr<VFW::SharedFrame> shared, bool& sceneCut) {
+	size_t lineSize = buffer->size() / m_height;
+	uint32_t complexity = 0;
+
+	// A shared frame is flipped by whoever gets to it first.
+	bool process = true;
+	if (shared) {
+		std::unique_lock<std::mutex> slock(shared->lock);
+		shared->cv.wait(slock, [&shared] {
+			return shared->state != VFW::SharedFrame::Working;
+		});
+		if (shared->state == VFW::SharedFrame::Done) {
+			complexity = shared->complexity;
+			process = false;
+		} else {
+			shared->state = VFW::SharedFrame::Working;
+		}
+	}
+
+	if (process) {
+		// Incremental input was already flipped while it was copied.
+		if (!m_incremental)
+			VFW::Kernel::FlipRows(reinterpret_cast<uint8_t*>(buffer->data()), lineSize, m_height);
+
+		// Other encoders of a shared frame may need it, so always estimate those.
+		if (shared || m_rateControl || (m_simulcastRungs.size() > 0)) {
+			complexity = VFW::Kernel::EstimateComplexity(
+				reinterpret_cast<const uint8_t*>(buffer->data()), lineSize, m_width, m_height);
+		}
+
+		if (shared) {
+			std::unique_lock<std::mutex> slock(shared->lock);
+			shared->state = VFW::SharedFrame::Done;
+			shared->complexity = complexity;
+			shared->cv.notify_all();
+		}
+	}
+
+	sceneCut = m_sceneCut && detectSceneCut(buffer);
+
+	// Feed the simulcast rungs from the flipped frame.
+	for (auto& rung : m_simulcastRungs) {
+		size_t rungLineSize = size_t(rung->m_width) * 4;
+		std::shared_ptr<std::vector<char>> rungbuf = rung->allocateBuffer(rungLineSize * rung->m_height);
+		VFW::Kernel::ScaleBGRA(
+			reinterpret_cast<const uint8_t*>(buffer->data()), lineSize, m_width, m_height,
+			reinterpret_cast<uint8_t*>(rungbuf->data()), rungLineSize, rung->m_width, rung->m_height);
+		if (!rung->submitPreprocessed(rungbuf, pts, complexity, sceneCut)) {
+			PLOG_DEBUG("<%s> Simulcast rung %" PRIu32 "x%" PRIu32 " is full, dropped frame %" PRId64 ".",
+				myInfo->Name.c_str(), rung->m_width, rung->m_height, pts);
+		}
+	}
+	return complexity;
+}
+
+bool VFW::Encoder::detectSceneCut(const std::shared_ptr<std::vector<char>>& buffer) {
+	uint32_t histogram[64];
+	VFW::Kernel::LumaHistogram(reinterpret_cast<const uint8_t*>(buffer->data()), buffer->size() / m_height,
+		m_width, m_height, histogram);
+
+	// Half the summed difference is the share of samples that changed bins.
+	uint64_t samples = 0, difference = 0;
+	for (size_t bin = 0; bin < 64; bin++) {
+		samples += histogram[bin];
+		difference += (histogram[bin] > m_sceneHistogram[bin])
+			? (histogram[bin] - m_sceneHistogram[bin]) : (m_sceneHistogram[bin] - histogram[bin]);
+	}
+	bool cut = m_sceneHistogramValid && (samples > 0)
+		&& ((difference * 50 / samples) >= scenecut_threshold_percent);
+	std::memcpy(m_sceneHistogram, histogram, sizeof(histogram));
+	m_sceneHistogramValid = true;
+	return cut;
+}
+
 void VFW::Encoder::preProcessLocal(std::unique_lock<std::mutex>& ul) {
 #ifdef _DEBUG
 	auto total_start = std::chrono::high_resolution_clock::now();
 #endif
 
 	auto kv = m_preProcessData.data.front();
+	auto shared = m_preProcessShared.front();
 	ul.unlock();
 
 #ifdef _DEBUG
 	auto invert_start = std::chrono::high_resolution_clock::now();
 #endif
-	std::shared_ptr<std::vector<char>> inbuf = std::get<0>(kv);
-	std::shared_ptr<std::vector<char>> outbuf = inbuf;// std::make_shared<std::vector<char>>(inbuf->size());
-
-	size_t halfHeight = m_height / 2;
-	size_t lineSize = inbuf->size() / m_height;
-	std::vector<char> tempBuf(lineSize);
-	for (size_t line = 0; line < halfHeight; line++) {
-		size_t front = line * lineSize;
-		size_t back = (m_height - line - 1) * lineSize;
-
-		std::memcpy(tempBuf.data(), inbuf->data() + front, lineSize);
-		std::memcpy(outbuf->data() + front, inbuf->data() + back, lineSize);
-		std::memcpy(outbuf->data() + back, tempBuf.data(), lineSize);
+	auto stage_start = std::chrono::high_resolution_clock::now();
+	std::shared_ptr<std::vector<char>> outbuf = std::get<0>(kv);
+	if (m_tracer)
+		m_tracer->dequeue(VFW::Tracer::QueuePreProcess, std::get<1>(kv), "Queue PreProcess");
+	uint32_t complexity;
+	bool sceneCut = false;
+	{
+		VFW::TraceSpan span(m_tracer, "PreProcess", std::get<1>(kv));
+		complexity = preProcessFrame(outbuf, std::get<1>(kv), shared, sceneCut);
 	}
+	updateTiming(m_timePreProcess, stage_start);
 #ifdef _DEBUG
 	auto invert_end = std::chrono::high_resolution_clock::now();
 #endif
@@ -725,9 +2141,12 @@ void VFW::Encoder::preProcessLocal(std::unique_lock<std::mutex>& ul) {
 	{
 		std::unique_lock<std::mutex> plock(m_preProcessData.lock);
 		std::unique_lock<std::mutex> elock(m_encodeData.lock);
-		m_encodeData.data.push(std::make_tuple(outbuf, std::get<1>(kv), std::get<2>(kv)));
+		m_encodeData.data.push(std::make_tuple(outbuf, std::get<1>(kv), sceneCut, complexity));
+		if (m_tracer)
+			m_tracer->enqueue(VFW::Tracer::QueueEncode, std::get<1>(kv));
 		m_encodeData.cv.notify_all();
 		m_preProcessData.data.pop();
+		m_preProcessShared.pop();
 	}
 #ifdef _DEBUG
 	auto queue_end = std::chrono::high_resolution_clock::now();
@@ -758,79 +2177,549 @@ void VFW::Encoder::preProcessLocal(std::unique_lock<std::mutex>& ul) {
 #endif
 }
 
-void VFW::Encoder::encodeLocal(std::unique_lock<std::mutex>& ul) {
-#ifdef _DEBUG
-	auto total_start = std::chrono::high_resolution_clock::now();
-#endif
+bool VFW::Encoder::encodeFrame(frame_t& kv) {
+	return (this->*m_encodeVariant)(kv);
+}
 
-	auto kv = m_encodeData.data.front();
-	ul.unlock();
+VFW::Encoder::encode_variant_t VFW::Encoder::selectEncodeVariant(CompressPath path, bool useQuality, bool forceKeyframes) {
+	static const encode_variant_t variants[3][2][2] = {
+		{
+			{ &Encoder::encodeVariant<PathNormal, false, false>, &Encoder::encodeVariant<PathNormal, false, true> },
+			{ &Encoder::encodeVariant<PathNormal, true, false>, &Encoder::encodeVariant<PathNormal, true, true> },
+		}, {
+			{ &Encoder::encodeVariant<PathTemporal, false, false>, &Encoder::encodeVariant<PathTemporal, false, true> },
+			{ &Encoder::encodeVariant<PathTemporal, true, false>, &Encoder::encodeVariant<PathTemporal, true, true> },
+		}, {
+			{ &Encoder::encodeVariant<PathSequential, false, false>, &Encoder::encodeVariant<PathSequential, false, true> },
+			{ &Encoder::encodeVariant<PathSequential, true, false>, &Encoder::encodeVariant<PathSequential, true, true> },
+		},
+	};
+	return variants[path][useQuality ? 1 : 0][forceKeyframes ? 1 : 0];
+}
 
-#ifdef _DEBUG
-	auto encode_start = std::chrono::high_resolution_clock::now();
-#endif
+VFW::Encoder::CompressPath VFW::Encoder::selectPath(const char* mode) {
+	if (strcmp(mode, PROP_MODE_NORMAL) == 0)
+		return PathNormal;
+	if (strcmp(mode, PROP_MODE_TEMPORAL) == 0)
+		return PathTemporal;
+	return PathSequential;
+}
+
+template<VFW::Encoder::CompressPath path, bool useQuality, bool forceKeyframes>
+bool VFW::Encoder::encodeVariant(frame_t& kv) {
 	bool isKeyframe = false;
-	bool makeKeyframe = (m_keyframeInterval > 0) && ((std::get<1>(kv) % m_keyframeInterval) == 0);
+	int64_t frameIndex = std::get<1>(kv) / m_decimation;
+	int64_t sinceKeyframe = frameIndex - m_lastKeyframe;
+	bool makeKeyframe;
+	if (m_sceneCutReset) {
+		makeKeyframe = (m_keyframeInterval > 0) && (sinceKeyframe >= int64_t(m_keyframeInterval));
+	} else {
+		makeKeyframe = (m_keyframeInterval > 0) && ((frameIndex % m_keyframeInterval) == 0);
+	}
+	if (std::get<2>(kv) && !makeKeyframe && (sinceKeyframe >= scenecut_min_frames)) {
+		makeKeyframe = true; // Scene cut.
+		m_sceneCuts++;
+	}
+	if (m_forceKeyframe.exchange(false))
+		makeKeyframe = true;
+	if ((path == PathTemporal) && !m_prevInput)
+		makeKeyframe = true; // Nothing to refer to yet.
+	if (makeKeyframe)
+		m_lastKeyframe = frameIndex;
 	std::shared_ptr<std::vector<char>> inbuf = std::get<0>(kv);
-	std::shared_ptr<std::vector<char>> outbuf = std::make_shared<std::vector<char>>(m_bufferOutput.size());
-	if (m_useNormalCompress) {
-		DWORD dwFlags = 0, cwCompFlags = 0;
+	if (m_governor)
+		updateGovernor(makeKeyframe);
+	uint32_t quality = m_governorQuality;
+	if (m_rateControl)
+		quality = min(quality, updateRateControl(std::get<3>(kv), makeKeyframe));
+
+	// Local references, a stalled call must not lose the codec under it.
+	std::shared_ptr<VFW::Codec> codec = m_codec;
+	std::shared_ptr<VFW::Watchdog> watchdog = m_watchdog;
+	std::shared_ptr<VFW::Tracer> tracer = m_tracer;
+	std::shared_ptr<std::vector<char>> outbuf = allocateBuffer(codec->maxOutputSize());
+	std::shared_ptr<std::vector<char>> prevbuf;
+	BITMAPINFO* inputFormat = codec->inputFormat();
+	BITMAPINFO* outputFormat = codec->outputFormat();
+	bool success = false;
+
+	LONG frameNum = (LONG)std::get<1>(kv);
+	DWORD frameSize = m_compressBitrate;
+	DWORD frameQuality = useQuality ? quality : 0;
+	bool usePrev = (path == PathTemporal) && !makeKeyframe;
+	if (path == PathSequential) {
+		// Stands in for ICSeqCompressFrame, enc-vfw-seqcheck compares the two
+		// on Windows. lKey, lDataRate and lQ are documented as the key frame
+		// rate, the data rate in KB/s and the quality. lFrame and lKeyCount are
+		// documented as reserved, they hold the frame number and the frames
+		// since the last key frame here. The first frame and every lKey-th are
+		// key frames, and every frame gets lQ. ICSeqCompressFrame never learns
+		// the frame rate and what it passes as the frame size is undocumented;
+		// this spreads lDataRate over the frames, so check with -b before
+		// relying on the same output at a data rate.
+		COMPVARS* cv = codec->compVars();
+		if ((cv->lFrame == 0) || ((cv->lKey > 0) && (cv->lKeyCount >= cv->lKey))) {
+			if (!makeKeyframe)
+				m_lastKeyframe = frameIndex;
+			makeKeyframe = true;
+		}
+		if (makeKeyframe)
+			cv->lKeyCount = 0;
+		cv->lKeyCount++;
+		cv->lQ = quality;
+		frameNum = cv->lFrame++;
+		frameSize = (cv->lDataRate > 0) ? DWORD(int64_t(cv->lDataRate) * 1024 * m_fpsDen / m_fpsNum) : 0;
+		frameQuality = cv->lQ;
+		usePrev = m_sequentialPrev && !makeKeyframe && m_prevInput;
+	}
+	if (usePrev)
+		prevbuf = m_prevInput;
+
+	m_pendingFrames.push_back(std::make_tuple(std::get<1>(kv), makeKeyframe, std::get<3>(kv)));
+	if (m_qualitySampler && (++m_qualitySince >= m_qualityInterval))
+		m_qualityInputs.push_back(std::make_pair(std::get<1>(kv), inbuf));
+	DWORD dwFlags = 0, cwCompFlags = 0;
+#ifdef _DEBUG
+	const char* pathName = (path == PathSequential) ? "Sequential" : ((path == PathTemporal) ? "Temporal" : "Normal");
+	PLOG_DEBUG("<%s:%s> PTS: %" PRIu32 ", Keyframe: %s", myInfo->Name.c_str(), pathName, std::get<1>(kv), makeKeyframe ? "Yes" : "No");
+#endif
+	uint64_t generation = watchdog->begin();
+	int64_t traceBegin = tracer ? tracer->now() : 0;
+	LRESULT err = ICCompress(codec->handle(),
+		makeKeyframe ? ICCOMPRESS_KEYFRAME : 0,
+		&(outputFormat->bmiHeader), outbuf->data(),
+		&(inputFormat->bmiHeader), inbuf->data(),
+		&dwFlags, &cwCompFlags,
+		frameNum,
+		frameSize,
+		frameQuality,
+		usePrev ? &(inputFormat->bmiHeader) : NULL,
+		usePrev ? prevbuf->data() : NULL);
+	if (tracer)
+		tracer->span("ICCompress", std::get<1>(kv), traceBegin, tracer->now());
+	if (!watchdog->end(generation))
+		return false; // Abandoned, the encoder may already be gone.
+	if (err == ICERR_OK) {
+		outbuf->resize(outputFormat->bmiHeader.biSizeImage);
+
+		isKeyframe = (cwCompFlags & AVIIF_KEYFRAME) != 0;
+		success = true;
+
+		// The next frame refers to this one, which is never written to again.
+		if ((path == PathTemporal) || m_sequentialPrev)
+			m_prevInput = inbuf;
+
 	#ifdef _DEBUG
-		PLOG_DEBUG("<%s:Normal> PTS: %" PRIu32 ", Keyframe: %s", myInfo->Name.c_str(), std::get<1>(kv), makeKeyframe ? "Yes" : "No");
+		PLOG_DEBUG("<%s:%s> PTS: %" PRIu32 ", Keyframe: %s, Size: %" PRIu32,
+			myInfo->Name.c_str(), pathName, std::get<1>(kv), isKeyframe ? "Yes" : "No", outbuf->size());
 	#endif
-		LRESULT err = ICCompress(hIC,
-			makeKeyframe ? ICCOMPRESS_KEYFRAME : 0,
-			&(m_outputBitmapInfo->bmiHeader), outbuf->data(),
-			&(m_inputBitmapInfo->bmiHeader), inbuf->data(),
-			&dwFlags, &cwCompFlags,
-			(LONG)std::get<1>(kv),
-			m_useBitrateFlag ? m_bitrate : 0,
-			m_useQualityFlag ? m_quality : 0,
-			!makeKeyframe && m_useTemporalFlag ? &(m_prevInputBitmapInfo->bmiHeader) : NULL,
-			!makeKeyframe && m_useTemporalFlag ? m_bufferPrevInput.data() : NULL);
-		if (err == ICERR_OK) {
-			outbuf->resize(m_outputBitmapInfo->bmiHeader.biSizeImage);
-			//std::memcpy(outbuf->data(), m_bufferOutput.data(), outbuf->size());
-
-			isKeyframe = (cwCompFlags & AVIIF_KEYFRAME) != 0;
-
-			// Swap Buffers
-			m_bufferPrevInput.swap(m_bufferInput);
-
-		#ifdef _DEBUG
-			PLOG_DEBUG("<%s:Normal> PTS: %" PRIu32 ", Keyframe: %s, Size: %" PRIu32,
-				myInfo->Name.c_str(), std::get<1>(kv), isKeyframe ? "Yes" : "No", outbuf->size());
-		#endif
+	} else {
+		PLOG_ERROR("Unable to encode: %s.", FormattedICCError(err).c_str());
+	}
+
+	if (!success) {
+		m_pendingFrames.pop_back();
+		return failFrame(kv);
+	}
+
+	m_errorsConsecutive = 0;
+	return finishFrame<forceKeyframes>(kv, outbuf, isKeyframe);
+}
+
+void VFW::Encoder::updateGovernor(bool makeKeyframe) {
+	// Opening a codec can take long, so the replacement is opened on the pool
+	// thread while this one keeps compressing.
+	if ((m_governorMode != m_codec->mode()) && !m_governorCodec) {
+		std::shared_ptr<pending_codec_t> pending = std::make_shared<pending_codec_t>();
+		pending->done = false;
+		m_governorCodec = pending;
+
+		VFW::Info* info = myInfo;
+		VFW::CodecSettings settings = m_codecSettings;
+		settings.mode = m_governorMode;
+		VFW::CodecPool::post(info, [info, settings, pending]() {
+			std::shared_ptr<VFW::Codec> codec;
+			try {
+				codec = std::make_shared<VFW::Codec>(info, settings);
+			} catch (const std::exception& ex) {
+				PLOG_WARNING("<%s> Governor: Unable to open codec in %s compression mode: %s",
+					info->Name.c_str(), settings.mode == ICMODE_COMPRESS ? "Normal" : "Fast", ex.what());
+			}
+			std::unique_lock<std::mutex> glock(pending->lock);
+			pending->codec = codec;
+			pending->done = true;
+		});
+	}
+
+	bool ready = false;
+	std::shared_ptr<VFW::Codec> codec;
+	if (m_governorCodec) {
+		std::unique_lock<std::mutex> glock(m_governorCodec->lock);
+		ready = m_governorCodec->done;
+		codec = m_governorCodec->codec;
+	}
+	if (ready) {
+		if (!codec || (codec->mode() != m_governorMode)) {
+			m_governorCodec = nullptr;
+			if (!codec || (codec->mode() != m_codec->mode())) {
+				// Don't keep retrying a mode the codec does not offer.
+				m_governorModeLocked = true;
+				m_governorMode = m_codec->mode();
+				PLOG_WARNING("<%s> Governor: Unable to switch compression mode.", myInfo->Name.c_str());
+			}
+			// Otherwise the governor changed its mind while it was opening.
+			closeLater(codec);
+		} else if (!makeKeyframe || (m_codecLag > 0)) {
+			// Compression mode changes wait for a keyframe, so nothing refers
+			// to frames of the previous codec instance. Without an interval
+			// there may never be one, so ask for it.
+			if ((m_keyframeInterval == 0) && (m_codecLag == 0))
+				m_forceKeyframe = true;
 		} else {
-			PLOG_ERROR("Unable to encode: %s.", FormattedICCError(err).c_str());
+			std::shared_ptr<VFW::Codec> previous = m_codec;
+			m_codec = codec;
+			m_governorCodec = nullptr;
+			m_governorModeChanges++;
+			PLOG_INFO("<%s> Governor: Switched to %s compression mode.",
+				myInfo->Name.c_str(), m_codec->mode() == ICMODE_COMPRESS ? "Normal" : "Fast");
+			closeLater(previous);
 		}
-	} else {
-		BOOL keyframe; LONG plSize = (LONG)inbuf->size();
-	#ifdef _DEBUG
-		PLOG_DEBUG("<%s:Sequential> PTS: %" PRIu32 ", Keyframe: %s",
-			myInfo->Name.c_str(), std::get<1>(kv), makeKeyframe ? "Yes" : "No");
-	#endif
-		LPVOID fptr = ICSeqCompressFrame(
-			&cv,
-			makeKeyframe ? 1 : 0,
-			reinterpret_cast<LPVOID>(inbuf->data()),
-			&keyframe,
-			&plSize);
-		if (fptr == NULL) {
-			PLOG_ERROR("Unable to encode.");
+	}
+
+	if (m_governorCooldown > 0) {
+		m_governorCooldown--;
+		return;
+	}
+
+	int64_t frameTime = int64_t((double_t(m_fpsDen) / double_t(m_fpsNum)) * 1000000000.0);
+	int64_t encodeTime = m_timeEncode;
+	uint32_t previousQuality = m_governorQuality;
+	if (encodeTime > (frameTime * governor_over_percent / 100)) {
+		// Lower quality first, then switch to the faster compression mode.
+		if (m_useQualityFlag && (m_governorQuality > governor_quality_min)) {
+			m_governorQuality = max(m_governorQuality - min(governor_quality_step, m_governorQuality), governor_quality_min);
+		} else if ((m_governorMode == ICMODE_COMPRESS) && (m_codecLag == 0) && !m_governorModeLocked) {
+			m_governorMode = ICMODE_FASTCOMPRESS;
+			PLOG_INFO("<%s> Governor: Compression took %" PRId64 "ns of %" PRId64 "ns, switching to Fast compression mode at the next keyframe.",
+				myInfo->Name.c_str(), encodeTime, frameTime);
+		}
+	} else if (encodeTime < (frameTime * governor_under_percent / 100)) {
+		// Step back up in reverse order.
+		if ((m_governorMode != m_codecSettings.mode) && (m_codecLag == 0) && !m_governorModeLocked
+			&& (encodeTime < (frameTime * governor_restore_percent / 100))) {
+			m_governorMode = m_codecSettings.mode;
+			PLOG_INFO("<%s> Governor: Compression took %" PRId64 "ns of %" PRId64 "ns, switching back to Normal compression mode at the next keyframe.",
+				myInfo->Name.c_str(), encodeTime, frameTime);
+		} else if (m_useQualityFlag && (m_governorQuality < m_quality)) {
+			m_governorQuality = min(m_governorQuality + governor_quality_step, m_quality);
+		}
+	}
+
+	if (m_governorQuality != previousQuality) {
+		m_governorQualityChanges++;
+		PLOG_INFO("<%s> Governor: Compression took %" PRId64 "ns of %" PRId64 "ns, quality changed from %0.2f%% to %0.2f%%.",
+			myInfo->Name.c_str(), encodeTime, frameTime,
+			double_t(previousQuality) / 100.0, double_t(m_governorQuality) / 100.0);
+	}
+	if ((m_governorQuality != previousQuality) || (m_governorMode != m_codec->mode()))
+		m_governorCooldown = governor_cooldown;
+}
+
+void VFW::Encoder::closeLater(std::shared_ptr<VFW::Codec>& codec) {
+	// Closing can take as long as opening, so the pool thread drops the last
+	// reference to it.
+	if (!codec)
+		return;
+	std::shared_ptr<std::shared_ptr<VFW::Codec>> holder = std::make_shared<std::shared_ptr<VFW::Codec>>(codec);
+	codec = nullptr;
+	VFW::CodecPool::post(myInfo, [holder]() {
+		*holder = nullptr;
+	});
+}
+
+uint32_t VFW::Encoder::updateRateControl(uint32_t complexity, bool makeKeyframe) {
+	// Aim for the size that brings the bucket back to half full, which over
+	// time averages out at exactly the target rate.
+	double_t reaction = ratecontrol_reaction_seconds * double_t(m_fpsNum) / double_t(m_fpsDen);
+	double_t desired = m_rateControlTarget - (m_rateControlFullness - m_rateControlBuffer / 2.0) / max(reaction, 1.0);
+	desired = max(desired, m_rateControlTarget / 4.0);
+
+	// Predict the size from the complexity, without history assume it fits.
+	double_t ratio = m_rateControlRatio[makeKeyframe ? 1 : 0];
+	if ((ratio <= 0) && makeKeyframe)
+		ratio = m_rateControlRatio[0];
+	double_t predicted = (ratio > 0) ? ratio * double_t(max(complexity, 1u)) : m_rateControlTarget;
+
+	double_t change = double_t(m_rateControlQuality) * (pow(desired / predicted, ratecontrol_gain) - 1.0);
+	change = max(min(change, double_t(ratecontrol_quality_step)), -double_t(ratecontrol_quality_step));
+	if (m_rateControlFullness > m_rateControlBuffer) {
+		// Already over, the link can't keep up with what was sent.
+		change = -double_t(ratecontrol_quality_step);
+	}
+	m_rateControlQuality = uint32_t(max(min(double_t(m_rateControlQuality) + change, double_t(m_quality)),
+		double_t(ratecontrol_quality_min)));
+	return m_rateControlQuality;
+}
+
+void VFW::Encoder::trackRateControl(size_t bytes, uint32_t complexity, bool isKeyframe) {
+	double_t bits = double_t(bytes) * 8.0;
+	m_rateControlFullness = max(m_rateControlFullness + bits - m_rateControlTarget, 0.0);
+	if (m_rateControlFullness > m_rateControlBuffer)
+		m_rateControlOverflows++;
+	m_rateControlBits += uint64_t(bits);
+	m_rateControlFrames++;
+
+	double_t sample = bits / double_t(max(complexity, 1u));
+	double_t& ratio = m_rateControlRatio[isKeyframe ? 1 : 0];
+	ratio = (ratio <= 0) ? sample : ((ratio * 7.0) + sample) / 8.0;
+}
+
+void VFW::Encoder::checkWatchdog() {
+	if (m_watchdogTimeout <= 0)
+		return;
+
+	if (m_watchdog->expire(m_watchdogTimeout)) {
+		// The worker is stuck inside the codec and is left behind with it.
+		// Everything it owned is ours again from here on.
+		m_watchdogStalls++;
+		m_watchdogPending = true;
+		abandonWorker();
+		PLOG_WARNING("<%s> Watchdog: Codec did not return within %" PRId64 "ms, abandoning it (%" PRIu64 " frames lost).",
+			myInfo->Name.c_str(), m_watchdogTimeout / 1000000, uint64_t(m_pendingFrames.size()));
+		m_pendingFrames.clear();
+		m_codecLag = 0;
+
+		// Drop the frame that stalled, it might just do so again.
+		std::unique_lock<std::mutex> elock(m_encodeData.lock);
+		if (m_encodeData.data.size() > 0)
+			m_encodeData.data.pop();
+	}
+	if (!m_watchdogPending)
+		return;
+
+	// Opening can take as long as the stall did, so the replacement is opened
+	// on the pool thread and frames queue up (or get rejected) meanwhile.
+	if (!m_watchdogCodec) {
+		std::shared_ptr<pending_codec_t> pending = std::make_shared<pending_codec_t>();
+		pending->done = false;
+		m_watchdogCodec = pending;
+
+		VFW::Info* info = myInfo;
+		VFW::CodecSettings settings = m_codecSettings;
+		settings.mode = m_codec->mode();
+		VFW::CodecPool::post(info, [info, settings, pending]() {
+			std::shared_ptr<VFW::Codec> codec;
+			try {
+				codec = std::make_shared<VFW::Codec>(info, settings);
+			} catch (...) {
+			}
+			std::unique_lock<std::mutex> glock(pending->lock);
+			pending->codec = codec;
+			pending->done = true;
+		});
+		return;
+	}
+
+	std::shared_ptr<VFW::Codec> codec;
+	{
+		std::unique_lock<std::mutex> glock(m_watchdogCodec->lock);
+		if (!m_watchdogCodec->done)
+			return;
+		codec = m_watchdogCodec->codec;
+	}
+	m_watchdogCodec = nullptr;
+	if (!codec) {
+		PLOG_ERROR("<%s> Watchdog: Unable to reopen codec, retrying with the next frame.",
+			myInfo->Name.c_str());
+		return;
+	}
+	m_codec = codec;
+	m_forceKeyframe = true;
+	m_watchdogPending = false;
+	m_watchdogRestarts++;
+	m_encodeData.worker = std::thread(threadMain, this, 1);
+	PLOG_INFO("<%s> Watchdog: Codec restarted, resuming with a keyframe.", myInfo->Name.c_str());
+}
+
+void VFW::Encoder::abandonWorker() {
+	// Workers that left their codec since are joined on the way.
+	std::unique_lock<std::mutex> alock(_abandonedLock);
+	for (auto it = _abandonedThreads.begin(); it != _abandonedThreads.end();) {
+		if (_abandonedDone.erase(it->get_id()) > 0) {
+			it->join();
+			it = _abandonedThreads.erase(it);
 		} else {
-			outbuf->resize(plSize);
-			std::memcpy(outbuf->data(), fptr, outbuf->size());
-			isKeyframe = keyframe != 0;
-
-		#ifdef _DEBUG
-			PLOG_DEBUG("<%s:Sequential> PTS: %" PRIu32 ", Keyframe: %s, Size: %" PRIu32,
-				myInfo->Name.c_str(), std::get<1>(kv), isKeyframe ? "Yes" : "No", outbuf->size());
-		#endif
+			it++;
+		}
+	}
+	_abandonedThreads.push_back(std::move(m_encodeData.worker));
+}
+
+template<bool forceKeyframes>
+bool VFW::Encoder::finishFrame(frame_t& kv, std::shared_ptr<std::vector<char>>& outbuf, bool isKeyframe) {
+	// Codecs with a lookahead (x264vfw and similar) return empty frames until
+	// it is filled, every later output belongs to the oldest pending frame.
+	if (outbuf->size() == 0) {
+		if (m_pendingFrames.size() > m_codecLag) {
+			m_codecLag = m_pendingFrames.size();
+			PLOG_DEBUG("<%s> Codec is delaying %" PRIu64 " frames.",
+				myInfo->Name.c_str(), uint64_t(m_codecLag));
+		}
+		return false;
+	}
+
+	auto pending = m_pendingFrames.front();
+	m_pendingFrames.pop_front();
+	if (m_qualitySampler)
+		sampleQuality(std::get<0>(pending), outbuf, isKeyframe);
+	isKeyframe = forceKeyframes ? std::get<1>(pending) || isKeyframe : isKeyframe;
+	kv = std::make_tuple(outbuf, std::get<0>(pending), isKeyframe, std::get<2>(pending));
+	if (m_rateControl)
+		trackRateControl(outbuf->size(), std::get<2>(pending), isKeyframe);
+
+	// Post-processing changes the packet in place, so keep an untouched copy.
+	if (m_errorPolicy == ErrorRepeat) {
+		m_lastGoodPacket = allocateBuffer(outbuf->data(), outbuf->size());
+		m_lastGoodKeyframe = isKeyframe;
+	}
+	return true;
+}
+
+void VFW::Encoder::sampleQuality(int64_t pts, const std::shared_ptr<std::vector<char>>& outbuf, bool isKeyframe) {
+	// Inputs of frames that failed or came out earlier are of no use anymore.
+	while ((m_qualityInputs.size() > 0) && (m_qualityInputs.front().first < pts))
+		m_qualityInputs.pop_front();
+	if ((m_qualityInputs.size() == 0) || (m_qualityInputs.front().first != pts))
+		return;
+	std::shared_ptr<std::vector<char>> input = m_qualityInputs.front().second;
+	m_qualityInputs.pop_front();
+
+	// Other frames can't be decoded without the ones they refer to, so
+	// wait for the next keyframe, which every frame of intra-only codecs is.
+	if (!isKeyframe)
+		return;
+	m_qualitySampler->submit(*outbuf, input);
+	m_qualitySince = 0;
+	m_qualityInputs.clear();
+}
+
+bool VFW::Encoder::failFrame(frame_t& kv) {
+	// Nothing of the output buffer is usable, it never leaves this function.
+	m_errors++;
+	m_errorsConsecutive++;
+	if ((m_errorLimit > 0) && (m_errorsConsecutive >= m_errorLimit) && !m_failed) {
+		PLOG_ERROR("<%s> Compression failed for %" PRIu32 " frames in a row, stopping.",
+			myInfo->Name.c_str(), m_errorsConsecutive);
+		m_failed = true;
+	}
+
+	switch (m_errorPolicy) {
+		case ErrorRepeat:
+			// Only possible while nothing is delayed, the packet would be out of order otherwise.
+			if (m_lastGoodPacket && (m_pendingFrames.size() == 0)) {
+				kv = std::make_tuple(allocateBuffer(m_lastGoodPacket->data(), m_lastGoodPacket->size()),
+					std::get<1>(kv), m_lastGoodKeyframe, std::get<3>(kv));
+				return true;
+			}
+			break;
+		case ErrorKeyframe:
+			m_forceKeyframe = true;
+			break;
+		default:
+			break;
+	}
+	return false;
+}
+
+bool VFW::Encoder::flushFrame(frame_t& kv) {
+	if (m_pendingFrames.size() == 0)
+		return false;
+
+	// Passing no input asks the codec to return its delayed frames.
+	std::shared_ptr<std::vector<char>> outbuf = allocateBuffer(m_codec->maxOutputSize());
+	BITMAPINFO* outputFormat = m_codec->outputFormat();
+	DWORD dwFlags = 0, cwCompFlags = 0;
+	LRESULT err = ICCompress(m_codec->handle(), 0,
+		&(outputFormat->bmiHeader), outbuf->data(),
+		&(m_codec->inputFormat()->bmiHeader), NULL,
+		&dwFlags, &cwCompFlags,
+		(LONG)std::get<0>(m_pendingFrames.front()),
+		0, 0, NULL, NULL);
+	if (err != ICERR_OK) {
+		PLOG_WARNING("<%s> Unable to flush delayed frames: %s.",
+			myInfo->Name.c_str(), FormattedICCError(err).c_str());
+		return false;
+	}
+	outbuf->resize(outputFormat->bmiHeader.biSizeImage);
+	if (outbuf->size() == 0)
+		return false;
+
+	if (m_forceKeyframes)
+		return finishFrame<true>(kv, outbuf, (cwCompFlags & AVIIF_KEYFRAME) != 0);
+	return finishFrame<false>(kv, outbuf, (cwCompFlags & AVIIF_KEYFRAME) != 0);
+}
+
+void VFW::Encoder::flush() {
+	// Wait for the pipeline to drain. Every stage moves a frame into the next
+	// queue before it leaves its own, and nothing new comes in meanwhile, so
+	// the stages can be waited for one after another.
+	for (thread_data* td : { &m_preProcessData, &m_encodeData, &m_postProcessData }) {
+		while (true) {
+			{
+				std::unique_lock<std::mutex> ulock(td->lock);
+				if (td->cv.wait_for(ulock, std::chrono::milliseconds(flush_watchdog_interval), [td] {
+					return td->data.size() == 0;
+				}))
+					break;
+			}
+			// A stalled codec never empties its queue.
+			checkWatchdog();
+			if (m_watchdogPending && !m_watchdogCodec)
+				break; // No codec to drain into.
 		}
 	}
 
-	isKeyframe = m_forceKeyframes ? makeKeyframe || isKeyframe : isKeyframe;
+	// Then retrieve whatever the codec is still holding on to.
+	size_t flushed = 0;
+	frame_t kv;
+	while (flushFrame(kv)) {
+		postProcessFrame(kv);
+		queuePacket(kv);
+		flushed++;
+	}
+	if (flushed > 0 || m_pendingFrames.size() > 0) {
+		PLOG_INFO("<%s> Flushed %" PRIu64 " delayed frames, %" PRIu64 " lost.",
+			myInfo->Name.c_str(), uint64_t(flushed), uint64_t(m_pendingFrames.size()));
+	}
+	m_pendingFrames.clear();
+
+	// Rungs got every frame from pre-processing above, so they drain now.
+	for (auto& rung : m_simulcastRungs)
+		rung->flushRung();
+	m_flushed = true;
+}
+
+void VFW::Encoder::encodeLocal(std::unique_lock<std::mutex>& ul) {
+#ifdef _DEBUG
+	auto total_start = std::chrono::high_resolution_clock::now();
+#endif
+
+	auto kv = m_encodeData.data.front();
+	ul.unlock();
+
+#ifdef _DEBUG
+	auto encode_start = std::chrono::high_resolution_clock::now();
+#endif
+	auto stage_start = std::chrono::high_resolution_clock::now();
+	std::shared_ptr<VFW::Watchdog> watchdog = m_watchdog;
+	uint64_t generation = watchdog->current();
+	if (m_tracer)
+		m_tracer->dequeue(VFW::Tracer::QueueEncode, std::get<1>(kv), "Queue Encode");
+	bool produced = encodeFrame(kv);
+	if (watchdog->current() != generation)
+		return;
+	updateTiming(m_timeEncode, stage_start);
+	m_timingSamples++;
 #ifdef _DEBUG
 	auto encode_end = std::chrono::high_resolution_clock::now();
 #endif
@@ -857,8 +2746,12 @@ void VFW::Encoder::encodeLocal(std::unique_lock<std::mutex>& ul) {
 	{
 		std::unique_lock<std::mutex> elock(m_encodeData.lock);
 		std::unique_lock<std::mutex> plock(m_postProcessData.lock);
-		m_postProcessData.data.push(std::make_tuple(outbuf, std::get<1>(kv), isKeyframe));
-		m_postProcessData.cv.notify_all();
+		if (produced) {
+			m_postProcessData.data.push(kv);
+			m_postProcessData.cv.notify_all();
+			if (m_tracer)
+				m_tracer->enqueue(VFW::Tracer::QueuePostProcess, std::get<1>(kv));
+		}
 		m_encodeData.data.pop();
 	}
 #ifdef _DEBUG
@@ -888,124 +2781,126 @@ void VFW::Encoder::encodeLocal(std::unique_lock<std::mutex>& ul) {
 #endif
 }
 
-void MatroxM2VBitstreamFixer(std::shared_ptr<std::vector<char>>& ptr, std::pair<uint32_t, uint32_t> framerate) {
-	// Matrox developers are idiots. Their MPEG-2 codec flags the content
-	// as interlaced top-field top-displayed, but in reality there is a
-	// progressive frame there. But that isn't the only issue.
-	// They also have structures in the stream that are larger than the
-	// standard allows for, or even invalid user data (all 0s). It's just
-	// a big bunch of "How did this ever work?" ...
-
-	// Find best match FPS
-	double_t sourceHertz = double_t(framerate.first) / double_t(framerate.second);
-	uint64_t sourceKey = uint64_t(sourceHertz * mpeg2hertz_mult);
-	std::pair<uint64_t, std::tuple<uint8_t, uint8_t, uint8_t>> bestMatch;
-	uint64_t bestMatchDiff = UINT64_MAX;
-	for (auto kv : mpeg2hertz) {
-		uint64_t diff = uint64_t(abs(int64_t(sourceKey) - int64_t(kv.first)));
-		if (diff < bestMatchDiff) {
-			bestMatch = kv;
-			bestMatchDiff = diff;
-		}
+void VFW::Encoder::postProcessFrame(frame_t& kv) {
+	(this->*m_postProcessVariant)(kv);
+}
+
+template<VFW::Encoder::PostProcessQuirk quirk>
+void VFW::Encoder::postProcessVariant(frame_t& kv) {
+	if (quirk == QuirkMatroxMPEG2) {
+		VFW::Kernel::FixMatroxMPEG2(reinterpret_cast<uint8_t*>(std::get<0>(kv)->data()),
+			std::get<0>(kv)->size(), m_mpeg2FrameRate);
+	} else if (quirk == QuirkH264) {
+		postProcessH264(kv);
 	}
-#ifdef _DEBUG
-	PLOG_DEBUG("(MPEG-2 Rewrite) Best Match for Content: %f (Diff: %llu idx: %i, extn: %i, extd: %i)",
-		double_t(bestMatch.first / mpeg2hertz_mult),
-		bestMatchDiff,
-		std::get<0>(bestMatch.second),
-		std::get<1>(bestMatch.second),
-		std::get<2>(bestMatch.second));
-#endif
+}
 
-	std::vector<char>* buffer = ptr.get();
+void VFW::Encoder::postProcessH264(frame_t& kv) {
+	std::vector<char>* buffer = std::get<0>(kv).get();
+	if (buffer->size() < 5)
+		return;
+	uint8_t* begin = reinterpret_cast<uint8_t*>(buffer->data());
+	uint8_t* end = begin + buffer->size();
+
+	// x264vfw emits Annex B, but may be configured to emit length prefixed
+	// NAL units instead. A length prefix can look like a start code, so the
+	// packet only counts as length prefixed if the lengths add up to exactly
+	// the packet, with a valid NAL header after every one of them.
+	auto isNALHeader = [](uint8_t header) {
+		return ((header & 0x80) == 0) && ((header & 0x1F) != 0) && ((header & 0x1F) <= 23);
+	};
+	uint8_t* pos = begin;
+	while ((end - pos) > 4) {
+		size_t length = (size_t(pos[0]) << 24) | (size_t(pos[1]) << 16) | (size_t(pos[2]) << 8) | size_t(pos[3]);
+		if ((length == 0) || (length > size_t(end - pos - 4)) || !isNALHeader(pos[4]))
+			break;
+		pos += 4 + length;
+	}
+	if (pos != end) {
+		bool annexB = ((begin[0] == 0) && (begin[1] == 0) && (begin[2] == 1) && isNALHeader(begin[3]))
+			|| ((begin[0] == 0) && (begin[1] == 0) && (begin[2] == 0) && (begin[3] == 1) && isNALHeader(begin[4]));
+		if (!annexB) {
+			PLOG_WARNING("<%s> Packet is neither Annex B nor length prefixed, leaving it untouched.",
+				myInfo->Name.c_str());
+			return;
+		}
+	} else {
+		for (pos = begin; pos < end;) {
+			size_t length = (size_t(pos[0]) << 24) | (size_t(pos[1]) << 16) | (size_t(pos[2]) << 8) | size_t(pos[3]);
+			pos[0] = pos[1] = pos[2] = 0; pos[3] = 1;
+			pos += 4 + length;
+		}
+	}
 
-	// Rewrite stream
-	size_t streamPosition = 0, streamSize = buffer->size();
-	while ((streamPosition < streamSize) && ((streamSize - streamPosition) >= 4)) {
-		uint8_t blockId = (uint8_t)(*buffer)[streamPosition + 3];
-		streamPosition += 4;
+	// Index the NAL units, each one starts at its start code.
+	struct nal_t {
+		uint8_t* start;
+		uint8_t* payload;
+		uint8_t* end;
+		uint8_t type;
+	};
+	auto next = [begin, end](uint8_t* from) {
+		return begin + (VFW::Kernel::FindStartCode(from, end) - begin);
+	};
+	std::vector<nal_t> nals;
+	for (uint8_t* pos = next(begin); pos < end;) {
+		nal_t nal;
+		nal.start = ((pos > begin) && (pos[-1] == 0)) ? pos - 1 : pos;
+		nal.payload = pos + 3;
+		pos = next(nal.payload);
+		nal.end = (pos < end) && (pos[-1] == 0) ? pos - 1 : pos;
+		nal.type = (nal.payload < nal.end) ? (*nal.payload & 0x1F) : 0;
+		nals.push_back(nal);
+	}
 
-		switch (blockId) {
-			case 0xB3: // Sequence Header
-			{
-			#ifdef _DEBUG
-				PLOG_DEBUG("(MPEG-2 Rewrite) Sequence Header at %" PRIu64, streamPosition);
-			#endif
-				// Rewrite Framerate
-				char b = (*buffer)[streamPosition + 3];
-				char fpsflag = std::get<0>(bestMatch.second);
-				(*buffer)[streamPosition + 3] = (b & 0xF0) + (fpsflag & 0x0F);
-				streamPosition += 8;
-				break;
-			}
-			case 0xB5:
-			{
-				//					streamPosition += 1;
-				char type = ((*buffer)[streamPosition] & 0xF0) >> 4;
-				switch (type) {
-					case 0b0001:
-					{ // Sequence Extension (Progressive, FPS, ChromaFormat possible)
-					#ifdef _DEBUG
-						PLOG_DEBUG("(MPEG-2 Rewrite) Sequence Extension at %" PRIu64, streamPosition);
-					#endif
-						(*buffer)[streamPosition + 1] |= 1 << 3; // Flag Progressive
-						(*buffer)[streamPosition + 5] = // Rewrite FPS Ext
-							((*buffer)[streamPosition + 5] & 0x80)
-							| ((std::get<1>(bestMatch.second) & 0x3) << 5)
-							| ((std::get<2>(bestMatch.second) & 0x1F));
-						streamPosition += 6;
-						break;
-					}
-					case 0b0010:
-					{
-					#ifdef _DEBUG
-						PLOG_DEBUG("(MPEG-2 Rewrite) Sequence Display Extension at %" PRIu64, streamPosition);
-					#endif
-						if ((*buffer)[streamPosition] & 0b1) {
-							streamPosition += 8;
-						} else {
-							streamPosition += 5;
-						}
-					}
-					break;
-					case 0b1000:
-					{ // Chroma Stuff?
-					#ifdef _DEBUG
-						PLOG_DEBUG("(MPEG-2 Rewrite) Picture Coding Extension at %" PRIu64, streamPosition);
-					#endif
-						// Picture Structure
-						(*buffer)[streamPosition + 2] |= 0x3; // Full Frame
-						(*buffer)[streamPosition + 3] &= ~(1 << 7); // top field first
-						(*buffer)[streamPosition + 3] &= ~(1 << 1); // repeat first field
-						(*buffer)[streamPosition + 4] |= 1 << 7; // progressive
-						if ((*buffer)[streamPosition + 4] & 0b1000000) {
-							streamPosition += 7;
-						} else {
-							streamPosition += 5;
-						}
-						break;
-					}
-				#ifdef _DEBUG
-					default:
-						PLOG_DEBUG("(MPEG-2 Rewrite) Unknown Extension %" PRIx8 " at %" PRIu64, type, streamPosition);
-						break;
-					#endif
-				}
+	// Take the parameter sets from the first packet that has them.
+	bool isIDR = false;
+	std::vector<uint8_t> headers;
+	for (nal_t& nal : nals) {
+		if (nal.type == 5)
+			isIDR = true;
+		if ((nal.type == 7) || (nal.type == 8)) {
+			static const uint8_t startCode[] = { 0, 0, 0, 1 };
+			headers.insert(headers.end(), startCode, startCode + 4);
+			headers.insert(headers.end(), nal.payload, nal.end);
+		}
+	}
+	if (isIDR)
+		std::get<2>(kv) = true;
+	if (headers.size() == 0)
+		return;
 
-				break;
+	{
+		std::unique_lock<std::mutex> ulock(m_extraDataLock);
+		if (m_extraData.size() == 0) {
+			m_extraData = headers;
+			PLOG_INFO("<%s> Captured H.264 parameter sets (%" PRIu64 " bytes).",
+				myInfo->Name.c_str(), uint64_t(m_extraData.size()));
+		} else if (m_extraData != headers) {
+			// Parameter sets changed mid-stream, they have to stay in the packet.
+			if (!m_extraDataMismatch) {
+				PLOG_WARNING("<%s> H.264 parameter sets changed, keeping them in the stream.",
+					myInfo->Name.c_str());
+				m_extraDataMismatch = true;
 			}
+			return;
 		}
+	}
 
-		// Seek to a valid position.
-		while ((streamPosition < buffer->size()) && ((buffer->size() - streamPosition) >= 4)
-			&& (
-			((*buffer)[streamPosition] != 0)
-				|| ((*buffer)[streamPosition + 1] != 0)
-				|| ((*buffer)[streamPosition + 2] != 1)
-				)) {
-			++streamPosition;
-		}
+	// Drop the inline copies only once OBS has the extra data, a muxer that
+	// asked before the first keyframe still needs them in the stream.
+	if (!m_extraDataServed)
+		return;
+	uint8_t* out = begin;
+	for (nal_t& nal : nals) {
+		if ((nal.type == 7) || (nal.type == 8))
+			continue;
+		size_t length = size_t(nal.end - nal.start);
+		if (out != nal.start)
+			std::memmove(out, nal.start, length);
+		out += length;
 	}
+	buffer->resize(size_t(out - begin));
 }
 
 void VFW::Encoder::postProcessLocal(std::unique_lock<std::mutex>& ul) {
@@ -1019,12 +2914,14 @@ void VFW::Encoder::postProcessLocal(std::unique_lock<std::mutex>& ul) {
 #ifdef _DEBUG
 	auto bitstream_start = std::chrono::high_resolution_clock::now();
 #endif
-	if ((myInfo->Id == "mvcVfwMpeg2-mmes")
-		|| (myInfo->Id == "mvcVfwMpeg2Alpha-m704")
-		|| (myInfo->Id == "mvcVfwMpeg2HD-m701")
-		|| (myInfo->Id == "mvcVfwMpeg2Alpha-m705")) {
-		MatroxM2VBitstreamFixer(std::get<0>(kv), std::make_pair(m_fpsNum, m_fpsDen));
+	auto stage_start = std::chrono::high_resolution_clock::now();
+	if (m_tracer)
+		m_tracer->dequeue(VFW::Tracer::QueuePostProcess, std::get<1>(kv), "Queue PostProcess");
+	{
+		VFW::TraceSpan span(m_tracer, "PostProcess", std::get<1>(kv));
+		postProcessFrame(kv);
 	}
+	updateTiming(m_timePostProcess, stage_start);
 #ifdef _DEBUG
 	auto bitstream_end = std::chrono::high_resolution_clock::now();
 #endif
@@ -1050,9 +2947,10 @@ void VFW::Encoder::postProcessLocal(std::unique_lock<std::mutex>& ul) {
 #endif
 	{
 		std::unique_lock<std::mutex> plock(m_postProcessData.lock);
-		std::unique_lock<std::mutex> flock(m_finalPacketsLock);
-		m_finalPackets.push(kv);
+		queuePacket(kv);
 		m_postProcessData.data.pop();
+		if (m_tracer)
+			m_tracer->enqueue(VFW::Tracer::QueuePackets, std::get<1>(kv));
 	}
 #ifdef _DEBUG
 	auto queue_end = std::chrono::high_resolution_clock::now();
@@ -0,0 +1,153 @@
+#include "codec.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+
+// Stand-in codec for running the pipeline without a real driver, on Windows
+// and on other platforms alike: "Compresses" 32-bit RGB by copying it, every
+// frame is a keyframe, and decompresses it back the same way.
+
+#define FAKE_FOURCC mmioFOURCC('F', 'A', 'K', 'E')
+
+struct fake_instance_t {
+	DWORD mode;
+};
+
+static bool IsFakeInput(const BITMAPINFOHEADER* bi) {
+	return (bi != nullptr) && (bi->biCompression == BI_RGB) && (bi->biBitCount == 32)
+		&& (bi->biPlanes == 1) && (bi->biWidth > 0) && (bi->biHeight != 0);
+}
+
+static bool IsFakeOutput(const BITMAPINFOHEADER* bi) {
+	return (bi != nullptr) && (bi->biCompression == FAKE_FOURCC) && (bi->biBitCount == 32)
+		&& (bi->biWidth > 0) && (bi->biHeight != 0);
+}
+
+static DWORD FakeFrameSize(const BITMAPINFOHEADER* bi) {
+	return DWORD(bi->biWidth) * DWORD(abs(bi->biHeight)) * 4;
+}
+
+static LRESULT FakeCompress(ICCOMPRESS* icc) {
+	if (!IsFakeInput(icc->lpbiInput) || !IsFakeOutput(icc->lpbiOutput))
+		return ICERR_BADFORMAT;
+
+	// No input asks for delayed frames, of which there never are any.
+	if (icc->lpInput == nullptr) {
+		icc->lpbiOutput->biSizeImage = 0;
+		return ICERR_OK;
+	}
+
+	DWORD size = FakeFrameSize(icc->lpbiInput);
+	std::memcpy(icc->lpOutput, icc->lpInput, size);
+	icc->lpbiOutput->biSizeImage = size;
+	if (icc->lpckid)
+		*icc->lpckid = 0;
+	if (icc->lpdwFlags)
+		*icc->lpdwFlags = AVIIF_KEYFRAME;
+	return ICERR_OK;
+}
+
+static LRESULT FakeDecompress(ICDECOMPRESS* icd) {
+	if (!IsFakeOutput(icd->lpbiInput) || !IsFakeInput(icd->lpbiOutput))
+		return ICERR_BADFORMAT;
+	std::memcpy(icd->lpOutput, icd->lpInput, FakeFrameSize(icd->lpbiOutput));
+	return ICERR_OK;
+}
+
+static LRESULT CALLBACK FakeDriverProc(DWORD_PTR dwDriverId, HDRVR hDriver, UINT uMsg, LPARAM lParam1, LPARAM lParam2) {
+	UNREFERENCED_PARAMETER(hDriver);
+	fake_instance_t* instance = reinterpret_cast<fake_instance_t*>(dwDriverId);
+
+	switch (uMsg) {
+		case DRV_LOAD:
+		case DRV_FREE:
+		case DRV_ENABLE:
+		case DRV_DISABLE:
+		case DRV_INSTALL:
+		case DRV_REMOVE:
+			return DRV_OK;
+		case DRV_QUERYCONFIGURE:
+			return 0;
+		case DRV_OPEN: {
+			ICOPEN* icopen = reinterpret_cast<ICOPEN*>(lParam2);
+			if (icopen && (icopen->fccType != ICTYPE_VIDEO) && (icopen->fccType != mmioFOURCC('V', 'I', 'D', 'C')))
+				return 0;
+			instance = new fake_instance_t();
+			instance->mode = icopen ? icopen->dwFlags : ICMODE_QUERY;
+			if (icopen)
+				icopen->dwError = ICERR_OK;
+			return LRESULT(instance);
+		}
+		case DRV_CLOSE:
+			delete instance;
+			return DRV_OK;
+
+		case ICM_GETINFO: {
+			ICINFO* info = reinterpret_cast<ICINFO*>(lParam1);
+			if (!info || (DWORD(lParam2) < sizeof(ICINFO)))
+				return 0;
+			std::memset(info, 0, sizeof(ICINFO));
+			info->dwSize = sizeof(ICINFO);
+			info->fccType = ICTYPE_VIDEO;
+			info->fccHandler = FAKE_FOURCC;
+			info->dwFlags = VIDCF_QUALITY;
+			info->dwVersion = 1;
+			info->dwVersionICM = ICVERSION;
+			std::wcsncpy(info->szName, L"Fake", 15);
+			std::wcsncpy(info->szDescription, L"Stand-in Codec", 127);
+			return sizeof(ICINFO);
+		}
+		case ICM_GETSTATE:
+		case ICM_SETSTATE:
+			return 0;
+		case ICM_CONFIGURE:
+		case ICM_ABOUT:
+			return ICERR_UNSUPPORTED;
+		case ICM_GETDEFAULTQUALITY:
+			*reinterpret_cast<DWORD*>(lParam1) = 10000;
+			return ICERR_OK;
+		case ICM_GETDEFAULTKEYFRAMERATE:
+			*reinterpret_cast<DWORD*>(lParam1) = 1;
+			return ICERR_OK;
+
+		case ICM_COMPRESS_QUERY:
+			return IsFakeInput(reinterpret_cast<BITMAPINFOHEADER*>(lParam1)) ? ICERR_OK : ICERR_BADFORMAT;
+		case ICM_COMPRESS_GET_FORMAT: {
+			BITMAPINFO* input = reinterpret_cast<BITMAPINFO*>(lParam1);
+			BITMAPINFO* output = reinterpret_cast<BITMAPINFO*>(lParam2);
+			if (!input || !IsFakeInput(&input->bmiHeader))
+				return ICERR_BADFORMAT;
+			if (!output)
+				return sizeof(BITMAPINFOHEADER);
+			output->bmiHeader = input->bmiHeader;
+			output->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+			output->bmiHeader.biCompression = FAKE_FOURCC;
+			output->bmiHeader.biSizeImage = FakeFrameSize(&input->bmiHeader);
+			return ICERR_OK;
+		}
+		case ICM_COMPRESS_GET_SIZE: {
+			BITMAPINFO* input = reinterpret_cast<BITMAPINFO*>(lParam1);
+			return (input && IsFakeInput(&input->bmiHeader)) ? LRESULT(FakeFrameSize(&input->bmiHeader)) : 0;
+		}
+		case ICM_COMPRESS_BEGIN:
+		case ICM_COMPRESS_END:
+		case ICM_DECOMPRESS_BEGIN:
+		case ICM_DECOMPRESS_END:
+			return ICERR_OK;
+		case ICM_COMPRESS:
+			return FakeCompress(reinterpret_cast<ICCOMPRESS*>(lParam1));
+
+		case ICM_DECOMPRESS_QUERY:
+			return (IsFakeOutput(reinterpret_cast<BITMAPINFOHEADER*>(lParam1))
+				&& ((lParam2 == 0) || IsFakeInput(reinterpret_cast<BITMAPINFOHEADER*>(lParam2)))) ? ICERR_OK : ICERR_BADFORMAT;
+		case ICM_DECOMPRESS:
+			return FakeDecompress(reinterpret_cast<ICDECOMPRESS*>(lParam1));
+	}
+	return (uMsg < DRV_USER) ? 0 : ICERR_UNSUPPORTED;
+}
+
+bool VFW::InstallFakeCodec() {
+	return ICInstall(ICTYPE_VIDEO, FAKE_FOURCC, reinterpret_cast<LPARAM>(&FakeDriverProc),
+		nullptr, ICINSTALL_FUNCTION) != FALSE;
+}
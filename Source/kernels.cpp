@@ -0,0 +1,464 @@
+#include "kernels.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+#include <emmintrin.h>
+
+void VFW::Kernel::ScaleBGRA(const uint8_t* src, size_t srcStride, uint32_t srcWidth, uint32_t srcHeight,
+	uint8_t* dst, size_t dstStride, uint32_t dstWidth, uint32_t dstHeight) {
+	if ((srcWidth == dstWidth * 2) && (srcHeight == dstHeight * 2)) {
+		ScaleBGRABox2x(src, srcStride, dst, dstStride, dstWidth, dstHeight);
+	} else {
+		ScaleBGRABilinear(src, srcStride, srcWidth, srcHeight, dst, dstStride, dstWidth, dstHeight);
+	}
+}
+
+void VFW::Kernel::ScaleBGRABox2x(const uint8_t* src, size_t srcStride,
+	uint8_t* dst, size_t dstStride, uint32_t dstWidth, uint32_t dstHeight) {
+	for (uint32_t y = 0; y < dstHeight; y++) {
+		const uint8_t* row0 = src + (size_t(y) * 2) * srcStride;
+		const uint8_t* row1 = row0 + srcStride;
+		uint8_t* out = dst + size_t(y) * dstStride;
+
+		// Four output pixels from eight input pixels per step. The sums are
+		// taken in 16 bits, so rounding matches the scalar tail exactly.
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i two = _mm_set1_epi16(2);
+		uint32_t x = 0;
+		for (; (x + 4) <= dstWidth; x += 4) {
+			__m128i sums[2];
+			for (size_t half = 0; half < 2; half++) {
+				__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + x * 8 + half * 16));
+				__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + x * 8 + half * 16));
+				// Vertical sums of two pixel pairs each.
+				__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+				__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+				// Then horizontal, with the even pixels of a pair against the odd ones.
+				__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+				sums[half] = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+			}
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + x * 4), _mm_packus_epi16(sums[0], sums[1]));
+		}
+		for (; x < dstWidth; x++) {
+			for (size_t c = 0; c < 4; c++) {
+				out[x * 4 + c] = uint8_t((
+					uint32_t(row0[x * 8 + c]) + row0[x * 8 + 4 + c]
+					+ row1[x * 8 + c] + row1[x * 8 + 4 + c] + 2) / 4);
+			}
+		}
+	}
+}
+
+void VFW::Kernel::ScaleBGRABilinear(const uint8_t* src, size_t srcStride, uint32_t srcWidth, uint32_t srcHeight,
+	uint8_t* dst, size_t dstStride, uint32_t dstWidth, uint32_t dstHeight) {
+	// Weights are 7 bit, so that a vertically blended value fits into a
+	// signed 16-bit lane and the horizontal blend can use madd.
+	const int32_t one = 128;
+
+	auto position = [one](uint32_t pos, uint32_t srcSize, uint32_t dstSize, uint32_t& index, int32_t& weight) {
+		int64_t fixed = ((int64_t(pos) * 2 + 1) * srcSize * one) / (int64_t(dstSize) * 2) - (one / 2);
+		if (fixed < 0)
+			fixed = 0;
+		index = uint32_t(fixed / one);
+		weight = int32_t(fixed % one);
+		if (srcSize < 2) {
+			index = 0;
+			weight = 0;
+		} else if (index >= (srcSize - 1)) {
+			index = srcSize - 2;
+			weight = one;
+		}
+	};
+
+	std::vector<uint32_t> xIndex(dstWidth);
+	std::vector<int32_t> xWeight(dstWidth);
+	for (uint32_t x = 0; x < dstWidth; x++) {
+		position(x, srcWidth, dstWidth, xIndex[x], xWeight[x]);
+	}
+
+	// Two extra pixels so that a single source column can still be loaded as a pair.
+	std::vector<int16_t> row(size_t(srcWidth + 2) * 4, 0);
+	const size_t rowBytes = size_t(srcWidth) * 4;
+	for (uint32_t y = 0; y < dstHeight; y++) {
+		uint32_t yIndex; int32_t yWeight;
+		position(y, srcHeight, dstHeight, yIndex, yWeight);
+		const uint8_t* row0 = src + size_t(yIndex) * srcStride;
+		const uint8_t* row1 = (srcHeight > 1) ? row0 + srcStride : row0;
+
+		// Vertical blend into 16-bit.
+		__m128i w0 = _mm_set1_epi16(int16_t(one - yWeight));
+		__m128i w1 = _mm_set1_epi16(int16_t(yWeight));
+		__m128i zero = _mm_setzero_si128();
+		size_t i = 0;
+		for (; (i + 8) <= rowBytes; i += 8) {
+			__m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row0 + i)), zero);
+			__m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row1 + i)), zero);
+			__m128i v = _mm_add_epi16(_mm_mullo_epi16(a, w0), _mm_mullo_epi16(b, w1));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(row.data() + i), v);
+		}
+		for (; i < rowBytes; i++) {
+			row[i] = int16_t(row0[i] * (one - yWeight) + row1[i] * yWeight);
+		}
+
+		// Horizontal blend, one output pixel per step.
+		uint8_t* out = dst + size_t(y) * dstStride;
+		__m128i round = _mm_set1_epi32(1 << 13);
+		for (uint32_t x = 0; x < dstWidth; x++) {
+			__m128i pair = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row.data() + size_t(xIndex[x]) * 4));
+			__m128i mixed = _mm_unpacklo_epi16(pair, _mm_srli_si128(pair, 8));
+			__m128i weight = _mm_set1_epi32((xWeight[x] << 16) | (one - xWeight[x]));
+			__m128i sum = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(mixed, weight), round), 14);
+			__m128i packed = _mm_packus_epi16(_mm_packs_epi32(sum, zero), zero);
+			*reinterpret_cast<int32_t*>(out + size_t(x) * 4) = _mm_cvtsi128_si32(packed);
+		}
+	}
+}
+
+void VFW::Kernel::ConvertYUVToBGRA(const uint8_t* const planes[3], const size_t strides[3], uint32_t chromaShift,
+	uint8_t* dst, size_t dstStride, uint32_t width, uint32_t height) {
+	// 16.16 fixed point coefficients.
+	const int32_t cy = 76309, crv = 104597, cgu = 25675, cgv = 53279, cbu = 132201;
+	for (uint32_t y = 0; y < height; y++) {
+		const uint8_t* rowY = planes[0] + size_t(y) * strides[0];
+		const uint8_t* rowU = planes[1] + size_t(y >> chromaShift) * strides[1];
+		const uint8_t* rowV = planes[2] + size_t(y >> chromaShift) * strides[2];
+		uint8_t* out = dst + size_t(y) * dstStride;
+		for (uint32_t x = 0; x < width; x++, out += 4) {
+			int32_t luma = (int32_t(rowY[x]) - 16) * cy + 32768;
+			int32_t u = int32_t(rowU[x >> chromaShift]) - 128;
+			int32_t v = int32_t(rowV[x >> chromaShift]) - 128;
+			int32_t r = (luma + crv * v) >> 16;
+			int32_t g = (luma - cgu * u - cgv * v) >> 16;
+			int32_t b = (luma + cbu * u) >> 16;
+			out[0] = uint8_t(b < 0 ? 0 : (b > 255 ? 255 : b));
+			out[1] = uint8_t(g < 0 ? 0 : (g > 255 ? 255 : g));
+			out[2] = uint8_t(r < 0 ? 0 : (r > 255 ? 255 : r));
+			out[3] = 255;
+		}
+	}
+}
+
+uint32_t VFW::Kernel::EstimateComplexity(const uint8_t* src, size_t stride, uint32_t width, uint32_t height) {
+	if ((width < 2) || (height == 0))
+		return 0;
+
+	const size_t rowBytes = size_t(width - 1) * 4;
+	uint64_t total = 0, pairs = 0;
+	for (uint32_t y = 0; y < height; y += 4) {
+		const uint8_t* row = src + size_t(y) * stride;
+		__m128i sum = _mm_setzero_si128();
+		size_t x = 0;
+		for (; (x + 16) <= rowBytes; x += 16) {
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x + 4));
+			sum = _mm_add_epi64(sum, _mm_sad_epu8(a, b));
+		}
+		total += uint64_t(_mm_cvtsi128_si32(sum)) + uint64_t(_mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+		for (; x < rowBytes; x++) {
+			total += uint64_t(abs(int32_t(row[x]) - int32_t(row[x + 4])));
+		}
+		pairs += width - 1;
+	}
+	return uint32_t((total * 16) / pairs);
+}
+
+void VFW::Kernel::LumaHistogram(const uint8_t* src, size_t stride, uint32_t width, uint32_t height, uint32_t(&histogram)[64]) {
+	std::memset(histogram, 0, sizeof(histogram));
+	for (uint32_t y = 0; y < height; y += 4) {
+		const uint8_t* row = src + size_t(y) * stride;
+		for (uint32_t x = 0; x < width; x += 4) {
+			const uint8_t* px = row + size_t(x) * 4;
+			uint32_t luma = (uint32_t(px[0]) + uint32_t(px[1]) * 5 + uint32_t(px[2]) * 2) >> 3;
+			histogram[luma >> 2]++;
+		}
+	}
+}
+
+void VFW::Kernel::FlipRows(uint8_t* data, size_t stride, uint32_t height) {
+	// Swaps through registers, instead of copying every pair of rows three
+	// times through a temporary row.
+	for (uint32_t y = 0; y < height / 2; y++) {
+		uint8_t* top = data + size_t(y) * stride;
+		uint8_t* bottom = data + size_t(height - y - 1) * stride;
+		size_t x = 0;
+		for (; (x + 16) <= stride; x += 16) {
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top + x));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + x));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(top + x), b);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(bottom + x), a);
+		}
+		for (; x < stride; x++) {
+			uint8_t v = top[x];
+			top[x] = bottom[x];
+			bottom[x] = v;
+		}
+	}
+}
+
+void VFW::Kernel::CopyPlane(const uint8_t* src, size_t srcStride, uint8_t* dst, size_t rowBytes, uint32_t height) {
+	// memcpy is already vectorized by the runtime, so all that is left to
+	// win is not splitting the copy when there is nothing to skip.
+	if (srcStride == rowBytes) {
+		std::memcpy(dst, src, rowBytes * height);
+		return;
+	}
+	for (uint32_t y = 0; y < height; y++) {
+		std::memcpy(dst + size_t(y) * rowBytes, src + size_t(y) * srcStride, rowBytes);
+	}
+}
+
+// BT.601 luma of four BGRA pixels, one per 32-bit lane.
+static inline __m128i LumaBGRA4(__m128i pixels) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i weights = _mm_setr_epi16(29, 150, 77, 0, 29, 150, 77, 0);
+	// B*29 + G*150 and R*77 + A*0 per pixel, then the pairs summed.
+	__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), weights);
+	__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), weights);
+	lo = _mm_add_epi32(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+	hi = _mm_add_epi32(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+	__m128i luma = _mm_unpacklo_epi64(
+		_mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0)),
+		_mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0)));
+	return _mm_srli_epi32(luma, 8);
+}
+
+static inline int32_t HorizontalSum(__m128i v) {
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(v);
+}
+
+VFW::Kernel::Quality VFW::Kernel::CompareBGRA(const uint8_t* a, size_t strideA, const uint8_t* b, size_t strideB, uint32_t width, uint32_t height) {
+	// SSIM constants for 8-bit samples: (0.01 * 255)^2 and (0.03 * 255)^2
+	const double c1 = 6.5025, c2 = 58.5225;
+	uint64_t sse = 0, blocks = 0;
+	double ssim = 0;
+	for (uint32_t by = 0; (by + 8) <= height; by += 8) {
+		for (uint32_t bx = 0; (bx + 8) <= width; bx += 8) {
+			// Luma is below 256, so _mm_madd_epi16 squares and multiplies
+			// 32-bit lanes as the upper halves are zero.
+			__m128i sx = _mm_setzero_si128(), sy = sx, sxx = sx, syy = sx, sxy = sx;
+			for (uint32_t y = by; y < (by + 8); y++) {
+				const uint8_t* rowA = a + size_t(y) * strideA + size_t(bx) * 4;
+				const uint8_t* rowB = b + size_t(y) * strideB + size_t(bx) * 4;
+				for (size_t x = 0; x < 32; x += 16) {
+					__m128i la = LumaBGRA4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rowA + x)));
+					__m128i lb = LumaBGRA4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rowB + x)));
+					sx = _mm_add_epi32(sx, la);
+					sy = _mm_add_epi32(sy, lb);
+					sxx = _mm_add_epi32(sxx, _mm_madd_epi16(la, la));
+					syy = _mm_add_epi32(syy, _mm_madd_epi16(lb, lb));
+					sxy = _mm_add_epi32(sxy, _mm_madd_epi16(la, lb));
+				}
+			}
+
+			int64_t sumX = HorizontalSum(sx), sumY = HorizontalSum(sy);
+			int64_t sumXX = HorizontalSum(sxx), sumYY = HorizontalSum(syy), sumXY = HorizontalSum(sxy);
+			sse += uint64_t(sumXX + sumYY - 2 * sumXY);
+
+			double meanX = double(sumX) / 64.0, meanY = double(sumY) / 64.0;
+			double varX = double(sumXX) / 64.0 - meanX * meanX;
+			double varY = double(sumYY) / 64.0 - meanY * meanY;
+			double cov = double(sumXY) / 64.0 - meanX * meanY;
+			ssim += ((2.0 * meanX * meanY + c1) * (2.0 * cov + c2))
+				/ ((meanX * meanX + meanY * meanY + c1) * (varX + varY + c2));
+			blocks++;
+		}
+	}
+
+	Quality quality = { 0, 0 };
+	if (blocks == 0)
+		return quality;
+	double mse = double(sse) / double(blocks * 64);
+	quality.psnr = (mse > 0) ? (10.0 * log10(255.0 * 255.0 / mse)) : 100.0;
+	quality.ssim = ssim / double(blocks);
+	return quality;
+}
+
+static inline uint64_t HashMix(uint64_t hash, uint64_t value) {
+	hash += value * 0xC2B2AE3D27D4EB4FULL;
+	hash = (hash << 31) | (hash >> 33);
+	return hash * 0x9E3779B185EBCA87ULL;
+}
+
+void VFW::Kernel::HashRows(const uint8_t* src, size_t stride, size_t rowBytes, uint32_t height, uint64_t* hashes) {
+	// Four independent lanes, so the multiplies don't wait on each other.
+	for (uint32_t y = 0; y < height; y++) {
+		const uint8_t* row = src + size_t(y) * stride;
+		uint64_t lanes[4] = { 0x60EA27EEADC0B5D6ULL, 0xC2B2AE3D27D4EB4FULL, 0, 0x61C8864E7A143579ULL };
+		size_t x = 0;
+		for (; (x + 32) <= rowBytes; x += 32) {
+			uint64_t values[4];
+			std::memcpy(values, row + x, sizeof(values));
+			lanes[0] = HashMix(lanes[0], values[0]);
+			lanes[1] = HashMix(lanes[1], values[1]);
+			lanes[2] = HashMix(lanes[2], values[2]);
+			lanes[3] = HashMix(lanes[3], values[3]);
+		}
+		for (; x < rowBytes; x += 8) {
+			uint64_t value = 0;
+			std::memcpy(&value, row + x, ((rowBytes - x) < 8) ? (rowBytes - x) : 8);
+			lanes[0] = HashMix(lanes[0], value);
+		}
+		hashes[y] = HashMix(HashMix(HashMix(lanes[0], lanes[1]), lanes[2]), lanes[3]);
+	}
+}
+
+const uint8_t* VFW::Kernel::FindStartCode(const uint8_t* begin, const uint8_t* end) {
+	const uint8_t* p = begin;
+	const __m128i zero = _mm_setzero_si128();
+	while ((end - p) >= 3) {
+		// Every start code begins with a zero byte, skip blocks without one.
+		while ((end - p) >= 18) {
+			int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), zero));
+			if (mask != 0) {
+				while ((mask & 1) == 0) {
+					mask >>= 1;
+					p++;
+				}
+				break;
+			}
+			p += 16;
+		}
+
+		if (p[2] > 1) {
+			p += 3;
+		} else if (p[1] != 0) {
+			p += 2;
+		} else if ((p[0] != 0) || (p[2] != 1)) {
+			p += 1;
+		} else {
+			return p;
+		}
+	}
+	return end;
+}
+
+// Every frame rate MPEG-2 can signal, keyed by frames per second times
+// mpeg2_hertz_mult.
+static const uint64_t mpeg2_hertz_mult = 0xFFFFFFFF;
+
+static std::map<uint64_t, VFW::Kernel::MPEG2FrameRate> BuildMPEG2FrameRates() {
+	static const std::pair<uint8_t, double> native_hertz[] = {
+		std::make_pair(8, 60.0),
+		std::make_pair(7, (60000.0 / 1001.0)),
+		std::make_pair(6, 50.0),
+		std::make_pair(5, 30.0),
+		std::make_pair(4, (30000.0 / 1001.0)),
+		std::make_pair(3, 25.0),
+		std::make_pair(2, 24.0),
+		std::make_pair(1, (24000.0 / 1001.0)),
+	};
+
+	std::map<uint64_t, VFW::Kernel::MPEG2FrameRate> rates;
+	for (auto kv : native_hertz) {
+		VFW::Kernel::MPEG2FrameRate rate = { kv.first, 0, 0 };
+		rates.insert(std::make_pair(uint64_t(kv.second * mpeg2_hertz_mult), rate));
+	}
+	for (auto kv : native_hertz) {
+		for (uint8_t num = 0; num < (1 << 2); num++) {
+			for (uint8_t den = 0; den < (1 << 5); den++) {
+				if (num == den)
+					continue; // Don't need the 1:1 ones >_>
+
+				double fps = kv.second * (double(num + 1) / double(den + 1));
+				uint64_t key = uint64_t(fps * mpeg2_hertz_mult);
+				if (rates.count(key)) {
+					continue; // Duplicate.
+				}
+
+				VFW::Kernel::MPEG2FrameRate rate = { kv.first, num, den };
+				rates.insert(std::make_pair(key, rate));
+			}
+		}
+	}
+	return rates;
+}
+
+VFW::Kernel::MPEG2FrameRate VFW::Kernel::FindMPEG2FrameRate(uint32_t fpsNum, uint32_t fpsDen) {
+	static const std::map<uint64_t, MPEG2FrameRate> rates = BuildMPEG2FrameRates();
+
+	uint64_t sourceKey = uint64_t((double(fpsNum) / double(fpsDen)) * mpeg2_hertz_mult);
+	MPEG2FrameRate bestMatch = { 0, 0, 0 };
+	uint64_t bestMatchDiff = UINT64_MAX;
+	for (auto& kv : rates) {
+		uint64_t diff = uint64_t(llabs(int64_t(sourceKey) - int64_t(kv.first)));
+		if (diff < bestMatchDiff) {
+			bestMatch = kv.second;
+			bestMatchDiff = diff;
+		}
+	}
+	return bestMatch;
+}
+
+void VFW::Kernel::FixMatroxMPEG2(uint8_t* data, size_t size, MPEG2FrameRate rate) {
+	// Matrox developers are idiots. Their MPEG-2 codec flags the content
+	// as interlaced top-field top-displayed, but in reality there is a
+	// progressive frame there. But that isn't the only issue.
+	// They also have structures in the stream that are larger than the
+	// standard allows for, or even invalid user data (all 0s). It's just
+	// a big bunch of "How did this ever work?" ...
+	size_t streamPosition = 0;
+	while ((streamPosition < size) && ((size - streamPosition) >= 4)) {
+		uint8_t blockId = data[streamPosition + 3];
+		streamPosition += 4;
+
+		switch (blockId) {
+			case 0xB3: // Sequence Header
+			{
+				// Rewrite Framerate
+				uint8_t b = data[streamPosition + 3];
+				data[streamPosition + 3] = (b & 0xF0) + (rate.code & 0x0F);
+				streamPosition += 8;
+				break;
+			}
+			case 0xB5:
+			{
+				uint8_t type = (data[streamPosition] & 0xF0) >> 4;
+				switch (type) {
+					case 0x1:
+					{ // Sequence Extension (Progressive, FPS, ChromaFormat possible)
+						data[streamPosition + 1] |= 1 << 3; // Flag Progressive
+						data[streamPosition + 5] = // Rewrite FPS Ext
+							(data[streamPosition + 5] & 0x80)
+							| ((rate.extN & 0x3) << 5)
+							| ((rate.extD & 0x1F));
+						streamPosition += 6;
+						break;
+					}
+					case 0x2:
+					{ // Sequence Display Extension
+						if (data[streamPosition] & 0x1) {
+							streamPosition += 8;
+						} else {
+							streamPosition += 5;
+						}
+						break;
+					}
+					case 0x8:
+					{ // Picture Coding Extension
+						data[streamPosition + 2] |= 0x3; // Full Frame
+						data[streamPosition + 3] &= ~(1 << 7); // top field first
+						data[streamPosition + 3] &= ~(1 << 1); // repeat first field
+						data[streamPosition + 4] |= 1 << 7; // progressive
+						if (data[streamPosition + 4] & 0x40) {
+							streamPosition += 7;
+						} else {
+							streamPosition += 5;
+						}
+						break;
+					}
+				}
+				break;
+			}
+		}
+
+		// Seek to a valid position.
+		if (streamPosition < size)
+			streamPosition = size_t(FindStartCode(data + streamPosition, data + size) - data);
+	}
+}
@@ -0,0 +1,182 @@
+#include "enc-vfw.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Times encode() with the stand-in codec (Encoder Id "Fake-fake"), which only
+// copies frames, so that what is measured is the pipeline around the codec:
+// Input copy, pre-processing, the hand-offs between the stages and packet
+// retrieval. Runs every compression mode on the worker threads, and Normal
+// inline, and writes the results as JSON like enc-vfw-benchmark.
+//
+// Usage: enc-vfw-pipeline [-o Results.json] [-n Frames per Measurement] [-s WidthxHeight]
+
+struct variant_t {
+	const char* name;
+	const char* mode;
+	int64_t latency; // Zero lets the encoder switch to inline encoding.
+};
+
+static const variant_t variants[] = {
+	{ "Normal", PROP_MODE_NORMAL, 1 },
+	{ "Temporal", PROP_MODE_TEMPORAL, 1 },
+	{ "Sequential", PROP_MODE_SEQUENTIAL, 1 },
+	{ "Inline", PROP_MODE_NORMAL, 0 },
+};
+
+// Calls before measuring, which also gives the encoder time to go inline.
+static const uint64_t warmup_frames = 60;
+
+struct result_t {
+	std::string variant;
+	uint64_t frames, packets;
+	double ns;
+};
+
+static std::vector<result_t> _results;
+
+static bool WriteResults(const char* path, uint32_t width, uint32_t height) {
+	std::ofstream file(path, std::ios::out | std::ios::trunc);
+	if (!file.is_open())
+		return false;
+	file << "[\n";
+	for (size_t idx = 0; idx < _results.size(); idx++) {
+		const result_t& result = _results[idx];
+		char buf[512];
+		snprintf(buf, sizeof(buf),
+			"{\"variant\":\"%s\",\"resolution\":\"%ux%u\",\"frames\":%llu,\"packets\":%llu,"
+			"\"ns_per_frame\":%.1f,\"fps\":%.1f}%s\n",
+			result.variant.c_str(), width, height,
+			(unsigned long long)result.frames, (unsigned long long)result.packets,
+			result.ns, 1000000000.0 / result.ns,
+			(idx + 1 < _results.size()) ? "," : "");
+		file << buf;
+	}
+	file << "]\n";
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	const char* output = nullptr;
+	uint64_t count = 1000;
+	uint32_t width = 1280, height = 720;
+	for (int arg = 1; arg < argc; arg++) {
+		if ((strcmp(argv[arg], "-o") == 0) && (arg + 1 < argc)) {
+			output = argv[++arg];
+		} else if ((strcmp(argv[arg], "-n") == 0) && (arg + 1 < argc)) {
+			count = strtoull(argv[++arg], nullptr, 10);
+		} else if ((strcmp(argv[arg], "-s") == 0) && (arg + 1 < argc)
+			&& (sscanf(argv[++arg], "%ux%u", &width, &height) == 2)) {
+			continue;
+		} else {
+			printf("Usage: %s [-o Results.json] [-n Frames per Measurement] [-s WidthxHeight]\n", argv[0]);
+			return 1;
+		}
+	}
+	if ((count == 0) || (width == 0) || (height == 0)) {
+		printf("Frames and resolution must not be zero.\n");
+		return 1;
+	}
+
+	if (!obs_startup("en-US", nullptr, nullptr)) {
+		printf("Unable to start libobs.\n");
+		return 1;
+	}
+	VFW::InstallFakeCodec();
+	VFW::Initialize();
+
+	int result = 0;
+	VFW::Info* info = VFW::GetInfo("Fake-fake");
+	if (!info) {
+		printf("The stand-in codec is not available.\n");
+		result = 1;
+	}
+
+	// A few different frames, so that nothing can be skipped as unchanged.
+	std::vector<std::vector<uint8_t>> frames(4);
+	for (size_t index = 0; index < frames.size(); index++) {
+		frames[index].resize(size_t(width) * height * 4);
+		for (size_t px = 0; px < frames[index].size(); px++)
+			frames[index][px] = uint8_t(px * 7 + index * 31);
+	}
+
+	for (const variant_t& variant : variants) {
+		if (result != 0)
+			break;
+
+		obs_data_t* settings = obs_data_create();
+		VFW::Encoder::get_defaults(settings);
+		obs_data_set_string(settings, PROP_MODE, variant.mode);
+		obs_data_set_int(settings, PROP_LATENCY, variant.latency);
+
+		VFW::Encoder* encoder = nullptr;
+		try {
+			encoder = new VFW::Encoder(info, settings, width, height, 60, 1);
+		} catch (std::exception& ex) {
+			printf("Unable to create the encoder: %s\n", ex.what());
+			obs_data_release(settings);
+			result = 1;
+			break;
+		}
+
+		namespace sc = std::chrono;
+		using schrc = std::chrono::high_resolution_clock;
+		uint64_t packets = 0;
+		auto tbegin = schrc::now();
+		for (uint64_t index = 0; index < warmup_frames + count; index++) {
+			if (index == warmup_frames)
+				tbegin = schrc::now();
+
+			encoder_frame frame;
+			std::memset(&frame, 0, sizeof(encoder_frame));
+			frame.data[0] = frames[index % frames.size()].data();
+			frame.linesize[0] = width * 4;
+			frame.pts = int64_t(index);
+
+			encoder_packet packet;
+			bool received = false;
+			std::memset(&packet, 0, sizeof(encoder_packet));
+			encoder->encode(&frame, &packet, &received);
+			if (received && (packet.pts >= int64_t(warmup_frames)))
+				packets++;
+		}
+		// Packets still in flight are part of the measurement.
+		while (true) {
+			encoder_packet packet;
+			bool received = false;
+			encoder->encode(nullptr, &packet, &received);
+			if (!received)
+				break;
+			if (packet.pts >= int64_t(warmup_frames))
+				packets++;
+		}
+		auto tend = schrc::now();
+
+		result_t entry;
+		entry.variant = variant.name;
+		entry.frames = count;
+		entry.packets = packets;
+		entry.ns = sc::duration<double, std::nano>(tend - tbegin).count() / double(count);
+		_results.push_back(entry);
+		printf("%-10s %ux%u %8llu frames %8llu packets %12.0f ns %9.1f FPS\n",
+			variant.name, width, height, (unsigned long long)count, (unsigned long long)packets,
+			entry.ns, 1000000000.0 / entry.ns);
+
+		delete encoder;
+		obs_data_release(settings);
+	}
+
+	if ((result == 0) && output && !WriteResults(output, width, height)) {
+		printf("Unable to write results to '%s'.\n", output);
+		result = 1;
+	}
+
+	VFW::Finalize();
+	obs_shutdown();
+	return result;
+}
@@ -1,5 +1,7 @@
 #pragma once
+#ifdef _WIN32
 #include <windows.h>
+#endif
 
 #include "plugin.h"
 #include "enc-vfw.h"
@@ -8,9 +10,11 @@
 // Code                                                                 //
 //////////////////////////////////////////////////////////////////////////
 
+#ifdef _WIN32
 BOOL WINAPI DllMain(HINSTANCE, DWORD, LPVOID) {
 	return TRUE;
 }
+#endif
 
 //////////////////////////////////////////////////////////////////////////
 // Open Broadcaster Software Studio                                     //
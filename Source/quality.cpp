@@ -0,0 +1,132 @@
+#include "quality.h"
+#include "kernels.h"
+
+#include <stdexcept>
+
+// Share of one core that measuring may use, over the lifetime of the sampler.
+static const int64_t quality_budget_percent = 5;
+
+VFW::QualitySampler::QualitySampler(VFW::Info* info, BITMAPINFO* inputFormat, BITMAPINFO* outputFormat) {
+	myInfo = info;
+
+	// Compressed packets are described by the codec output format, and are
+	// decoded back into the format the codec was given.
+	m_bufferPacketInfo.resize(outputFormat->bmiHeader.biSize);
+	std::memcpy(m_bufferPacketInfo.data(), outputFormat, m_bufferPacketInfo.size());
+	m_packetInfo = reinterpret_cast<BITMAPINFO*>(m_bufferPacketInfo.data());
+	m_bufferFrameInfo.resize(inputFormat->bmiHeader.biSize);
+	std::memcpy(m_bufferFrameInfo.data(), inputFormat, m_bufferFrameInfo.size());
+	m_frameInfo = reinterpret_cast<BITMAPINFO*>(m_bufferFrameInfo.data());
+	m_decoded.resize(m_frameInfo->bmiHeader.biSizeImage);
+
+	hIC = ICOpen(myInfo->icInfo.fccType, myInfo->icInfo.fccHandler, ICMODE_DECOMPRESS);
+	if (hIC == 0) {
+		PLOG_WARNING("<%s> Quality: Driver has no decompressor.", myInfo->Name.c_str());
+		throw std::exception();
+	}
+	LRESULT err = ICDecompressQuery(hIC, m_packetInfo, m_frameInfo);
+	if (err == ICERR_OK)
+		err = ICDecompressBegin(hIC, m_packetInfo, m_frameInfo);
+	if (err != ICERR_OK) {
+		PLOG_WARNING("<%s> Quality: Unable to decompress to the input format: %s.",
+			myInfo->Name.c_str(), FormattedICCError(err).c_str());
+		ICClose(hIC);
+		throw std::exception();
+	}
+
+	m_shutdown = m_pending = false;
+	m_start = std::chrono::steady_clock::now();
+	m_busy = 0;
+	m_samples = m_skipped = m_failed = 0;
+	m_psnrSum = m_ssimSum = 0;
+	m_worker = std::thread(&QualitySampler::workerMain, this);
+}
+
+VFW::QualitySampler::~QualitySampler() {
+	{
+		std::unique_lock<std::mutex> ulock(m_lock);
+		m_shutdown = true;
+		m_cv.notify_all();
+	}
+	m_worker.join();
+
+	ICDecompressEnd(hIC);
+	ICClose(hIC);
+}
+
+bool VFW::QualitySampler::submit(const std::vector<char>& packet, const std::shared_ptr<std::vector<char>>& input) {
+	std::unique_lock<std::mutex> ulock(m_lock);
+	int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+	if (m_pending || ((m_busy * 100) > (elapsed * quality_budget_percent))) {
+		m_skipped++;
+		return false;
+	}
+
+	m_packet.assign(packet.begin(), packet.end());
+	m_input = input;
+	m_pending = true;
+	m_cv.notify_all();
+	return true;
+}
+
+VFW::QualitySampler::Statistics VFW::QualitySampler::statistics() {
+	std::unique_lock<std::mutex> ulock(m_lock);
+	Statistics stats;
+	stats.samples = m_samples;
+	stats.skipped = m_skipped;
+	stats.failed = m_failed;
+	stats.psnr = (m_samples > 0) ? (m_psnrSum / double_t(m_samples)) : 0;
+	stats.ssim = (m_samples > 0) ? (m_ssimSum / double_t(m_samples)) : 0;
+	stats.milliseconds = ((m_samples + m_failed) > 0) ? (double_t(m_busy) / double_t(m_samples + m_failed) / 1000000.0) : 0;
+	return stats;
+}
+
+void VFW::QualitySampler::workerMain() {
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+
+	std::unique_lock<std::mutex> ulock(m_lock);
+	while (true) {
+		m_cv.wait(ulock, [this] {
+			return m_pending || m_shutdown;
+		});
+		if (m_shutdown)
+			break;
+
+		// The packet and input stay untouched until m_pending is cleared.
+		std::shared_ptr<std::vector<char>> input = m_input;
+		ulock.unlock();
+
+		auto tbegin = std::chrono::steady_clock::now();
+		m_packetInfo->bmiHeader.biSizeImage = DWORD(m_packet.size());
+		DWORD err = ICDecompress(hIC, 0,
+			&(m_packetInfo->bmiHeader), m_packet.data(),
+			&(m_frameInfo->bmiHeader), m_decoded.data());
+		VFW::Kernel::Quality quality = { 0, 0 };
+		if (err == ICERR_OK) {
+			uint32_t width = uint32_t(m_frameInfo->bmiHeader.biWidth);
+			uint32_t height = uint32_t(abs(m_frameInfo->bmiHeader.biHeight));
+			quality = VFW::Kernel::CompareBGRA(
+				reinterpret_cast<const uint8_t*>(input->data()), input->size() / height,
+				reinterpret_cast<const uint8_t*>(m_decoded.data()), size_t(width) * 4,
+				width, height);
+		}
+		int64_t busy = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tbegin).count();
+		input = nullptr;
+
+		ulock.lock();
+		if (err == ICERR_OK) {
+			m_samples++;
+			m_psnrSum += quality.psnr;
+			m_ssimSum += quality.ssim;
+		} else {
+			if (m_failed == 0) {
+				PLOG_WARNING("<%s> Quality: Unable to decompress a sample: %s.",
+					myInfo->Name.c_str(), FormattedICCError(LRESULT(err)).c_str());
+			}
+			m_failed++;
+		}
+		m_busy += busy;
+		m_input = nullptr;
+		m_pending = false;
+	}
+}
@@ -0,0 +1,100 @@
+#include "enc-vfw.h"
+#include "capture.h"
+
+#include <chrono>
+#include <thread>
+
+// Feeds a frame capture (see PROP_CAPTURE_PATH) through the encoder pipeline,
+// either as fast as the pipeline allows or paced at the captured frame rate.
+// The stand-in codec (Encoder Id "Fake-fake") is always available, so this
+// also runs without any driver, and on other platforms than Windows.
+//
+// Usage: enc-vfw-replay <Encoder Id> <Capture File> [realtime] [loops]
+
+int main(int argc, char* argv[]) {
+	if (argc < 3) {
+		printf("Usage: %s <Encoder Id> <Capture File> [realtime] [loops]\n", argv[0]);
+		return 1;
+	}
+	bool realtime = (argc > 3) && (strcmp(argv[3], "realtime") == 0);
+	size_t loops = (argc > 4) ? size_t(strtoul(argv[4], nullptr, 10)) : 1;
+
+	if (!obs_startup("en-US", nullptr, nullptr)) {
+		printf("Unable to start libobs.\n");
+		return 1;
+	}
+	VFW::InstallFakeCodec();
+	VFW::Initialize();
+
+	int result = 0;
+	try {
+		VFW::Info* info = VFW::GetInfo(argv[1]);
+		if (!info)
+			throw std::runtime_error("Unknown encoder id");
+
+		VFW::CaptureReader reader(argv[2]);
+		const VFW::CaptureHeader& header = reader.header();
+		if ((header.format != VIDEO_FORMAT_BGRA) || (reader.count() == 0))
+			throw std::runtime_error("Unsupported capture");
+
+		obs_data_t* settings = obs_data_create();
+		VFW::Encoder::get_defaults(settings);
+		VFW::Encoder* encoder = new VFW::Encoder(info, settings,
+			header.width, header.height, header.fpsNum, header.fpsDen);
+
+		namespace sc = std::chrono;
+		using schrc = std::chrono::high_resolution_clock;
+		sc::nanoseconds frameTime(int64_t((double_t(header.fpsDen) / double_t(header.fpsNum)) * 1000000000.0));
+
+		uint64_t frames = 0, packets = 0, bytes = 0;
+		auto tbegin = schrc::now();
+		for (size_t loop = 0; loop < loops; loop++) {
+			for (size_t index = 0; index < reader.count(); index++) {
+				encoder_frame frame;
+				reader.read(index, &frame);
+				frame.pts = int64_t(frames); // Keep pts monotonic across loops.
+
+				if (realtime)
+					std::this_thread::sleep_until(tbegin + frameTime * frames);
+
+				encoder_packet packet;
+				bool received = false;
+				std::memset(&packet, 0, sizeof(encoder_packet));
+				encoder->encode(&frame, &packet, &received);
+				frames++;
+				if (received) {
+					packets++;
+					bytes += packet.size;
+				}
+			}
+		}
+		// Drain the pipeline and the codec the way OBS does before teardown.
+		while (true) {
+			encoder_packet packet;
+			bool received = false;
+			encoder->encode(nullptr, &packet, &received);
+			if (!received)
+				break;
+			packets++;
+			bytes += packet.size;
+		}
+		auto tend = schrc::now();
+
+		double_t seconds = sc::duration_cast<sc::duration<double_t>>(tend - tbegin).count();
+		PLOG_INFO("Replay: %" PRIu64 " frames, %" PRIu64 " packets, %" PRIu64 " bytes in %0.3f s "
+			"(%0.2f FPS, %0.3f ms/frame, %s).",
+			frames, packets, bytes, seconds,
+			double_t(frames) / seconds, seconds * 1000.0 / double_t(frames),
+			realtime ? "Real Time" : "Full Speed");
+
+		delete encoder;
+		obs_data_release(settings);
+	} catch (std::exception& ex) {
+		printf("Replay failed: %s\n", ex.what());
+		result = 1;
+	}
+
+	VFW::Finalize();
+	obs_shutdown();
+	return result;
+}
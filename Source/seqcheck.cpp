@@ -0,0 +1,277 @@
+#include "enc-vfw.h"
+#include "kernels.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Checks Sequential mode against the system's ICSeqCompressFrame, which it
+// stands in for (see VFW::Encoder::encodeVariant): Compresses the same frames
+// through the encoder and through ICSeqCompressFrameStart/ICSeqCompressFrame
+// on a second instance of the codec with the same state, and compares the
+// size, key frame flag and content of every frame. Only builds on Windows,
+// since the IC* calls of compat.h have no sequential compression.
+//
+// Usage: enc-vfw-seqcheck <Encoder Id> [-n Frames] [-s WidthxHeight] [-k Keyframe Interval] [-q Quality] [-b Bitrate]
+
+struct packet_t {
+	bool received;
+	bool keyframe;
+	std::vector<char> data;
+};
+
+// Frames that change a little from one to the next, so that temporal codecs
+// produce delta frames.
+static void MakeFrame(std::vector<uint8_t>& frame, uint32_t width, uint32_t height, uint64_t index) {
+	frame.resize(size_t(width) * height * 4);
+	for (uint32_t y = 0; y < height; y++) {
+		uint8_t* row = frame.data() + size_t(y) * width * 4;
+		for (uint32_t x = 0; x < width; x++) {
+			row[x * 4 + 0] = uint8_t(x + index * 3);
+			row[x * 4 + 1] = uint8_t(y + index);
+			row[x * 4 + 2] = uint8_t((x ^ y) + ((((x + index * 4) / 32) % 2) ? 64 : 0));
+			row[x * 4 + 3] = 255;
+		}
+	}
+}
+
+// What the encoder did before Sequential mode compressed into its own buffers.
+static bool RunReference(VFW::Info* info, uint32_t width, uint32_t height, uint64_t count,
+	uint32_t keyframeInterval, double quality, uint32_t bitrate, std::vector<packet_t>& packets) {
+	// Same mode preference and fallback as VFW::Codec with the default settings.
+	HIC hIC = ICOpen(info->icInfo.fccType, info->icInfo.fccHandler, ICMODE_FASTCOMPRESS);
+	if (hIC == 0)
+		hIC = ICOpen(info->icInfo.fccType, info->icInfo.fccHandler, ICMODE_COMPRESS);
+	if (hIC == 0) {
+		printf("Unable to open the codec.\n");
+		return false;
+	}
+	if (info->stateInfo.size() > 0) {
+		ICSetState(hIC, info->stateInfo.data(), (DWORD)info->stateInfo.size());
+	} else {
+		ICSetState(hIC, NULL, 0);
+	}
+
+	BITMAPINFO input;
+	std::memset(&input, 0, sizeof(BITMAPINFO));
+	input.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+	input.bmiHeader.biWidth = width;
+	input.bmiHeader.biHeight = height;
+	input.bmiHeader.biPlanes = 1;
+	input.bmiHeader.biBitCount = 32;
+	input.bmiHeader.biCompression = BI_RGB;
+	input.bmiHeader.biSizeImage = width * height * 4;
+
+	LRESULT size = ICSendMessage(hIC, ICM_COMPRESS_GET_FORMAT, (DWORD_PTR)&input, 0);
+	if (size <= 0) {
+		printf("Unable to retrieve format information size: %s.\n", FormattedICCError(size).c_str());
+		ICClose(hIC);
+		return false;
+	}
+	std::vector<char> bufferOutput(size);
+	BITMAPINFO* output = reinterpret_cast<BITMAPINFO*>(bufferOutput.data());
+	output->bmiHeader.biSize = (DWORD)bufferOutput.size();
+	LRESULT err = ICSendMessage(hIC, ICM_COMPRESS_GET_FORMAT, (DWORD_PTR)&input, (DWORD_PTR)output);
+	if (err != ICERR_OK) {
+		printf("Unable to retrieve format information: %s.\n", FormattedICCError(err).c_str());
+		ICClose(hIC);
+		return false;
+	}
+
+	COMPVARS cv;
+	std::memset(&cv, 0, sizeof(COMPVARS));
+	cv.cbSize = sizeof(COMPVARS);
+	cv.dwFlags = ICMF_COMPVARS_VALID;
+	cv.hic = hIC;
+	cv.fccType = info->icInfo2.fccType;
+	cv.fccHandler = info->icInfo2.fccHandler;
+	cv.lpbiOut = output;
+	cv.lKey = keyframeInterval;
+	cv.lDataRate = bitrate;
+	cv.lQ = uint32_t(quality * 100); // As the encoder reads the Quality property.
+	if (!ICSeqCompressFrameStart(&cv, &input)) {
+		printf("Unable to begin sequential compression.\n");
+		ICClose(hIC);
+		return false;
+	}
+
+	bool result = true;
+	std::vector<uint8_t> frame;
+	packets.resize(count);
+	for (uint64_t index = 0; index < count; index++) {
+		// The encoder hands the codec bottom-up rows.
+		MakeFrame(frame, width, height, index);
+		VFW::Kernel::FlipRows(frame.data(), size_t(width) * 4, height);
+
+		bool makeKeyframe = (keyframeInterval > 0) && ((index % keyframeInterval) == 0);
+		BOOL keyframe = FALSE;
+		LONG plSize = (LONG)frame.size();
+		LPVOID fptr = ICSeqCompressFrame(&cv, makeKeyframe ? ICCOMPRESS_KEYFRAME : 0,
+			frame.data(), &keyframe, &plSize);
+		if (fptr == NULL) {
+			printf("Frame %llu: ICSeqCompressFrame failed.\n", (unsigned long long)index);
+			result = false;
+			break;
+		}
+		packets[index].received = true;
+		packets[index].keyframe = keyframe != FALSE;
+		packets[index].data.assign(static_cast<char*>(fptr), static_cast<char*>(fptr) + plSize);
+	}
+
+	ICSeqCompressFrameEnd(&cv);
+	ICClose(hIC);
+	return result;
+}
+
+static bool RunEncoder(VFW::Info* info, uint32_t width, uint32_t height, uint64_t count,
+	uint32_t keyframeInterval, double quality, uint32_t bitrate, std::vector<packet_t>& packets) {
+	obs_data_t* settings = obs_data_create();
+	VFW::Encoder::get_defaults(settings);
+	obs_data_set_string(settings, PROP_MODE, PROP_MODE_SEQUENTIAL);
+	obs_data_set_int(settings, PROP_INTERVAL_TYPE, 1);
+	obs_data_set_int(settings, PROP_KEYFRAME_INTERVAL2, keyframeInterval);
+	obs_data_set_double(settings, PROP_QUALITY, quality);
+	obs_data_set_int(settings, PROP_BITRATE, bitrate);
+	// Report key frames as the codec flags them, like ICSeqCompressFrame.
+	obs_data_set_bool(settings, PROP_FORCE_KEYFRAMES, false);
+
+	VFW::Encoder* encoder = nullptr;
+	try {
+		encoder = new VFW::Encoder(info, settings, width, height, 30, 1);
+	} catch (std::exception& ex) {
+		printf("Unable to create the encoder: %s\n", ex.what());
+		obs_data_release(settings);
+		return false;
+	}
+
+	packets.resize(count);
+	auto store = [&packets](const encoder_packet& packet) {
+		if ((packet.pts < 0) || (uint64_t(packet.pts) >= packets.size()))
+			return;
+		packet_t& entry = packets[size_t(packet.pts)];
+		entry.received = true;
+		entry.keyframe = packet.keyframe;
+		entry.data.assign(packet.data, packet.data + packet.size);
+	};
+
+	std::vector<uint8_t> frame;
+	for (uint64_t index = 0; index < count; index++) {
+		MakeFrame(frame, width, height, index);
+
+		encoder_frame input;
+		std::memset(&input, 0, sizeof(encoder_frame));
+		input.data[0] = frame.data();
+		input.linesize[0] = width * 4;
+		input.pts = int64_t(index);
+
+		encoder_packet packet;
+		bool received = false;
+		std::memset(&packet, 0, sizeof(encoder_packet));
+		encoder->encode(&input, &packet, &received);
+		if (received)
+			store(packet);
+	}
+	while (true) {
+		encoder_packet packet;
+		bool received = false;
+		std::memset(&packet, 0, sizeof(encoder_packet));
+		encoder->encode(nullptr, &packet, &received);
+		if (!received)
+			break;
+		store(packet);
+	}
+
+	delete encoder;
+	obs_data_release(settings);
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		printf("Usage: %s <Encoder Id> [-n Frames] [-s WidthxHeight] [-k Keyframe Interval] [-q Quality] [-b Bitrate]\n", argv[0]);
+		return 1;
+	}
+	uint64_t count = 300;
+	uint32_t width = 1280, height = 720;
+	uint32_t keyframeInterval = 30, bitrate = 0;
+	double quality = 100.0; // Like the Quality property, 1 to 100.
+	for (int arg = 2; arg < argc; arg++) {
+		if ((strcmp(argv[arg], "-n") == 0) && (arg + 1 < argc)) {
+			count = strtoull(argv[++arg], nullptr, 10);
+		} else if ((strcmp(argv[arg], "-s") == 0) && (arg + 1 < argc)
+			&& (sscanf(argv[++arg], "%ux%u", &width, &height) == 2)) {
+			continue;
+		} else if ((strcmp(argv[arg], "-k") == 0) && (arg + 1 < argc)) {
+			keyframeInterval = uint32_t(strtoul(argv[++arg], nullptr, 10));
+		} else if ((strcmp(argv[arg], "-q") == 0) && (arg + 1 < argc)) {
+			quality = strtod(argv[++arg], nullptr);
+		} else if ((strcmp(argv[arg], "-b") == 0) && (arg + 1 < argc)) {
+			bitrate = uint32_t(strtoul(argv[++arg], nullptr, 10));
+		} else {
+			printf("Usage: %s <Encoder Id> [-n Frames] [-s WidthxHeight] [-k Keyframe Interval] [-q Quality] [-b Bitrate]\n", argv[0]);
+			return 1;
+		}
+	}
+	if ((count == 0) || (width == 0) || (height == 0)) {
+		printf("Frames and resolution must not be zero.\n");
+		return 1;
+	}
+
+	if (!obs_startup("en-US", nullptr, nullptr)) {
+		printf("Unable to start libobs.\n");
+		return 1;
+	}
+	VFW::InstallFakeCodec();
+	VFW::Initialize();
+
+	int result = 0;
+	std::vector<packet_t> expected, actual;
+	VFW::Info* info = VFW::GetInfo(argv[1]);
+	if (!info) {
+		printf("Unknown encoder id '%s'.\n", argv[1]);
+		result = 1;
+	} else if (!RunReference(info, width, height, count, keyframeInterval, quality, bitrate, expected)
+		|| !RunEncoder(info, width, height, count, keyframeInterval, quality, bitrate, actual)) {
+		result = 1;
+	}
+
+	if (result == 0) {
+		uint64_t mismatches = 0, keyframes = 0;
+		for (uint64_t index = 0; index < count; index++) {
+			const packet_t& want = expected[index];
+			const packet_t& got = actual[index];
+			keyframes += want.keyframe ? 1 : 0;
+
+			const char* problem = nullptr;
+			if (!got.received) {
+				problem = "missing";
+			} else if (got.keyframe != want.keyframe) {
+				problem = "key frame flag differs";
+			} else if (got.data.size() != want.data.size()) {
+				problem = "size differs";
+			} else if (std::memcmp(got.data.data(), want.data.data(), want.data.size()) != 0) {
+				problem = "content differs";
+			}
+			if (!problem)
+				continue;
+
+			// Only the first few, a single difference usually carries on.
+			if (mismatches < 10) {
+				printf("Frame %llu: %s (ICSeqCompressFrame: %llu bytes, %s; Sequential mode: %llu bytes, %s).\n",
+					(unsigned long long)index, problem,
+					(unsigned long long)want.data.size(), want.keyframe ? "key frame" : "delta frame",
+					(unsigned long long)got.data.size(), got.keyframe ? "key frame" : "delta frame");
+			}
+			mismatches++;
+		}
+		printf("%llu frames, %llu key frames, %llu differ.\n",
+			(unsigned long long)count, (unsigned long long)keyframes, (unsigned long long)mismatches);
+		if (mismatches > 0)
+			result = 1;
+	}
+
+	VFW::Finalize();
+	obs_shutdown();
+	return result;
+}
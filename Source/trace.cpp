@@ -0,0 +1,199 @@
+#include "trace.h"
+#include "plugin.h"
+
+#include <cstdio>
+#include <stdexcept>
+
+struct trace_thread_t {
+	uint64_t serial;
+	void* buffer;
+};
+
+// Buffers of the current thread, by tracer.
+static thread_local std::vector<trace_thread_t> _traceThread;
+static std::atomic<uint64_t> _traceSerial(0);
+
+// Names come from the codec and the settings, so they may hold anything.
+// Span names are literals and are written as they are.
+static std::string EscapeJSON(const char* text) {
+	std::string escaped;
+	for (const char* p = text; *p != '\0'; p++) {
+		unsigned char c = static_cast<unsigned char>(*p);
+		if ((c == '"') || (c == '\\')) {
+			escaped += '\\';
+			escaped += char(c);
+		} else if (c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			escaped += buf;
+		} else {
+			escaped += char(c);
+		}
+	}
+	return escaped;
+}
+
+VFW::Tracer::Chunk::Chunk() : count(0), next(nullptr) {}
+
+VFW::Tracer::Tracer(const std::string& path, const std::string& name) {
+	m_serial = ++_traceSerial;
+	m_start = std::chrono::steady_clock::now();
+	for (size_t queue = 0; queue < QueueCount; queue++) {
+		for (size_t slot = 0; slot < queue_slots; slot++) {
+			m_queued[queue][slot] = -1;
+		}
+	}
+
+	m_file.open(path, std::ios::out | std::ios::trunc);
+	if (!m_file.is_open()) {
+		PLOG_ERROR("Unable to open trace file '%s'.", path.c_str());
+		throw std::runtime_error("Unable to open trace file");
+	}
+
+	// The closing bracket is optional, so a cut short trace still loads.
+	m_file << "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"" << EscapeJSON(name.c_str()) << "\"}},\n";
+
+	m_shutdown = false;
+	m_writer = std::thread(&Tracer::writerMain, this);
+}
+
+VFW::Tracer::~Tracer() {
+	{
+		std::unique_lock<std::mutex> ulock(m_lock);
+		m_shutdown = true;
+		m_writerCV.notify_all();
+	}
+	m_writer.join();
+
+	std::unique_lock<std::mutex> ulock(m_lock);
+	write();
+	m_file << "{}]\n";
+	for (Buffer* buffer : m_buffers) {
+		for (Chunk* chunk = buffer->head; chunk != nullptr;) {
+			Chunk* next = chunk->next;
+			delete chunk;
+			chunk = next;
+		}
+		delete buffer;
+	}
+}
+
+int64_t VFW::Tracer::now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+}
+
+void VFW::Tracer::span(const char* name, int64_t pts, int64_t begin, int64_t end) {
+	Buffer* buf = buffer();
+	Chunk* chunk = buf->tail;
+	size_t count = chunk->count.load(std::memory_order_relaxed);
+	if (count == chunk_events) {
+		Chunk* fresh = new Chunk();
+		chunk->next.store(fresh, std::memory_order_release);
+		buf->tail = chunk = fresh;
+		count = 0;
+	}
+
+	Event& ev = chunk->events[count];
+	ev.name = name;
+	ev.pts = pts;
+	ev.begin = begin;
+	ev.end = end;
+	chunk->count.store(count + 1, std::memory_order_release);
+}
+
+void VFW::Tracer::nameThread(const char* name) {
+	buffer()->name = name;
+}
+
+void VFW::Tracer::enqueue(Queue queue, int64_t pts) {
+	m_queued[queue][uint64_t(pts) % queue_slots] = now();
+}
+
+void VFW::Tracer::dequeue(Queue queue, int64_t pts, const char* name) {
+	int64_t begin = m_queued[queue][uint64_t(pts) % queue_slots].exchange(-1);
+	if (begin >= 0)
+		span(name, pts, begin, now());
+}
+
+VFW::Tracer::Buffer* VFW::Tracer::buffer() {
+	for (trace_thread_t& entry : _traceThread) {
+		if (entry.serial == m_serial)
+			return static_cast<Buffer*>(entry.buffer);
+	}
+
+	// First event from this thread.
+	Buffer* buf = new Buffer();
+	buf->name = nullptr;
+	buf->writtenName = nullptr;
+	buf->head = buf->tail = new Chunk();
+	buf->read = 0;
+	{
+		std::unique_lock<std::mutex> ulock(m_lock);
+		buf->tid = uint32_t(m_buffers.size() + 1);
+		m_buffers.push_back(buf);
+	}
+
+	// Entries of tracers that are long gone only need to be dropped eventually.
+	if (_traceThread.size() >= 16)
+		_traceThread.erase(_traceThread.begin());
+	trace_thread_t entry;
+	entry.serial = m_serial;
+	entry.buffer = buf;
+	_traceThread.push_back(entry);
+	return buf;
+}
+
+void VFW::Tracer::writerMain() {
+	std::unique_lock<std::mutex> ulock(m_lock);
+	while (!m_shutdown) {
+		m_writerCV.wait_for(ulock, std::chrono::seconds(1));
+		write();
+	}
+}
+
+void VFW::Tracer::write() {
+	// Called with m_lock held.
+	for (Buffer* buf : m_buffers) {
+		const char* name = buf->name;
+		if (name && (name != buf->writtenName)) {
+			m_file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buf->tid
+				<< ",\"args\":{\"name\":\"" << EscapeJSON(name) << "\"}},\n";
+			buf->writtenName = name;
+		}
+
+		while (true) {
+			size_t count = buf->head->count.load(std::memory_order_acquire);
+			for (; buf->read < count; buf->read++) {
+				const Event& ev = buf->head->events[buf->read];
+				m_file << "{\"name\":\"" << ev.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buf->tid
+					<< ",\"ts\":" << (ev.begin / 1000) << "." << ((ev.begin / 100) % 10)
+					<< ",\"dur\":" << ((ev.end - ev.begin) / 1000) << "." << (((ev.end - ev.begin) / 100) % 10)
+					<< ",\"args\":{\"pts\":" << ev.pts << "}},\n";
+			}
+
+			// Full chunks are no longer touched by the recording thread once
+			// it moved on to the next one.
+			Chunk* next = buf->head->next.load(std::memory_order_acquire);
+			if ((count < chunk_events) || (next == nullptr))
+				break;
+			delete buf->head;
+			buf->head = next;
+			buf->read = 0;
+		}
+	}
+	m_file.flush();
+}
+
+VFW::TraceSpan::TraceSpan(const std::shared_ptr<Tracer>& tracer, const char* name, int64_t pts) {
+	if (!tracer)
+		return;
+	m_tracer = tracer;
+	m_name = name;
+	m_pts = pts;
+	m_begin = tracer->now();
+}
+
+VFW::TraceSpan::~TraceSpan() {
+	if (m_tracer)
+		m_tracer->span(m_name, m_pts, m_begin, m_tracer->now());
+}
@@ -0,0 +1,265 @@
+#include "enc-vfw.h"
+#include "capture.h"
+#include "kernels.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+// Encodes raw video files as fast as the codec allows, several files at once,
+// and writes the packets of each into an AVI file next to the others.
+// Inputs are frame captures (*.vfwc), YUV4MPEG2 (*.y4m), or headerless I420
+// (*.yuv) and BGRA (*.bgra), which need the size and frame rate given.
+// Settings start from the defaults with the watchdog and the error limit off,
+// then a settings file as OBS stores it (-c) applies, then single options (-o):
+// mode=normal|temporal|sequential, quality=<Percent>, bitrate=<Value>.
+//
+// Usage: enc-vfw-transcode <Encoder Id> <Output Directory> [-j Jobs] [-s WxH] [-r Num/Den]
+//	[-c Settings.json] [-o Key=Value]... <Input>...
+
+struct transcode_job_t {
+	std::string input, output;
+	bool success;
+	uint64_t frames, packets, bytes;
+	double_t seconds;
+};
+
+static bool HasExtension(const std::string& path, const char* extension) {
+	size_t length = strlen(extension);
+	return (path.size() >= length) && (_stricmp(path.c_str() + path.size() - length, extension) == 0);
+}
+
+static bool ApplyOption(obs_data_t* settings, const char* option) {
+	const char* separator = strchr(option, '=');
+	if (!separator)
+		return false;
+	std::string key(option, separator - option);
+	const char* value = separator + 1;
+	if (key == "mode") {
+		if (_stricmp(value, "normal") == 0) {
+			obs_data_set_string(settings, PROP_MODE, PROP_MODE_NORMAL);
+		} else if (_stricmp(value, "temporal") == 0) {
+			obs_data_set_string(settings, PROP_MODE, PROP_MODE_TEMPORAL);
+		} else if (_stricmp(value, "sequential") == 0) {
+			obs_data_set_string(settings, PROP_MODE, PROP_MODE_SEQUENTIAL);
+		} else {
+			return false;
+		}
+	} else if (key == "quality") {
+		obs_data_set_double(settings, PROP_QUALITY, atof(value));
+	} else if (key == "bitrate") {
+		obs_data_set_int(settings, PROP_BITRATE, strtoll(value, nullptr, 10));
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static void Transcode(VFW::Info* info, transcode_job_t& job, obs_data_t* jobSettings,
+	uint32_t width, uint32_t height, uint32_t fpsNum, uint32_t fpsDen) {
+	// Captures and raw files share the header and random access interface.
+	std::unique_ptr<VFW::CaptureReader> capture;
+	std::unique_ptr<VFW::RawReader> raw;
+	VFW::CaptureHeader header;
+	if (HasExtension(job.input, ".vfwc")) {
+		capture = std::unique_ptr<VFW::CaptureReader>(new VFW::CaptureReader(job.input));
+		header = capture->header();
+	} else {
+		video_format format = VIDEO_FORMAT_NONE;
+		if (HasExtension(job.input, ".yuv")) {
+			format = VIDEO_FORMAT_I420;
+		} else if (HasExtension(job.input, ".bgra")) {
+			format = VIDEO_FORMAT_BGRA;
+		}
+		raw = std::unique_ptr<VFW::RawReader>(new VFW::RawReader(job.input, width, height, fpsNum, fpsDen, format));
+		header = raw->header();
+	}
+	size_t count = capture ? capture->count() : raw->count();
+
+	obs_data_t* settings = obs_data_create();
+	obs_data_apply(settings, jobSettings);
+	VFW::Encoder* encoder = nullptr;
+	std::unique_ptr<VFW::AVIWriter> output;
+	try {
+		encoder = new VFW::Encoder(info, settings, header.width, header.height, header.fpsNum, header.fpsDen);
+		output = std::unique_ptr<VFW::AVIWriter>(new VFW::AVIWriter(job.output, encoder->outputFormat(),
+			info->icInfo.fccHandler, header.width, header.height, header.fpsNum, header.fpsDen));
+	} catch (...) {
+		delete encoder;
+		obs_data_release(settings);
+		throw;
+	}
+
+	// The encoder takes BGRA, everything else is converted into one buffer.
+	std::vector<uint8_t> converted;
+	if (header.format != VIDEO_FORMAT_BGRA)
+		converted.resize(size_t(header.width) * header.height * 4);
+
+	auto tbegin = std::chrono::high_resolution_clock::now();
+	auto writePacket = [&](encoder_packet& packet) {
+		output->write(&packet);
+		job.packets++;
+		job.bytes += packet.size;
+	};
+	for (size_t index = 0; index < count; index++) {
+		encoder_frame frame;
+		if (capture) {
+			capture->read(index, &frame);
+		} else {
+			raw->read(index, &frame);
+		}
+		frame.pts = int64_t(index);
+
+		if (header.format != VIDEO_FORMAT_BGRA) {
+			const uint8_t* planes[3] = { frame.data[0], frame.data[1], frame.data[2] };
+			const size_t strides[3] = { frame.linesize[0], frame.linesize[1], frame.linesize[2] };
+			VFW::Kernel::ConvertYUVToBGRA(planes, strides, header.format == VIDEO_FORMAT_I420 ? 1 : 0,
+				converted.data(), size_t(header.width) * 4, header.width, header.height);
+			std::memset(&frame.data, 0, sizeof(frame.data));
+			std::memset(&frame.linesize, 0, sizeof(frame.linesize));
+			frame.data[0] = converted.data();
+			frame.linesize[0] = header.width * 4;
+		}
+
+		encoder_packet packet;
+		bool received = false;
+		std::memset(&packet, 0, sizeof(encoder_packet));
+		if (encoder->encodeOffline(&frame, &packet, &received))
+			job.frames++;
+		if (received)
+			writePacket(packet);
+	}
+	// Drain the pipeline and the codec the way OBS does before teardown.
+	while (true) {
+		encoder_packet packet;
+		bool received = false;
+		encoder->encode(nullptr, &packet, &received);
+		if (!received)
+			break;
+		writePacket(packet);
+	}
+	output->finish();
+	job.seconds = std::chrono::duration_cast<std::chrono::duration<double_t>>(
+		std::chrono::high_resolution_clock::now() - tbegin).count();
+
+	delete encoder;
+	obs_data_release(settings);
+	job.success = true;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 4) {
+		printf("Usage: %s <Encoder Id> <Output Directory> [-j Jobs] [-s WxH] [-r Num/Den] "
+			"[-c Settings.json] [-o Key=Value]... <Input>...\n", argv[0]);
+		return 1;
+	}
+
+	size_t jobs = size_t(max(std::thread::hardware_concurrency(), 1u));
+	uint32_t width = 0, height = 0, fpsNum = 0, fpsDen = 0;
+	const char* settingsPath = nullptr;
+	std::vector<const char*> options;
+	std::vector<transcode_job_t> files;
+	for (int arg = 3; arg < argc; arg++) {
+		char separator = 0;
+		if ((strcmp(argv[arg], "-j") == 0) && (arg + 1 < argc)) {
+			jobs = max(size_t(strtoul(argv[++arg], nullptr, 10)), size_t(1));
+		} else if ((strcmp(argv[arg], "-s") == 0) && (arg + 1 < argc)) {
+			sscanf(argv[++arg], "%" SCNu32 "%c%" SCNu32, &width, &separator, &height);
+		} else if ((strcmp(argv[arg], "-r") == 0) && (arg + 1 < argc)) {
+			sscanf(argv[++arg], "%" SCNu32 "%c%" SCNu32, &fpsNum, &separator, &fpsDen);
+		} else if ((strcmp(argv[arg], "-c") == 0) && (arg + 1 < argc)) {
+			settingsPath = argv[++arg];
+		} else if ((strcmp(argv[arg], "-o") == 0) && (arg + 1 < argc)) {
+			options.push_back(argv[++arg]);
+		} else {
+			transcode_job_t job;
+			job.input = argv[arg];
+			job.success = false;
+			job.frames = job.packets = job.bytes = 0;
+			job.seconds = 0;
+			files.push_back(job);
+		}
+	}
+
+	if (!obs_startup("en-US", nullptr, nullptr)) {
+		printf("Unable to start libobs.\n");
+		return 1;
+	}
+	VFW::InstallFakeCodec();
+	VFW::Initialize();
+
+	// Nothing watches over an offline run, so a stalled or failing codec is
+	// not restarted or stopped unless asked for.
+	obs_data_t* settings = obs_data_create();
+	VFW::Encoder::get_defaults(settings);
+	obs_data_set_int(settings, PROP_WATCHDOG, 0);
+	obs_data_set_int(settings, PROP_ERROR_LIMIT, 0);
+
+	int result = 0;
+	if (settingsPath) {
+		obs_data_t* stored = obs_data_create_from_json_file(settingsPath);
+		if (stored) {
+			obs_data_apply(settings, stored);
+			obs_data_release(stored);
+		} else {
+			printf("Unable to read settings from '%s'.\n", settingsPath);
+			result = 1;
+		}
+	}
+	for (const char* option : options) {
+		if (!ApplyOption(settings, option)) {
+			printf("Unknown option '%s'.\n", option);
+			result = 1;
+		}
+	}
+
+	VFW::Info* info = VFW::GetInfo(argv[1]);
+	if ((result == 0) && !info) {
+		printf("Unknown encoder id '%s'.\n", argv[1]);
+		result = 1;
+	}
+	if (result == 0) {
+		// Output: <Directory>/<Input Name>.avi
+		for (transcode_job_t& job : files) {
+			size_t slash = job.input.find_last_of("/\\");
+			std::string name = (slash == std::string::npos) ? job.input : job.input.substr(slash + 1);
+			job.output = std::string(argv[2]) + "/" + name + ".avi";
+		}
+
+		// Each worker takes the next file until none are left.
+		std::atomic<size_t> next(0);
+		std::vector<std::thread> workers;
+		for (size_t worker = 0; worker < min(jobs, files.size()); worker++) {
+			workers.push_back(std::thread([&]() {
+				for (size_t index = next++; index < files.size(); index = next++) {
+					try {
+						Transcode(info, files[index], settings, width, height, fpsNum, fpsDen);
+					} catch (std::exception& ex) {
+						PLOG_ERROR("Transcoding '%s' failed: %s", files[index].input.c_str(), ex.what());
+					} catch (...) {
+						PLOG_ERROR("Transcoding '%s' failed.", files[index].input.c_str());
+					}
+				}
+			}));
+		}
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+
+		for (transcode_job_t& job : files) {
+			if (!job.success) {
+				result = 1;
+				continue;
+			}
+			PLOG_INFO("Transcoded '%s' to '%s': %" PRIu64 " frames, %" PRIu64 " packets, %" PRIu64 " bytes in %0.3f s (%0.2f FPS).",
+				job.input.c_str(), job.output.c_str(), job.frames, job.packets, job.bytes, job.seconds,
+				double_t(job.frames) / max(job.seconds, 0.001));
+		}
+	}
+
+	obs_data_release(settings);
+	VFW::Finalize();
+	obs_shutdown();
+	return result;
+}